@@ -0,0 +1,66 @@
+#ifndef COMMON_ALLOC_COUNTER_H_
+#define COMMON_ALLOC_COUNTER_H_
+
+// Counts heap allocations by replacing the global operator new, in total and for the calling thread.
+// Replacement operators must be defined once per program: include this from exactly one translation unit.
+// Shared by the echo-app and filetransfer benchmarks.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace alloc_counter
+{
+std::atomic<uint64_t> gTotal{0};
+thread_local uint64_t tThread = 0;
+} // namespace alloc_counter
+
+struct AllocationCount
+{
+  uint64_t mTotal{0};  // By every thread
+  uint64_t mThread{0}; // By the calling thread
+};
+
+inline AllocationCount CountAllocations()
+{
+  return AllocationCount{alloc_counter::gTotal.load(std::memory_order_relaxed), alloc_counter::tThread};
+}
+
+void *operator new(std::size_t size)
+{
+  alloc_counter::gTotal.fetch_add(1, std::memory_order_relaxed);
+  ++alloc_counter::tThread;
+  if (void *p = std::malloc(size != 0 ? size : 1))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+#endif // COMMON_ALLOC_COUNTER_H_
@@ -0,0 +1,342 @@
+#ifndef COMMON_LOGGER_H_
+#define COMMON_LOGGER_H_
+
+// Asynchronous logging. A log statement formats its message straight into a slot of the calling thread's ring
+// buffer and publishes it with one release store; a background thread drains the rings to stdout (warnings and
+// errors to stderr) and flushes once per pass. The logging thread never takes a lock or waits on the terminal. A
+// full ring drops the message, the drops are counted and reported. Messages of one thread keep their order,
+// messages of different threads are interleaved by the drain.
+//
+//   LOG_INFO("Received " << bytes << " bytes");
+//   LOG_PROGRESS("Received: " << received);      // At most once per progress interval per call site and thread
+//   LOG_STATUS("\rDownloaded " << received);     // Same, written without a newline to rewrite the line in place
+//
+// The level defaults to info and is read from the LOG_LEVEL environment variable (debug, info, warn, error, off).
+// Shared by echo-app and filetransfer, which add common/include to their include paths.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class LogLevel : uint8_t
+{
+  DEBUG = 0,
+  INFO = 1,
+  WARN = 2,
+  ERROR = 3,
+  OFF = 4
+};
+
+class Logger
+{
+public:
+  static const size_t RING_SLOTS = 512;
+  static const size_t MAX_MESSAGE_SIZE = 240; // Longer messages are cut
+
+  static Logger &Instance()
+  {
+    static Logger sLogger;
+    return sLogger;
+  }
+
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  ~Logger()
+  {
+    mIsStopping.store(true);
+    mThread.join();
+  }
+
+  bool IsEnabled(LogLevel level) const
+  {
+    return level >= mLevel.load(std::memory_order_relaxed);
+  }
+
+  void SetLevel(LogLevel level)
+  {
+    mLevel.store(level, std::memory_order_relaxed);
+  }
+
+  void SetProgressInterval(std::chrono::milliseconds interval)
+  {
+    mProgressIntervalNanos.store(static_cast<uint64_t>(std::chrono::nanoseconds(interval).count()),
+                                 std::memory_order_relaxed);
+  }
+
+  // True at most once per progress interval for the same lastNanos, which remembers when it last was
+  bool IsProgressDue(uint64_t &lastNanos) const
+  {
+    const uint64_t now = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    if (lastNanos != 0 && now - lastNanos < mProgressIntervalNanos.load(std::memory_order_relaxed))
+    {
+      return false;
+    }
+    lastNanos = now;
+    return true;
+  }
+
+  static bool ParseLevel(const std::string &name, LogLevel &level)
+  {
+    static const std::array<const char *, 5> names{"debug", "info", "warn", "error", "off"};
+    for (size_t i = 0; i < names.size(); i++)
+    {
+      if (name == names[i])
+      {
+        level = static_cast<LogLevel>(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  struct Record
+  {
+    LogLevel mLevel;
+    bool mIsNewline;
+    size_t mSize;
+    char mText[MAX_MESSAGE_SIZE];
+  };
+
+  // Formats into a record's text, output beyond its end is dropped
+  class RecordBuffer : public std::streambuf
+  {
+  public:
+    void Reset(char *data, size_t size)
+    {
+      setp(data, data + size);
+    }
+
+    size_t Size() const
+    {
+      return static_cast<size_t>(pptr() - pbase());
+    }
+  };
+
+  // Single producer (its thread), single consumer (the drain)
+  struct Ring
+  {
+    Ring() : mStream(&mBuffer) {}
+
+    std::array<Record, RING_SLOTS> mRecords;
+    alignas(64) std::atomic<size_t> mHead{0}; // Next record the thread writes
+    alignas(64) std::atomic<size_t> mTail{0}; // Next record the drain writes out
+    std::atomic<bool> mIsThreadExited{false};
+    RecordBuffer mBuffer;
+    std::ostream mStream;
+  };
+
+public:
+  // One message being formatted into the calling thread's ring, published when it goes out of scope
+  class Line
+  {
+  public:
+    Line(Logger &logger, LogLevel level, bool isNewline) : mRing(logger.ThreadRing()), mpRecord(nullptr)
+    {
+      const size_t head = mRing.mHead.load(std::memory_order_relaxed);
+      if (head - mRing.mTail.load(std::memory_order_acquire) >= RING_SLOTS)
+      {
+        logger.mDropped.fetch_add(1, std::memory_order_relaxed);
+        mRing.mBuffer.Reset(nullptr, 0);
+      }
+      else
+      {
+        mpRecord = &mRing.mRecords[head % RING_SLOTS];
+        mpRecord->mLevel = level;
+        mpRecord->mIsNewline = isNewline;
+        mRing.mBuffer.Reset(mpRecord->mText, MAX_MESSAGE_SIZE);
+      }
+      // The stream is reused by every message of the thread, start each from the default format
+      mRing.mStream.clear();
+      mRing.mStream.flags(std::ios_base::dec | std::ios_base::skipws);
+      mRing.mStream.precision(6);
+      mRing.mStream.fill(' ');
+    }
+
+    Line(const Line &) = delete;
+    Line &operator=(const Line &) = delete;
+
+    ~Line()
+    {
+      if (mpRecord)
+      {
+        mpRecord->mSize = mRing.mBuffer.Size();
+        mRing.mHead.store(mRing.mHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+    }
+
+    std::ostream &Stream()
+    {
+      return mRing.mStream;
+    }
+
+  private:
+    Ring &mRing;
+    Record *mpRecord;
+  };
+
+private:
+  Logger()
+  {
+    if (const char *name = std::getenv("LOG_LEVEL"))
+    {
+      LogLevel level;
+      if (ParseLevel(name, level))
+      {
+        mLevel.store(level);
+      }
+    }
+    mThread = std::thread([this] { Run(); });
+  }
+
+  // Marks the thread's ring when the thread exits
+  struct RingOwner
+  {
+    ~RingOwner()
+    {
+      if (mpRing)
+      {
+        mpRing->mIsThreadExited.store(true, std::memory_order_release);
+      }
+    }
+
+    std::shared_ptr<Ring> mpRing;
+  };
+
+  // Created and registered on the thread's first message; it stays registered after the thread exits until it
+  // has been drained
+  Ring &ThreadRing()
+  {
+    thread_local RingOwner tOwner;
+    if (!tOwner.mpRing)
+    {
+      tOwner.mpRing = std::make_shared<Ring>();
+      std::lock_guard<std::mutex> lock(mMutex);
+      mRings.push_back(tOwner.mpRing);
+    }
+    return *tOwner.mpRing;
+  }
+
+  void Run()
+  {
+    bool isStopping = false;
+    while (!isStopping)
+    {
+      isStopping = mIsStopping.load();
+      if (!Drain() && !isStopping)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }
+  }
+
+  // Writes out what every ring holds, returns whether there was anything
+  bool Drain()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mDraining = mRings; // Reuses its capacity, the drain doesn't allocate once every thread has logged
+    }
+
+    bool isWritten = false;
+    for (const auto &pRing : mDraining)
+    {
+      Ring &ring = *pRing;
+      const size_t head = ring.mHead.load(std::memory_order_acquire);
+      size_t tail = ring.mTail.load(std::memory_order_relaxed);
+      for (; tail != head; tail++)
+      {
+        const Record &record = ring.mRecords[tail % RING_SLOTS];
+        std::ostream &out = record.mLevel >= LogLevel::WARN ? std::cerr : std::cout;
+        out.write(record.mText, static_cast<std::streamsize>(record.mSize));
+        if (record.mIsNewline)
+        {
+          out.put('\n');
+        }
+        isWritten = true;
+      }
+      ring.mTail.store(tail, std::memory_order_release);
+    }
+
+    const uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+    if (dropped != mReportedDropped)
+    {
+      std::cerr << "Logger: " << dropped - mReportedDropped << " messages dropped" << std::endl;
+      mReportedDropped = dropped;
+    }
+    if (isWritten)
+    {
+      std::cout.flush();
+    }
+
+    // Exited threads don't write anymore, their rings go once drained
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto it = mRings.begin(); it != mRings.end();)
+    {
+      if ((*it)->mIsThreadExited.load(std::memory_order_acquire) &&
+          (*it)->mHead.load(std::memory_order_acquire) == (*it)->mTail.load(std::memory_order_relaxed))
+      {
+        it = mRings.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+    return isWritten;
+  }
+
+  std::atomic<LogLevel> mLevel{LogLevel::INFO};
+  std::atomic<uint64_t> mProgressIntervalNanos{250000000};
+  std::atomic<uint64_t> mDropped{0};
+  uint64_t mReportedDropped{0}; // Only used by the drain
+  std::mutex mMutex; // Guards mRings, taken when a thread logs for the first time and by the drain
+  std::vector<std::shared_ptr<Ring>> mRings;
+  std::vector<std::shared_ptr<Ring>> mDraining; // Copy of mRings the drain works on without the lock
+  std::atomic<bool> mIsStopping{false};
+  std::thread mThread;
+};
+
+#define LOG_AT(level, isNewline, message)                                                                        \
+  do                                                                                                             \
+  {                                                                                                              \
+    Logger &logger_ = Logger::Instance();                                                                        \
+    if (logger_.IsEnabled(level))                                                                                \
+    {                                                                                                            \
+      Logger::Line line_(logger_, level, isNewline);                                                             \
+      line_.Stream() << message;                                                                                 \
+    }                                                                                                            \
+  } while (0)
+
+#define LOG_DEBUG(message) LOG_AT(LogLevel::DEBUG, true, message)
+#define LOG_INFO(message) LOG_AT(LogLevel::INFO, true, message)
+#define LOG_WARN(message) LOG_AT(LogLevel::WARN, true, message)
+#define LOG_ERROR(message) LOG_AT(LogLevel::ERROR, true, message)
+
+#define LOG_RATE_LIMITED(isNewline, message)                                                                     \
+  do                                                                                                             \
+  {                                                                                                              \
+    thread_local uint64_t lastNanos_ = 0;                                                                        \
+    Logger &progressLogger_ = Logger::Instance();                                                                \
+    if (progressLogger_.IsEnabled(LogLevel::INFO) && progressLogger_.IsProgressDue(lastNanos_))                  \
+    {                                                                                                            \
+      LOG_AT(LogLevel::INFO, isNewline, message);                                                                \
+    }                                                                                                            \
+  } while (0)
+
+#define LOG_PROGRESS(message) LOG_RATE_LIMITED(true, message)
+#define LOG_STATUS(message) LOG_RATE_LIMITED(false, message)
+
+#endif // COMMON_LOGGER_H_
@@ -0,0 +1,293 @@
+#ifndef ECHO_APP_CALLBACK_ECHO_SERVER_H_
+#define ECHO_APP_CALLBACK_ECHO_SERVER_H_
+
+// Echo server engine in completion handler style: every step binds the next handler to the session through
+// shared_from_this. CallbackEchoServer accepts on one io_context; EchoServerPool runs it on several threads in one
+// of the ExecutionModels.
+
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include "logger.h"
+#include "pipelined_echo_session.h"
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+
+class CallbackEchoSession : public std::enable_shared_from_this<CallbackEchoSession> {
+public:
+  // The session's handlers run on executor, a strand keeps them off each other on a shared io_context
+  explicit CallbackEchoSession(const ba::any_io_executor& executor)
+    : mSocket(executor)
+  {}
+
+  bai::tcp::socket& Socket()
+  {
+    return mSocket;
+  }
+
+  void Start()
+  {
+    // Kept for the log, the socket no longer knows its peer once the connection is gone
+    boost::system::error_code ignored;
+    mRemoteEndpoint = mSocket.remote_endpoint(ignored);
+    ba::async_read_until(mSocket, mBuffer, '\n',
+      std::bind(&CallbackEchoSession::HandleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+  }
+
+private:
+  bai::tcp::socket mSocket;
+  bai::tcp::endpoint mRemoteEndpoint;
+  ba::streambuf mBuffer;
+  std::string mMessage; // Being echoed
+
+  void HandleRead(const boost::system::error_code& error, size_t bytesTransferred)
+  {
+    if (!error)
+    {
+      // The line is copied out of the buffer before the write, whose handler may already run on another thread
+      // and read into it again; mMessage outlives the write, which only references it
+      mMessage.assign(ba::buffer_cast<const char*>(mBuffer.data()), bytesTransferred);
+      mBuffer.consume(bytesTransferred);
+      const std::string& message = mMessage;
+      LOG_DEBUG("Received: " << message << " Thread: " << std::this_thread::get_id());
+      // std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      ba::async_write(mSocket, ba::buffer(message),
+        std::bind(&CallbackEchoSession::HandleWrite, shared_from_this(), std::placeholders::_1, std::placeholders::_2, message));
+    }
+    else if (error == ba::error::eof)
+    {
+      LOG_INFO("Client connection has been closed (EOF): " << mRemoteEndpoint);
+    }
+    else
+    {
+      LOG_ERROR("Read failure (" << mRemoteEndpoint << "): " << error.message());
+    }
+  }
+
+  void HandleWrite(const boost::system::error_code& error, size_t bytesTransferred, std::string message)
+  {
+    if (!error)
+    {
+      LOG_DEBUG("Send: " << message);
+
+      ba::async_read_until(mSocket, mBuffer, '\n',
+        std::bind(&CallbackEchoSession::HandleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+    }
+    else
+    {
+      LOG_ERROR("Write failure (" << mRemoteEndpoint << "): " << error.message());
+    }
+  }
+};
+
+// Lets several sockets bind the same port, the kernel spreads incoming connections over them
+using reuse_port = ba::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+struct CallbackEchoServerOptions
+{
+  bool mIsReusePort{false};         // Bind with SO_REUSEPORT, next to other acceptors of the port
+  bool mIsStrandPerSession{false};  // Run each session's handlers through its own strand
+  bool mIsPipelined{false};         // Serve with PipelinedEchoSession, always on a strand
+  std::vector<ba::io_context*> mSessionContexts; // Hand accepted connections out round-robin over these
+};
+
+class CallbackEchoServer
+{
+public:
+  CallbackEchoServer(ba::io_context& context, unsigned short port,
+                     CallbackEchoServerOptions options = CallbackEchoServerOptions())
+    : mContext(context), mAcceptor(context), mOptions(std::move(options))
+  {
+    bai::tcp::endpoint endpoint(bai::tcp::v4(), port);
+    mAcceptor.open(endpoint.protocol());
+    mAcceptor.set_option(bai::tcp::acceptor::reuse_address(true));
+    if (mOptions.mIsReusePort)
+    {
+      mAcceptor.set_option(reuse_port(true));
+    }
+    mAcceptor.bind(endpoint);
+    mAcceptor.listen();
+    StartAccept();
+  }
+
+  unsigned short LocalPort() const
+  {
+    return mAcceptor.local_endpoint().port();
+  }
+
+  void StartAccept()
+  {
+    ba::io_context& sessionContext = mOptions.mSessionContexts.empty()
+      ? mContext : *mOptions.mSessionContexts[mNextSessionContext++ % mOptions.mSessionContexts.size()];
+    if (mOptions.mIsPipelined)
+    {
+      // Its read and write overlap
+      Accept(std::make_shared<PipelinedEchoSession>(ba::make_strand(sessionContext)));
+    }
+    else if (mOptions.mIsStrandPerSession)
+    {
+      Accept(std::make_shared<CallbackEchoSession>(ba::make_strand(sessionContext)));
+    }
+    else
+    {
+      Accept(std::make_shared<CallbackEchoSession>(sessionContext.get_executor()));
+    }
+  }
+
+  template <typename SessionT>
+  void Accept(std::shared_ptr<SessionT> session)
+  {
+    mAcceptor.async_accept(session->Socket(),
+      std::bind(&CallbackEchoServer::HandleAccept<SessionT>, this, session, std::placeholders::_1));
+  }
+
+  template <typename SessionT>
+  void HandleAccept(std::shared_ptr<SessionT> session,
+                    const boost::system::error_code& error)
+  {
+    if (!error)
+    {
+      boost::system::error_code ignored;
+      LOG_INFO("New connection has been accepted: " << session->Socket().remote_endpoint(ignored));
+      // Started on its own executor, which may be a strand or another thread's context
+      ba::post(session->Socket().get_executor(), [session]() { session->Start(); });
+    }
+    else if (error == ba::error::operation_aborted)
+    {
+      return; // Acceptor closed
+    }
+    else
+    {
+      LOG_ERROR("Accept error: " << error.message());
+    }
+
+    StartAccept();
+  }
+
+private:
+  ba::io_context& mContext;
+  bai::tcp::acceptor mAcceptor;
+  CallbackEchoServerOptions mOptions;
+  size_t mNextSessionContext{0};
+};
+
+enum class ExecutionModel : uint8_t
+{
+  SHARED_STRAND = 0,      // Every thread runs one io_context, each session runs on its own strand
+  CONTEXT_PER_THREAD = 1, // Every thread runs its own io_context, one acceptor hands sessions out round-robin
+  REUSE_PORT = 2          // Every thread runs its own io_context with its own SO_REUSEPORT acceptor
+};
+
+// Runs CallbackEchoServer on several threads in one of the execution models
+class EchoServerPool
+{
+public:
+  EchoServerPool(ExecutionModel model, size_t threads, unsigned short port, bool isPipelined = false)
+  {
+    threads = std::max<size_t>(threads, 1);
+    const size_t contexts = model == ExecutionModel::SHARED_STRAND ? 1 : threads;
+    for (size_t i = 0; i < contexts; i++)
+    {
+      // A context run by a single thread doesn't need to lock its queue
+      mContexts.push_back(std::make_unique<ba::io_context>(contexts == 1 ? static_cast<int>(threads) : 1));
+    }
+
+    CallbackEchoServerOptions options;
+    options.mIsPipelined = isPipelined;
+    switch (model)
+    {
+      case ExecutionModel::SHARED_STRAND:
+        options.mIsStrandPerSession = true;
+        mServers.push_back(std::make_unique<CallbackEchoServer>(*mContexts.front(), port, options));
+        break;
+      case ExecutionModel::CONTEXT_PER_THREAD:
+        for (auto& context : mContexts)
+        {
+          options.mSessionContexts.push_back(context.get());
+        }
+        mServers.push_back(std::make_unique<CallbackEchoServer>(*mContexts.front(), port, options));
+        break;
+      case ExecutionModel::REUSE_PORT:
+        options.mIsReusePort = true;
+        for (auto& context : mContexts)
+        {
+          // Port 0 picks an ephemeral port for the first acceptor, the others join it
+          mServers.push_back(std::make_unique<CallbackEchoServer>(
+            *context, mServers.empty() ? port : mServers.front()->LocalPort(), options));
+        }
+        break;
+    }
+    for (auto& context : mContexts)
+    {
+      mWork.push_back(ba::make_work_guard(*context));
+    }
+
+    for (size_t i = 0; i < threads; i++)
+    {
+      ba::io_context& context = *mContexts[i % mContexts.size()];
+      mThreads.emplace_back([&context] { context.run(); });
+    }
+  }
+
+  ~EchoServerPool()
+  {
+    Stop();
+  }
+
+  unsigned short LocalPort() const
+  {
+    return mServers.front()->LocalPort();
+  }
+
+  void Join()
+  {
+    for (auto& thread : mThreads)
+    {
+      thread.join();
+    }
+    mThreads.clear();
+  }
+
+  void Stop()
+  {
+    mWork.clear();
+    for (auto& context : mContexts)
+    {
+      context->stop();
+    }
+    Join();
+  }
+
+  static bool ParseModel(const std::string& name, ExecutionModel& model)
+  {
+    if (name == "strand")
+    {
+      model = ExecutionModel::SHARED_STRAND;
+    }
+    else if (name == "context-per-thread")
+    {
+      model = ExecutionModel::CONTEXT_PER_THREAD;
+    }
+    else if (name == "reuseport")
+    {
+      model = ExecutionModel::REUSE_PORT;
+    }
+    else
+    {
+      return false;
+    }
+    return true;
+  }
+
+private:
+  std::vector<std::unique_ptr<ba::io_context>> mContexts;
+  std::vector<ba::executor_work_guard<ba::io_context::executor_type>> mWork;
+  std::vector<std::unique_ptr<CallbackEchoServer>> mServers;
+  std::vector<std::thread> mThreads;
+};
+
+#endif // ECHO_APP_CALLBACK_ECHO_SERVER_H_
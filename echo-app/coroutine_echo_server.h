@@ -0,0 +1,97 @@
+#ifndef ECHO_APP_COROUTINE_ECHO_SERVER_H_
+#define ECHO_APP_COROUTINE_ECHO_SERVER_H_
+
+// Echo server engine written as C++20 coroutines: one coroutine accepts, one per connection reads a line and
+// writes it back in a plain loop. The coroutine frame holds the session state, so nothing is reference counted
+// per operation. Errors come back as error codes (redirect_error), a closing client doesn't throw. Accepts and
+// serves on whatever threads run the io_context.
+
+#include <string>
+#include <string_view>
+#include <utility> // Boost 1.74's awaitable.hpp uses std::exchange without including it, before any Asio header
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include "logger.h"
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+
+class CoroutineEchoServer
+{
+public:
+  CoroutineEchoServer(ba::io_context& context, unsigned short port)
+    : mAcceptor(context, bai::tcp::endpoint(bai::tcp::v4(), port))
+  {
+    ba::co_spawn(mAcceptor.get_executor(), Accept(), ba::detached);
+  }
+
+  unsigned short LocalPort() const
+  {
+    return mAcceptor.local_endpoint().port();
+  }
+
+private:
+  ba::awaitable<void> Accept()
+  {
+    while (true)
+    {
+      boost::system::error_code error;
+      bai::tcp::socket socket = co_await mAcceptor.async_accept(ba::redirect_error(ba::use_awaitable, error));
+      if (error == ba::error::operation_aborted)
+      {
+        co_return; // Acceptor closed
+      }
+      if (error)
+      {
+        LOG_ERROR("Accept error: " << error.message());
+        continue;
+      }
+      boost::system::error_code ignored;
+      LOG_INFO("New connection has been accepted: " << socket.remote_endpoint(ignored));
+      auto executor = socket.get_executor();
+      ba::co_spawn(executor, Echo(std::move(socket)), ba::detached);
+    }
+  }
+
+  static ba::awaitable<void> Echo(bai::tcp::socket socket)
+  {
+    // Kept for the log, the socket no longer knows its peer once the connection is gone
+    boost::system::error_code error;
+    const bai::tcp::endpoint remoteEndpoint = socket.remote_endpoint(error);
+    std::string buffer; // Bytes read past the line stay in it for the next one
+    while (true)
+    {
+      const size_t length = co_await ba::async_read_until(socket, ba::dynamic_buffer(buffer), '\n',
+                                                          ba::redirect_error(ba::use_awaitable, error));
+      if (error == ba::error::eof)
+      {
+        LOG_INFO("Client connection has been closed (EOF): " << remoteEndpoint);
+        co_return;
+      }
+      if (error)
+      {
+        LOG_ERROR("Read failure (" << remoteEndpoint << "): " << error.message());
+        co_return;
+      }
+      const std::string_view message(buffer.data(), length);
+      LOG_DEBUG("Received: " << message);
+
+      co_await ba::async_write(socket, ba::buffer(message), ba::redirect_error(ba::use_awaitable, error));
+      if (error)
+      {
+        LOG_ERROR("Write failure (" << remoteEndpoint << "): " << error.message());
+        co_return;
+      }
+      LOG_DEBUG("Send: " << message);
+      buffer.erase(0, length);
+    }
+  }
+
+  bai::tcp::acceptor mAcceptor;
+};
+
+#endif // ECHO_APP_COROUTINE_ECHO_SERVER_H_
@@ -0,0 +1,239 @@
+// Compares the echo server engines under the same load: the completion handler server of
+// echo_server_async_multithreaded, with plain or pipelined sessions, and the coroutine server of
+// echo_server_coroutine. Each runs in process on its own thread pool, clients from load_client.h keep requests in
+// flight against it, and the report gives throughput, per-message latency and the heap allocations the server makes
+// per message (every allocation in the process minus the client threads' own, counted by replacing operator new).
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <future>
+#include <utility> // Before Asio, see coroutine_echo_server.h
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include "alloc_counter.h"
+#include "load_client.h"
+#include "callback_echo_server.h"
+#include "coroutine_echo_server.h"
+
+namespace po = boost::program_options;
+
+namespace
+{
+
+struct BenchConfig
+{
+  size_t mServerThreads{4};
+  size_t mConnections{16};
+  size_t mClientThreads{1};
+  double mDurationSeconds{5};
+  double mWarmupSeconds{1};
+  LoadConfig mLoad;
+};
+
+struct EngineResult
+{
+  std::string mEngine;
+  double mSeconds{0.0};
+  WorkerStats mTotal;
+  uint64_t mServerAllocations{0};
+};
+
+// The completion handler server with pipelined sessions, constructed like the other engines
+class PipelinedEchoServer : public CallbackEchoServer
+{
+public:
+  PipelinedEchoServer(ba::io_context& context, unsigned short port)
+    : CallbackEchoServer(context, port, PipelinedOptions())
+  {}
+
+private:
+  static CallbackEchoServerOptions PipelinedOptions()
+  {
+    CallbackEchoServerOptions options;
+    options.mIsPipelined = true;
+    return options;
+  }
+};
+
+// Allocations made so far by the worker's thread
+uint64_t WorkerAllocations(Worker& worker)
+{
+  std::promise<uint64_t> count;
+  ba::post(worker.Context(), [&count] { count.set_value(CountAllocations().mThread); });
+  return count.get_future().get();
+}
+
+// Allocations made so far by every thread but the clients'
+uint64_t ServerAllocations(std::vector<std::unique_ptr<Worker>>& workers)
+{
+  uint64_t clients = 0;
+  for (auto& worker : workers)
+  {
+    clients += WorkerAllocations(*worker);
+  }
+  return CountAllocations().mTotal - clients;
+}
+
+template <typename ServerT>
+EngineResult RunEngine(const std::string& name, const BenchConfig& config)
+{
+  ba::io_context serverContext;
+  ServerT server(serverContext, 0);
+  std::vector<std::thread> serverThreads;
+  for (size_t i = 0; i < config.mServerThreads; i++)
+  {
+    serverThreads.emplace_back([&serverContext] { serverContext.run(); });
+  }
+
+  const size_t clientThreads = std::min(config.mClientThreads, config.mConnections);
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::vector<std::shared_ptr<Connection>>> workerConnections(clientThreads);
+  std::atomic<bool> isMeasuring{false};
+  for (size_t i = 0; i < clientThreads; i++)
+  {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  bai::tcp::resolver resolver(workers[0]->Context());
+  auto endpoints = resolver.resolve("127.0.0.1", std::to_string(server.LocalPort()));
+  for (size_t i = 0; i < config.mConnections; i++)
+  {
+    Worker& worker = *workers[i % clientThreads];
+    auto connection = std::make_shared<Connection>(worker.Context(), config.mLoad, worker.Stats(), isMeasuring);
+    connection->Start(endpoints, i);
+    workerConnections[i % clientThreads].push_back(connection);
+  }
+  for (auto& worker : workers)
+  {
+    worker->Run();
+  }
+
+  EngineResult result;
+  result.mEngine = name;
+  std::this_thread::sleep_for(std::chrono::duration<double>(config.mWarmupSeconds));
+  const uint64_t allocationsBefore = ServerAllocations(workers);
+  isMeasuring = true;
+  const auto start = Clock::now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(config.mDurationSeconds));
+  isMeasuring = false;
+  result.mSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+  result.mServerAllocations = ServerAllocations(workers) - allocationsBefore;
+
+  for (size_t i = 0; i < clientThreads; i++)
+  {
+    workers[i]->Stop(workerConnections[i]);
+    const WorkerStats& stats = workers[i]->Stats();
+    result.mTotal.mLatency.Add(stats.mLatency);
+    result.mTotal.mResponses += stats.mResponses;
+    result.mTotal.mBytes += stats.mBytes;
+    result.mTotal.mErrors += stats.mErrors;
+  }
+  serverContext.stop();
+  for (auto& thread : serverThreads)
+  {
+    thread.join();
+  }
+  return result;
+}
+
+void PrintResults(const std::vector<EngineResult>& results)
+{
+  std::cout << std::fixed << std::setw(11) << "engine" << std::setw(14) << "requests/s" << std::setw(10) << "MiB/s"
+            << std::setw(10) << "p50_us" << std::setw(10) << "p99_us" << std::setw(10) << "p99.9_us" << std::setw(10)
+            << "max_us" << std::setw(12) << "allocs/msg" << std::setw(8) << "errors" << std::endl;
+  for (const EngineResult& result : results)
+  {
+    const WorkerStats& total = result.mTotal;
+    const double responses = static_cast<double>(std::max<uint64_t>(total.mResponses, 1));
+    std::cout << std::setw(11) << result.mEngine << std::setprecision(0) << std::setw(14)
+              << total.mResponses / result.mSeconds << std::setprecision(1) << std::setw(10)
+              << total.mBytes / result.mSeconds / (1024 * 1024) << std::setw(10) << total.mLatency.Percentile(50) / 1e3
+              << std::setw(10) << total.mLatency.Percentile(99) / 1e3 << std::setw(10)
+              << total.mLatency.Percentile(99.9) / 1e3 << std::setw(10) << total.mLatency.Max() / 1e3
+              << std::setprecision(2) << std::setw(12) << result.mServerAllocations / responses << std::setw(8)
+              << total.mErrors << std::endl;
+  }
+  std::cout << std::defaultfloat;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    BenchConfig config;
+    std::vector<std::string> engines;
+    size_t size = 0;
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("engines", po::value<std::vector<std::string>>(&engines)->multitoken()->default_value({"callback", "pipelined", "coroutine"}, "callback pipelined coroutine"),
+       "Server engines to run, in turn: callback, pipelined (callback with pipelined sessions), coroutine")
+      ("server-threads", po::value<size_t>(&config.mServerThreads)->default_value(config.mServerThreads),
+       "Threads running the server's io_context")
+      ("connections,c", po::value<size_t>(&config.mConnections)->default_value(config.mConnections),
+       "Connections to the server")
+      ("client-threads,t", po::value<size_t>(&config.mClientThreads)->default_value(config.mClientThreads),
+       "Threads the connections are spread over, each with its own io_context")
+      ("depth", po::value<size_t>(&config.mLoad.mDepth)->default_value(config.mLoad.mDepth),
+       "Requests in flight per connection")
+      ("size", po::value<size_t>(&size)->default_value(64), "Message size in bytes, newline included")
+      ("duration", po::value<double>(&config.mDurationSeconds)->default_value(config.mDurationSeconds),
+       "Seconds measured per engine")
+      ("warmup", po::value<double>(&config.mWarmupSeconds)->default_value(config.mWarmupSeconds),
+       "Seconds of load before measuring");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || config.mServerThreads == 0 || config.mConnections == 0 || config.mClientThreads == 0)
+    {
+      std::cerr << "Usage: " << argv[0] << " [options]\n" << options << "\n";
+      return 1;
+    }
+    config.mLoad.mDepth = std::max<size_t>(config.mLoad.mDepth, 1);
+    config.mLoad.mMessages.push_back(std::string(std::max<size_t>(size, 1) - 1, 'x') + "\n");
+    // Connection messages of the servers aren't part of the measurement
+    Logger::Instance().SetLevel(LogLevel::WARN);
+
+    std::cout << "Load: " << config.mConnections << " connections on " << config.mClientThreads << " threads, "
+              << config.mLoad.mDepth << " in flight each, " << size << " byte messages; server on "
+              << config.mServerThreads << " threads" << std::endl;
+
+    std::vector<EngineResult> results;
+    for (const std::string& engine : engines)
+    {
+      if (engine == "callback")
+      {
+        results.push_back(RunEngine<CallbackEchoServer>(engine, config));
+      }
+      else if (engine == "pipelined")
+      {
+        results.push_back(RunEngine<PipelinedEchoServer>(engine, config));
+      }
+      else if (engine == "coroutine")
+      {
+        results.push_back(RunEngine<CoroutineEchoServer>(engine, config));
+      }
+      else
+      {
+        std::cerr << "Unknown engine: " << engine << std::endl;
+        return 1;
+      }
+    }
+    PrintResults(results);
+  }
+  catch (const std::exception& error)
+  {
+    std::cerr << "Benchmark error: " << error.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,136 @@
+// Load generator for the echo servers: N connections spread over M threads, each thread with its own io_context.
+// Closed loop keeps a fixed number of requests in flight per connection and measures from each send. Open loop
+// sends at a fixed overall rate and measures from when each request was due, so a stalled server shows up as
+// latency instead of quietly lowering the offered load (coordinated omission).
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include "load_client.h"
+
+namespace po = boost::program_options;
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    std::string host;
+    std::string port;
+    size_t connections = 0;
+    size_t threads = 0;
+    std::string mode;
+    double rate = 0;
+    std::vector<size_t> sizes;
+    double durationSeconds = 0;
+    double warmupSeconds = 0;
+    LoadConfig config;
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("host", po::value<std::string>(&host)->default_value("127.0.0.1"), "Server address")
+      ("port", po::value<std::string>(&port)->default_value("12345"), "Server port")
+      ("connections,c", po::value<size_t>(&connections)->default_value(16), "Connections to the server")
+      ("threads,t", po::value<size_t>(&threads)->default_value(std::max(1u, std::thread::hardware_concurrency())),
+       "Threads the connections are spread over, each with its own io_context")
+      ("mode", po::value<std::string>(&mode)->default_value("closed"),
+       "closed: keep --depth requests in flight per connection, open: send --rate requests per second")
+      ("depth", po::value<size_t>(&config.mDepth)->default_value(config.mDepth),
+       "Closed loop: requests in flight per connection (1 = ping-pong, more pipelines them)")
+      ("rate", po::value<double>(&rate)->default_value(10000), "Open loop: requests per second over all connections")
+      ("sizes", po::value<std::vector<size_t>>(&sizes)->multitoken()->default_value({64}, "64"),
+       "Message sizes in bytes, newline included, used in turn")
+      ("duration", po::value<double>(&durationSeconds)->default_value(10), "Seconds measured")
+      ("warmup", po::value<double>(&warmupSeconds)->default_value(1), "Seconds of load before measuring");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || (mode != "closed" && mode != "open") || connections == 0 || threads == 0 ||
+        sizes.empty() || (mode == "open" && rate <= 0))
+    {
+      std::cerr << "Usage: " << argv[0] << " [options]\n" << options << "\n";
+      return 1;
+    }
+
+    config.mIsOpenLoop = mode == "open";
+    config.mDepth = std::max<size_t>(config.mDepth, 1);
+    config.mRatePerConnection = rate / connections;
+    for (size_t size : sizes)
+    {
+      config.mMessages.push_back(std::string(std::max<size_t>(size, 1) - 1, 'x') + "\n");
+    }
+
+    threads = std::min(threads, connections);
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::vector<std::shared_ptr<Connection>>> workerConnections(threads);
+    std::atomic<bool> isMeasuring{false};
+    for (size_t i = 0; i < threads; i++)
+    {
+      workers.push_back(std::make_unique<Worker>());
+    }
+
+    bai::tcp::resolver resolver(workers[0]->Context());
+    auto endpoints = resolver.resolve(host, port);
+    for (size_t i = 0; i < connections; i++)
+    {
+      Worker& worker = *workers[i % threads];
+      auto connection = std::make_shared<Connection>(worker.Context(), config, worker.Stats(), isMeasuring);
+      connection->Start(endpoints, i);
+      workerConnections[i % threads].push_back(connection);
+    }
+
+    std::cout << "Load: " << connections << " connections on " << threads << " threads, "
+              << (config.mIsOpenLoop ? "open loop at " + std::to_string(static_cast<uint64_t>(rate)) + " requests/s"
+                                     : "closed loop with " + std::to_string(config.mDepth) + " in flight each")
+              << std::endl;
+
+    for (auto& worker : workers)
+    {
+      worker->Run();
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(warmupSeconds));
+    isMeasuring = true;
+    const auto start = Clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(durationSeconds));
+    isMeasuring = false;
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    WorkerStats total;
+    for (size_t i = 0; i < threads; i++)
+    {
+      workers[i]->Stop(workerConnections[i]);
+      const WorkerStats& stats = workers[i]->Stats();
+      total.mLatency.Add(stats.mLatency);
+      total.mResponses += stats.mResponses;
+      total.mBytes += stats.mBytes;
+      total.mErrors += stats.mErrors;
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "Requests: " << total.mResponses << " in " << seconds << " s, " << total.mResponses / seconds
+              << " requests/s, " << total.mBytes / seconds / (1024 * 1024) << " MiB/s echoed, errors: "
+              << total.mErrors << std::endl;
+    std::cout << "Latency (us): min " << total.mLatency.Min() / 1e3 << " mean " << total.mLatency.Mean() / 1e3
+              << " max " << total.mLatency.Max() / 1e3 << std::endl;
+    std::cout << std::setw(12) << "percentile" << std::setw(14) << "latency_us" << std::endl;
+    for (double percentile : {50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 99.999, 100.0})
+    {
+      std::cout << std::setw(12) << std::setprecision(3) << percentile << std::setw(14) << std::setprecision(1)
+                << total.mLatency.Percentile(percentile) / 1e3 << std::endl;
+    }
+  }
+  catch (const std::exception& error)
+  {
+    std::cout << "Load generator error: " << error.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -2,6 +2,7 @@
 #include <string>
 #include <memory>
 #include <boost/asio.hpp>
+#include "logger.h"
 
 namespace ba = boost::asio;
 namespace bai = boost::asio::ip;
@@ -19,33 +20,40 @@ public:
 
   void Start()
   {
+    // Kept for the log, the socket no longer knows its peer once the connection is gone
+    boost::system::error_code ignored;
+    mRemoteEndpoint = mSocket.remote_endpoint(ignored);
     ba::async_read_until(mSocket, mBuffer, '\n',
       std::bind(&Session::HandleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
   }
 
 private:
   bai::tcp::socket mSocket;
+  bai::tcp::endpoint mRemoteEndpoint;
   ba::streambuf mBuffer;
+  std::string mMessage; // Being echoed
 
   void HandleRead(const boost::system::error_code& error, size_t bytesTransferred)
   {
     if (!error)
     {
-      std::string message = ba::buffer_cast<const char*>(mBuffer.data());
-      std::cout << "Received: " << message << std::endl;
+      // The line is copied out of the buffer before the write, whose handler may already run on another thread
+      // and read into it again; mMessage outlives the write, which only references it
+      mMessage.assign(ba::buffer_cast<const char*>(mBuffer.data()), bytesTransferred);
+      mBuffer.consume(bytesTransferred);
+      const std::string& message = mMessage;
+      LOG_DEBUG("Received: " << message);
 
       ba::async_write(mSocket, ba::buffer(message),
         std::bind(&Session::HandleWrite, shared_from_this(), std::placeholders::_1, std::placeholders::_2, message));
-
-      mBuffer.consume(bytesTransferred);
     }
     else if (error == ba::error::eof)
     {
-      std::cout << "Client connection has been closed (EOF): " << mSocket.remote_endpoint() << std::endl; 
+      LOG_INFO("Client connection has been closed (EOF): " << mRemoteEndpoint);
     }
     else
     {
-      std::cout << "Read failure (" << mSocket.remote_endpoint() << "): " << error.message() << std::endl;
+      LOG_ERROR("Read failure (" << mRemoteEndpoint << "): " << error.message());
     }
   }
 
@@ -53,14 +61,14 @@ private:
   {
     if (!error)
     {
-      std::cout << "Send: " << message << std::endl;
+      LOG_DEBUG("Send: " << message);
 
       ba::async_read_until(mSocket, mBuffer, '\n',
         std::bind(&Session::HandleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
     }
     else
     {
-      std::cout << "Write failure (" << mSocket.remote_endpoint() << "): " << error.message() << std::endl;
+      LOG_ERROR("Write failure (" << mRemoteEndpoint << "): " << error.message());
     }
   }
 };
@@ -86,12 +94,12 @@ public:
   {
     if (!error)
     {
-      std::cout << "New connection has been accepted: " << session->Socket().remote_endpoint() << std::endl;
+      LOG_INFO("New connection has been accepted: " << session->Socket().remote_endpoint());
       session->Start();
     }
     else
     {
-      std::cout << "Accept error: " << error.message() << std::endl;
+      LOG_ERROR("Accept error: " << error.message());
     }
 
     StartAccept();
@@ -110,12 +118,12 @@ int main()
     ba::io_context context;
     Server s(context, 12345);
 
-    std::cout << "Async server is listening Port 12345" << std::endl;
+    LOG_INFO("Async server is listening Port 12345");
     context.run();
   }
   catch (const boost::system::system_error& error)
   {
-    std::cout << "Server error: " << error.what() << std::endl;
+    LOG_ERROR("Server error: " << error.what());
   }
   return 0;
 }
\ No newline at end of file
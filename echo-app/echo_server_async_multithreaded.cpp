@@ -2,134 +2,55 @@
 #include <string>
 #include <memory>
 #include <thread>
-#include <chrono>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include "callback_echo_server.h"
 
-namespace ba = boost::asio;
-namespace bai = boost::asio::ip;
+namespace po = boost::program_options;
 
-class Session : public std::enable_shared_from_this<Session> {
-public:
-  Session(ba::io_context& context)
-    : mSocket(context)
-  {}
-
-  bai::tcp::socket& Socket()
-  {
-    return mSocket;
-  }
-
-  void Start()
-  {
-    ba::async_read_until(mSocket, mBuffer, '\n',
-      std::bind(&Session::HandleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-  }
-
-private:
-  bai::tcp::socket mSocket;
-  ba::streambuf mBuffer;
-
-  void HandleRead(const boost::system::error_code& error, size_t bytesTransferred)
-  {
-    if (!error)
-    {
-      std::string message = ba::buffer_cast<const char*>(mBuffer.data());
-      std::cout << "Received: " << message << " Thread: " << std::this_thread::get_id() <<std::endl;
-      // std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      ba::async_write(mSocket, ba::buffer(message),
-        std::bind(&Session::HandleWrite, shared_from_this(), std::placeholders::_1, std::placeholders::_2, message));
-
-      mBuffer.consume(bytesTransferred);
-    }
-    else if (error == ba::error::eof)
-    {
-      std::cout << "Client connection has been closed (EOF): " << mSocket.remote_endpoint() << std::endl; 
-    }
-    else
-    {
-      std::cout << "Read failure (" << mSocket.remote_endpoint() << "): " << error.message() << std::endl;
-    }
-  }
-
-  void HandleWrite(const boost::system::error_code& error, size_t bytesTransferred, std::string message)
-  {
-    if (!error)
-    {
-      std::cout << "Send: " << message << std::endl;
-
-      ba::async_read_until(mSocket, mBuffer, '\n',
-        std::bind(&Session::HandleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-    }
-    else
-    {
-      std::cout << "Write failure (" << mSocket.remote_endpoint() << "): " << error.message() << std::endl;
-    }
-  }
-};
-
-class Server
+int main(int argc, char* argv[])
 {
-public:
-  Server(ba::io_context& context, int port)
-    : mContext(context), mAcceptor(context, bai::tcp::endpoint(bai::tcp::v4(), 12345))
+  try
   {
-    StartAccept();
-  }
+    unsigned short port = 12345;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string modelName = "strand";
+    bool isPipelined = false;
 
-  void StartAccept()
-  {
-    auto session = std::make_shared<Session>(mContext);
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("port", po::value<unsigned short>(&port)->default_value(port), "Port to listen on")
+      ("threads", po::value<size_t>(&threads)->default_value(threads), "Threads serving the connections")
+      ("model", po::value<std::string>(&modelName)->default_value(modelName),
+       "strand: one io_context run by every thread, a strand per session; context-per-thread: an io_context per "
+       "thread, one acceptor handing out connections round-robin; reuseport: an io_context and an SO_REUSEPORT "
+       "acceptor per thread")
+      ("pipelined", po::bool_switch(&isPipelined),
+       "Echo every complete line of a read in one write and keep reading while it is in flight, instead of one "
+       "line per read and write");
 
-    mAcceptor.async_accept(session->Socket(), std::bind(&Server::HandleAccept, this, session, std::placeholders::_1));
-  }
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
 
-  void HandleAccept(std::shared_ptr<Session> session,
-                    const boost::system::error_code& error)
-  {
-    if (!error)
-    {
-      std::cout << "New connection has been accepted: " << session->Socket().remote_endpoint() << std::endl;
-      session->Start();
-    }
-    else
+    ExecutionModel model = ExecutionModel::SHARED_STRAND;
+    if (vm.count("help") || !EchoServerPool::ParseModel(modelName, model))
     {
-      std::cout << "Accept error: " << error.message() << std::endl;
+      std::cerr << "Usage: " << argv[0] << " [options]\n";
+      std::cerr << options << "\n";
+      return 1;
     }
 
-    StartAccept();
-  }
-
-private:
-  ba::io_context& mContext;
-  bai::tcp::acceptor mAcceptor;
-};
-
-
-int main()
-{
-  try
-  {
-    ba::io_context context;
-    Server s(context, 12345);
-
-    std::cout << "Async server is listening Port 12345" << std::endl;
-
-    std::vector<std::thread> threads;
-    for (size_t i = 0; i < 4; i++)
-    {
-      threads.emplace_back([&context] {
-        context.run();
-      });
-    }
-    
-    for (auto& t : threads)
-    {
-      t.join();
-    }
+    EchoServerPool server(model, threads, port, isPipelined);
+    LOG_INFO("Async server is listening Port " << server.LocalPort() << " with " << threads << " threads ("
+             << modelName << ")");
+    server.Join();
   }
-  catch (const boost::system::system_error& error)
+  catch (const std::exception& error)
   {
-    std::cout << "Server error: " << error.what() << std::endl;
+    LOG_ERROR("Server error: " << error.what());
   }
   return 0;
-}
\ No newline at end of file
+}
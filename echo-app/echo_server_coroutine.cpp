@@ -0,0 +1,37 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility> // Before Asio, see coroutine_echo_server.h
+#include <vector>
+#include <boost/asio.hpp>
+#include "coroutine_echo_server.h"
+
+int main()
+{
+  try
+  {
+    ba::io_context context;
+    CoroutineEchoServer s(context, 12345);
+
+    LOG_INFO("Coroutine server is listening Port 12345");
+
+    // The same pool as echo_server_async_multithreaded
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 4; i++)
+    {
+      threads.emplace_back([&context] {
+        context.run();
+      });
+    }
+
+    for (auto& t : threads)
+    {
+      t.join();
+    }
+  }
+  catch (const boost::system::system_error& error)
+  {
+    LOG_ERROR("Server error: " << error.what());
+  }
+  return 0;
+}
@@ -1,62 +1,193 @@
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <optional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include "logger.h"
 
 namespace ba = boost::asio;
 namespace bai = boost::asio::ip;
+namespace po = boost::program_options;
 
-void HandleClient(bai::tcp::socket& sock)
+// Accepted sockets waiting for a worker. Push blocks while the queue is full, so a busy pool stops the accept loop
+// and further connections wait in the listen backlog.
+class SocketQueue
+{
+public:
+  explicit SocketQueue(size_t maxSockets)
+    : mMaxSockets(std::max<size_t>(maxSockets, 1))
+  {}
+
+  void Push(bai::tcp::socket socket)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mNotFull.wait(lock, [this] { return mSockets.size() < mMaxSockets || mIsClosed; });
+    if (mIsClosed)
+    {
+      return;
+    }
+    mSockets.push_back(std::move(socket));
+    lock.unlock();
+    mNotEmpty.notify_one();
+  }
+
+  // Waits for the next socket, returns false once the queue is closed
+  bool Pop(std::optional<bai::tcp::socket>& socket)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mNotEmpty.wait(lock, [this] { return !mSockets.empty() || mIsClosed; });
+    if (mIsClosed)
+    {
+      return false;
+    }
+    socket.emplace(std::move(mSockets.front()));
+    mSockets.pop_front();
+    lock.unlock();
+    mNotFull.notify_one();
+    return true;
+  }
+
+  void Close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsClosed = true;
+    }
+    mNotEmpty.notify_all();
+    mNotFull.notify_all();
+  }
+
+private:
+  const size_t mMaxSockets;
+  std::mutex mMutex;
+  std::condition_variable mNotEmpty;
+  std::condition_variable mNotFull;
+  std::deque<bai::tcp::socket> mSockets;
+  bool mIsClosed{false};
+};
+
+// Echoes lines until the client goes away. buffer is the caller's, reused from client to client.
+void HandleClient(bai::tcp::socket& sock, std::string& buffer)
 {
   try
   {
+    // Bytes read past the line stay in the buffer for the next one
+    buffer.clear();
     while (true)
     {
-      ba::streambuf buffer;
-      ba::read_until(sock, buffer, '\n');
+      size_t length = ba::read_until(sock, ba::dynamic_buffer(buffer), '\n');
+      LOG_DEBUG("Received: " << std::string_view(buffer.data(), length));
 
-      std::string message = ba::buffer_cast<const char*>(buffer.data());
-      std::cout << "Received: " << message << std::endl;
-
-      ba::write(sock, ba::buffer(message));
-      std::cout << "Send: " << message << std::endl;
+      ba::write(sock, ba::buffer(buffer.data(), length));
+      LOG_DEBUG("Send: " << std::string_view(buffer.data(), length));
+      buffer.erase(0, length);
     }
   }
   catch(const boost::system::system_error& e)
   {
     if (e.code() == ba::error::eof)
     {
-      std::cout << "Client connection has been closed EOF" << std::endl;
+      LOG_INFO("Client connection has been closed EOF");
     }
     else
     {
-      std::cout << "Error: " << e.what() << std::endl;
+      LOG_ERROR("Error: " << e.what());
     }
   }
 }
 
-int main()
+int main(int argc, char* argv[])
 {
   try
   {
+    unsigned short port = 12345;
+    size_t workers = 0;
+    size_t queuedSockets = 1024;
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("port", po::value<unsigned short>(&port)->default_value(port), "Port to listen on")
+      ("workers", po::value<size_t>(&workers)->default_value(workers),
+       "Threads serving one client each with blocking reads and writes (0 = serve each client in the accept loop, "
+       "one at a time)")
+      ("queued-sockets", po::value<size_t>(&queuedSockets)->default_value(queuedSockets),
+       "Accepted sockets waiting for a free worker before the accept loop waits too");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+      std::cerr << "Usage: " << argv[0] << " [options]\n";
+      std::cerr << options << "\n";
+      return 1;
+    }
+
     ba::io_context io_context;
 
-    bai::tcp::acceptor acceptor(io_context, bai::tcp::endpoint(bai::tcp::v4(), 12345));
-    std::cout << "Server is listening port 12345" << std::endl;
+    bai::tcp::acceptor acceptor(io_context, bai::tcp::endpoint(bai::tcp::v4(), port));
+    LOG_INFO("Server is listening port " << port << " with " << workers << " workers");
 
-    while (true)
+    SocketQueue queue(queuedSockets);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; i++)
     {
-      bai::tcp::socket socket(io_context);
+      threads.emplace_back([&queue] {
+        std::string buffer; // Keeps its capacity from client to client
+        std::optional<bai::tcp::socket> socket;
+        while (queue.Pop(socket))
+        {
+          HandleClient(*socket, buffer);
+          // Closed now rather than at the next Pop, an idle worker would keep the connection open
+          socket.reset();
+          LOG_INFO("Client connection has been closed");
+        }
+      });
+    }
 
-      acceptor.accept(socket);
-      std::cout << "New connection has been accepted: " << socket.remote_endpoint() << std::endl;
+    std::string buffer;
+    try
+    {
+      while (true)
+      {
+        bai::tcp::socket socket(io_context);
 
-      HandleClient(socket);
-      std::cout << "Client connection has been closed" << std::endl;
+        acceptor.accept(socket);
+        boost::system::error_code ignored;
+        LOG_INFO("New connection has been accepted: " << socket.remote_endpoint(ignored));
+
+        if (workers == 0)
+        {
+          HandleClient(socket, buffer);
+          LOG_INFO("Client connection has been closed");
+        }
+        else
+        {
+          queue.Push(std::move(socket));
+        }
+      }
+    }
+    catch (...)
+    {
+      queue.Close();
+      for (auto& thread : threads)
+      {
+        thread.join();
+      }
+      throw;
     }
   }
   catch (const std::exception& ex)
   {
-    std::cout << "Server error: " << ex.what() << std::endl;
+    LOG_ERROR("Server error: " << ex.what());
   }
 
   return 0;
@@ -0,0 +1,98 @@
+#ifndef ECHO_APP_LATENCY_HISTOGRAM_H_
+#define ECHO_APP_LATENCY_HISTOGRAM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Log-linear histogram in the spirit of HdrHistogram. Values below 2^SUB_BUCKET_BITS are counted exactly, larger
+// ones in buckets per power of two, each split into 2^(SUB_BUCKET_BITS - 1) linear sub-buckets, so every value is
+// kept to within 1/2^(SUB_BUCKET_BITS - 1) (0.2%) at a fixed size. Recording is a couple of shifts and an
+// increment; histograms recorded on different threads are merged afterwards with Add.
+class LatencyHistogram
+{
+public:
+  static const int SUB_BUCKET_BITS = 10;
+
+  LatencyHistogram() : mCounts(static_cast<size_t>(66 - SUB_BUCKET_BITS) << (SUB_BUCKET_BITS - 1), 0) {}
+
+  void Record(uint64_t value)
+  {
+    mCounts[Index(value)]++;
+    mTotal++;
+    mSum += value;
+    mMin = std::min(mMin, value);
+    mMax = std::max(mMax, value);
+  }
+
+  void Add(const LatencyHistogram& other)
+  {
+    for (size_t i = 0; i < mCounts.size(); i++)
+    {
+      mCounts[i] += other.mCounts[i];
+    }
+    mTotal += other.mTotal;
+    mSum += other.mSum;
+    mMin = std::min(mMin, other.mMin);
+    mMax = std::max(mMax, other.mMax);
+  }
+
+  void Reset()
+  {
+    std::fill(mCounts.begin(), mCounts.end(), 0);
+    mTotal = 0;
+    mSum = 0;
+    mMin = UINT64_MAX;
+    mMax = 0;
+  }
+
+  // Smallest value at least percentile percent of the recorded values are equal to (within the precision)
+  uint64_t Percentile(double percentile) const
+  {
+    if (mTotal == 0)
+    {
+      return 0;
+    }
+    const uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(percentile / 100.0 * mTotal)), 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < mCounts.size(); i++)
+    {
+      seen += mCounts[i];
+      if (seen >= rank)
+      {
+        return std::min(HighestEquivalentValue(i), mMax);
+      }
+    }
+    return mMax;
+  }
+
+  uint64_t Count() const { return mTotal; }
+  uint64_t Min() const { return mTotal == 0 ? 0 : mMin; }
+  uint64_t Max() const { return mMax; }
+  double Mean() const { return mTotal == 0 ? 0.0 : static_cast<double>(mSum) / mTotal; }
+
+private:
+  static size_t Index(uint64_t value)
+  {
+    const int highestBit = value == 0 ? 0 : 63 - __builtin_clzll(value);
+    const int shift = std::max(highestBit - SUB_BUCKET_BITS + 1, 0);
+    return (static_cast<size_t>(shift) << (SUB_BUCKET_BITS - 1)) + static_cast<size_t>(value >> shift);
+  }
+
+  static uint64_t HighestEquivalentValue(size_t index)
+  {
+    const size_t halfBucket = size_t(1) << (SUB_BUCKET_BITS - 1);
+    const int shift = index < 2 * halfBucket ? 0 : static_cast<int>(index / halfBucket) - 1;
+    const uint64_t top = index - (static_cast<size_t>(shift) << (SUB_BUCKET_BITS - 1));
+    return ((top + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> mCounts;
+  uint64_t mTotal{0};
+  uint64_t mSum{0};
+  uint64_t mMin{UINT64_MAX};
+  uint64_t mMax{0};
+};
+
+#endif // ECHO_APP_LATENCY_HISTOGRAM_H_
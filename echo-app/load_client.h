@@ -0,0 +1,258 @@
+#ifndef ECHO_APP_LOAD_CLIENT_H_
+#define ECHO_APP_LOAD_CLIENT_H_
+
+// Client side of the echo load: connections that keep requests in flight against an echo server and record the
+// latency of every echo, grouped into workers that each run their own io_context on their own thread. Shared by
+// echo_loadgen and echo_bench.
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <boost/asio.hpp>
+#include "latency_histogram.h"
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+using Clock = std::chrono::steady_clock;
+
+struct LoadConfig
+{
+  bool mIsOpenLoop{false};
+  size_t mDepth{1};            // Closed loop: requests in flight per connection
+  double mRatePerConnection{0}; // Open loop: requests per second per connection
+  std::vector<std::string> mMessages; // Sent in turn, each ending in '\n'
+};
+
+// Counters of one thread, only touched by it while the load runs
+struct WorkerStats
+{
+  LatencyHistogram mLatency; // Nanoseconds
+  uint64_t mResponses{0};
+  uint64_t mBytes{0};
+  uint64_t mErrors{0};
+};
+
+class Connection : public std::enable_shared_from_this<Connection>
+{
+public:
+  Connection(ba::io_context& context, const LoadConfig& config, WorkerStats& stats, const std::atomic<bool>& isMeasuring)
+    : mSocket(context), mTimer(context), mConfig(config), mStats(stats), mIsMeasuring(isMeasuring)
+  {}
+
+  void Start(const bai::tcp::resolver::results_type& endpoints, size_t index)
+  {
+    mNextMessage = index % mConfig.mMessages.size();
+    auto self(shared_from_this());
+    ba::async_connect(mSocket, endpoints,
+      [self](const boost::system::error_code& error, const bai::tcp::endpoint& /*endpoint*/) {
+        self->HandleConnect(error);
+      });
+  }
+
+  void Stop()
+  {
+    mIsStopped = true;
+    boost::system::error_code ignored;
+    mTimer.cancel();
+    mSocket.close(ignored);
+  }
+
+private:
+  void HandleConnect(const boost::system::error_code& error)
+  {
+    if (error)
+    {
+      std::cerr << "Connect error: " << error.message() << std::endl;
+      mStats.mErrors++;
+      return;
+    }
+    mSocket.set_option(bai::tcp::no_delay(true));
+    StartRead();
+
+    if (mConfig.mIsOpenLoop)
+    {
+      mNextDue = Clock::now();
+      SendDue();
+    }
+    else
+    {
+      for (size_t i = 0; i < mConfig.mDepth; i++)
+      {
+        Send(Clock::now());
+      }
+    }
+  }
+
+  // Sends every request due by now, then sleeps until the next one is
+  void SendDue()
+  {
+    const auto interval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(1.0 / mConfig.mRatePerConnection));
+    const auto now = Clock::now();
+    while (mNextDue <= now)
+    {
+      Send(mNextDue);
+      mNextDue += interval;
+    }
+
+    auto self(shared_from_this());
+    mTimer.expires_at(mNextDue);
+    mTimer.async_wait([self](const boost::system::error_code& error) {
+      if (!error && !self->mIsStopped)
+      {
+        self->SendDue();
+      }
+    });
+  }
+
+  // Requests sent while a write is in progress go out together with the next one
+  void Send(Clock::time_point startTime)
+  {
+    const std::string& message = mConfig.mMessages[mNextMessage];
+    mNextMessage = (mNextMessage + 1) % mConfig.mMessages.size();
+    mInFlight.push_back({startTime, message.size()});
+    mPendingWrite += message;
+    if (!mIsWriting)
+    {
+      StartWrite();
+    }
+  }
+
+  void StartWrite()
+  {
+    mIsWriting = true;
+    mWriting.swap(mPendingWrite);
+    mPendingWrite.clear();
+    auto self(shared_from_this());
+    ba::async_write(mSocket, ba::buffer(mWriting),
+      [self](const boost::system::error_code& error, size_t /*bytesTransferred*/) {
+        self->mIsWriting = false;
+        if (error)
+        {
+          return; // The read side reports the connection's failure
+        }
+        if (!self->mPendingWrite.empty())
+        {
+          self->StartWrite();
+        }
+      });
+  }
+
+  void StartRead()
+  {
+    auto self(shared_from_this());
+    mSocket.async_read_some(ba::buffer(mReadBuffer),
+      [self](const boost::system::error_code& error, size_t bytesTransferred) {
+        self->HandleRead(error, bytesTransferred);
+      });
+  }
+
+  // Every line is the echo of the oldest request in flight
+  void HandleRead(const boost::system::error_code& error, size_t bytesTransferred)
+  {
+    if (error)
+    {
+      if (!mIsStopped)
+      {
+        std::cerr << "Read error: " << error.message() << std::endl;
+        mStats.mErrors++;
+      }
+      return;
+    }
+
+    const auto now = Clock::now();
+    const bool isMeasuring = mIsMeasuring.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < bytesTransferred; i++)
+    {
+      mLineLength++;
+      if (mReadBuffer[i] != '\n')
+      {
+        continue;
+      }
+      if (mInFlight.empty() || mInFlight.front().mLength != mLineLength)
+      {
+        mStats.mErrors++; // Unexpected or mangled echo
+      }
+      else if (isMeasuring)
+      {
+        mStats.mLatency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - mInFlight.front().mStartTime).count());
+        mStats.mResponses++;
+        mStats.mBytes += mLineLength;
+      }
+      mLineLength = 0;
+      if (!mInFlight.empty())
+      {
+        mInFlight.pop_front();
+        if (!mConfig.mIsOpenLoop)
+        {
+          Send(now);
+        }
+      }
+    }
+    if (!mIsStopped)
+    {
+      StartRead();
+    }
+  }
+
+  struct Request
+  {
+    Clock::time_point mStartTime; // Sent, or due to be sent in open loop
+    size_t mLength;
+  };
+
+  bai::tcp::socket mSocket;
+  ba::steady_timer mTimer;
+  const LoadConfig& mConfig;
+  WorkerStats& mStats;
+  const std::atomic<bool>& mIsMeasuring;
+  size_t mNextMessage{0};
+  Clock::time_point mNextDue;
+  std::deque<Request> mInFlight;
+  std::string mPendingWrite;
+  std::string mWriting;
+  bool mIsWriting{false};
+  char mReadBuffer[64 * 1024];
+  size_t mLineLength{0};
+  bool mIsStopped{false};
+};
+
+// One thread running its own io_context and the connections assigned to it
+class Worker
+{
+public:
+  Worker() : mWork(ba::make_work_guard(mContext)) {}
+
+  ba::io_context& Context() { return mContext; }
+  WorkerStats& Stats() { return mStats; }
+
+  void Run()
+  {
+    mThread = std::thread([this] { mContext.run(); });
+  }
+
+  void Stop(std::vector<std::shared_ptr<Connection>>& connections)
+  {
+    ba::post(mContext, [&connections] {
+      for (auto& connection : connections)
+      {
+        connection->Stop();
+      }
+    });
+    mWork.reset();
+    mThread.join();
+  }
+
+private:
+  ba::io_context mContext;
+  ba::executor_work_guard<ba::io_context::executor_type> mWork;
+  WorkerStats mStats;
+  std::thread mThread;
+};
+
+#endif // ECHO_APP_LOAD_CLIENT_H_
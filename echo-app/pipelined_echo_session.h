@@ -0,0 +1,162 @@
+#ifndef ECHO_APP_PIPELINED_ECHO_SESSION_H_
+#define ECHO_APP_PIPELINED_ECHO_SESSION_H_
+
+// Echo session for clients that pipeline their lines. Received bytes land in a fixed ring buffer owned by the
+// session; every complete line found after a read is echoed in one gather write pointing straight into the ring, and
+// reading goes on while that write is in flight until the ring is full of bytes not echoed yet. A read and a write are
+// in flight together, so the session's handlers must run on a strand (or a context run by a single thread).
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include "logger.h"
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+
+class PipelinedEchoSession : public std::enable_shared_from_this<PipelinedEchoSession> {
+public:
+  // Bytes read but not echoed yet at most, a power of two; also the longest line the session accepts
+  static const size_t RING_SIZE = 64 * 1024;
+
+  explicit PipelinedEchoSession(const ba::any_io_executor& executor)
+    : mSocket(executor), mRing(RING_SIZE)
+  {}
+
+  bai::tcp::socket& Socket()
+  {
+    return mSocket;
+  }
+
+  void Start()
+  {
+    // Kept for the log, the socket no longer knows its peer once the connection is gone
+    boost::system::error_code ignored;
+    mRemoteEndpoint = mSocket.remote_endpoint(ignored);
+    Read();
+  }
+
+private:
+  using Buffers = std::array<ba::mutable_buffer, 2>;
+
+  bai::tcp::socket mSocket;
+  bai::tcp::endpoint mRemoteEndpoint;
+  std::vector<char> mRing;
+  // Stream offsets since the start of the connection, taken modulo RING_SIZE to index the ring:
+  // [mWritten, mLinesEnd) are complete lines waiting for or in the write, [mLinesEnd, mReceived) a partial line
+  uint64_t mWritten{0};
+  uint64_t mLinesEnd{0};
+  uint64_t mReceived{0};
+  bool mIsReading{false};
+  bool mIsWriting{false};
+  bool mIsReadClosed{false}; // EOF or a read error, nothing more is read
+
+  // The ring's bytes between two stream offsets, at most RING_SIZE apart: one buffer, or two when they wrap
+  Buffers Span(uint64_t begin, uint64_t end)
+  {
+    const size_t offset = begin & (RING_SIZE - 1);
+    const size_t length = end - begin;
+    const size_t first = std::min(length, RING_SIZE - offset);
+    return {ba::buffer(mRing.data() + offset, first), ba::buffer(mRing.data(), length - first)};
+  }
+
+  void Read()
+  {
+    if (mIsReading || mIsReadClosed)
+    {
+      return;
+    }
+    if (mReceived - mWritten == RING_SIZE)
+    {
+      // Backlog full, the next write that completes resumes reading
+      if (mLinesEnd == mWritten)
+      {
+        LOG_ERROR("Line longer than " << RING_SIZE << " bytes (" << mRemoteEndpoint << "), closing");
+        boost::system::error_code ignored;
+        mSocket.close(ignored);
+      }
+      return;
+    }
+    mIsReading = true;
+    mSocket.async_read_some(Span(mReceived, mWritten + RING_SIZE),
+      std::bind(&PipelinedEchoSession::HandleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+  }
+
+  void HandleRead(const boost::system::error_code& error, size_t bytesTransferred)
+  {
+    mIsReading = false;
+    if (error)
+    {
+      if (error == ba::error::eof)
+      {
+        LOG_INFO("Client connection has been closed (EOF): " << mRemoteEndpoint);
+      }
+      else if (error != ba::error::operation_aborted)
+      {
+        LOG_ERROR("Read failure (" << mRemoteEndpoint << "): " << error.message());
+      }
+      // Lines already received are still echoed, a partial last line is dropped
+      mIsReadClosed = true;
+      return;
+    }
+
+    const uint64_t scanned = mReceived;
+    mReceived += bytesTransferred;
+    // Only the new bytes are searched, backwards, for the end of the last complete line
+    const Buffers received = Span(scanned, mReceived);
+    uint64_t segmentEnd = mReceived;
+    for (size_t i = received.size(); i-- > 0;)
+    {
+      const char* begin = static_cast<const char*>(received[i].data());
+      const char* end = begin + received[i].size();
+      const auto newline = std::find(std::make_reverse_iterator(end), std::make_reverse_iterator(begin), '\n');
+      if (newline != std::make_reverse_iterator(begin))
+      {
+        mLinesEnd = segmentEnd - (end - newline.base());
+        break;
+      }
+      segmentEnd -= received[i].size();
+    }
+    LOG_DEBUG("Received: " << bytesTransferred << " bytes, " << mLinesEnd - mWritten << " to echo, Thread: "
+              << std::this_thread::get_id());
+
+    Write();
+    Read();
+  }
+
+  void Write()
+  {
+    if (mIsWriting || mLinesEnd == mWritten)
+    {
+      return;
+    }
+    mIsWriting = true;
+    // Every complete line so far in one write, straight from the ring
+    const Buffers lines = Span(mWritten, mLinesEnd);
+    ba::async_write(mSocket, std::array<ba::const_buffer, 2>{lines[0], lines[1]},
+      std::bind(&PipelinedEchoSession::HandleWrite, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+  }
+
+  void HandleWrite(const boost::system::error_code& error, size_t bytesTransferred)
+  {
+    mIsWriting = false;
+    if (error)
+    {
+      LOG_ERROR("Write failure (" << mRemoteEndpoint << "): " << error.message());
+      // Cancels the pending read, the session ends with it
+      boost::system::error_code ignored;
+      mSocket.close(ignored);
+      return;
+    }
+    LOG_DEBUG("Send: " << bytesTransferred << " bytes");
+    mWritten += bytesTransferred;
+
+    Write();
+    Read();
+  }
+};
+
+#endif // ECHO_APP_PIPELINED_ECHO_SESSION_H_
@@ -0,0 +1,294 @@
+#ifndef FILETRANSFER_BENCH_COMMON_H_
+#define FILETRANSFER_BENCH_COMMON_H_
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include "client.h"
+#include "server.h"
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+namespace fs = boost::filesystem;
+
+// Streambuf that discards everything, used to keep per-chunk logging out of the measurements
+class NullStreambuf : public std::streambuf
+{
+protected:
+  int overflow(int c) override { return traits_type::not_eof(c); }
+  std::streamsize xsputn(const char * /*s*/, std::streamsize n) override { return n; }
+};
+
+// Keeps server and client logging out of the measurements for its lifetime: only warnings and errors are logged
+// and std::cout is redirected to nowhere
+class QuietStdout
+{
+public:
+  QuietStdout() : mpOriginal(std::cout.rdbuf(&mNull)) { Logger::Instance().SetLevel(LogLevel::WARN); }
+  ~QuietStdout() { std::cout.rdbuf(mpOriginal); }
+
+  std::streambuf *Original() const { return mpOriginal; }
+
+private:
+  NullStreambuf mNull;
+  std::streambuf *mpOriginal;
+};
+
+// TCP relay that holds every forwarded segment for a fixed one-way delay in each direction,
+// emulating a link with RTT = 2 * delay and unlimited bandwidth.
+class DelayProxy
+{
+public:
+  DelayProxy(ba::io_context &context, unsigned short upstreamPort, std::chrono::microseconds oneWayDelay)
+      : mContext(context),
+        mAcceptor(context, bai::tcp::endpoint(bai::address_v4::loopback(), 0)),
+        mUpstream(bai::address_v4::loopback(), upstreamPort),
+        mDelay(oneWayDelay)
+  {
+  }
+
+  unsigned short LocalPort() const
+  {
+    return mAcceptor.local_endpoint().port();
+  }
+
+  void StartAccept()
+  {
+    auto connection = std::make_shared<Connection>(mContext, mDelay);
+    mAcceptor.async_accept(connection->mDownstream, [this, connection](const boost::system::error_code &error)
+                           {
+                             if (error)
+                             {
+                               return;
+                             }
+                             connection->Start(mUpstream);
+                             StartAccept();
+                           });
+  }
+
+private:
+  struct Connection;
+
+  // Forwards one direction of a connection, releasing each read segment after the delay
+  struct Relay : public std::enable_shared_from_this<Relay>
+  {
+    Relay(std::shared_ptr<Connection> connection, bai::tcp::socket &from, bai::tcp::socket &to,
+          std::chrono::microseconds delay)
+        : mpConnection(connection), mFrom(from), mTo(to), mTimer(from.get_executor()), mDelay(delay)
+    {
+    }
+
+    void Read()
+    {
+      auto self(shared_from_this());
+      mReadBuffer.resize(64 * 1024);
+      mFrom.async_read_some(ba::buffer(mReadBuffer), [self](const boost::system::error_code &error, size_t sz)
+                            {
+                              if (error)
+                              {
+                                self->mIsEof = true;
+                                self->Flush();
+                                return;
+                              }
+                              self->mReadBuffer.resize(sz);
+                              self->mPending.emplace_back(std::chrono::steady_clock::now() + self->mDelay,
+                                                          std::move(self->mReadBuffer));
+                              self->Flush();
+                              self->Read();
+                            });
+    }
+
+    void Flush()
+    {
+      if (mIsWriting)
+      {
+        return;
+      }
+      if (mPending.empty())
+      {
+        if (mIsEof)
+        {
+          boost::system::error_code ignored;
+          mTo.shutdown(bai::tcp::socket::shutdown_send, ignored);
+        }
+        return;
+      }
+
+      auto self(shared_from_this());
+      mIsWriting = true;
+      mTimer.expires_at(mPending.front().first);
+      mTimer.async_wait([self](const boost::system::error_code & /*error*/)
+                        {
+                          ba::async_write(self->mTo, ba::buffer(self->mPending.front().second),
+                                          [self](const boost::system::error_code &error, size_t /*sz*/)
+                                          {
+                                            self->mPending.pop_front();
+                                            self->mIsWriting = false;
+                                            if (error)
+                                            {
+                                              self->mpConnection->Close();
+                                              return;
+                                            }
+                                            self->Flush();
+                                          });
+                        });
+    }
+
+    std::shared_ptr<Connection> mpConnection;
+    bai::tcp::socket &mFrom;
+    bai::tcp::socket &mTo;
+    ba::steady_timer mTimer;
+    std::chrono::microseconds mDelay;
+    std::vector<char> mReadBuffer;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::vector<char>>> mPending;
+    bool mIsWriting{false};
+    bool mIsEof{false};
+  };
+
+  struct Connection : public std::enable_shared_from_this<Connection>
+  {
+    Connection(ba::io_context &context, std::chrono::microseconds delay)
+        : mDownstream(context), mUpstreamSocket(context), mDelay(delay)
+    {
+    }
+
+    void Start(const bai::tcp::endpoint &upstream)
+    {
+      auto self(shared_from_this());
+      mUpstreamSocket.async_connect(upstream, [self](const boost::system::error_code &error)
+                                    {
+                                      if (error)
+                                      {
+                                        self->Close();
+                                        return;
+                                      }
+                                      bai::tcp::no_delay noDelay(true);
+                                      self->mDownstream.set_option(noDelay);
+                                      self->mUpstreamSocket.set_option(noDelay);
+                                      std::make_shared<Relay>(self, self->mDownstream, self->mUpstreamSocket, self->mDelay)->Read();
+                                      std::make_shared<Relay>(self, self->mUpstreamSocket, self->mDownstream, self->mDelay)->Read();
+                                    });
+    }
+
+    void Close()
+    {
+      boost::system::error_code ignored;
+      mDownstream.close(ignored);
+      mUpstreamSocket.close(ignored);
+    }
+
+    bai::tcp::socket mDownstream;
+    bai::tcp::socket mUpstreamSocket;
+    std::chrono::microseconds mDelay;
+  };
+
+  ba::io_context &mContext;
+  bai::tcp::acceptor mAcceptor;
+  bai::tcp::endpoint mUpstream;
+  std::chrono::microseconds mDelay;
+};
+
+// Runs an io_context on a background thread until destroyed
+class ContextThread
+{
+public:
+  ContextThread() : mWork(ba::make_work_guard(mContext)), mThread([this] { mContext.run(); }) {}
+  ~ContextThread()
+  {
+    Stop();
+  }
+
+  // Must be called before destroying objects whose handlers run on this thread
+  void Stop()
+  {
+    mWork.reset();
+    mContext.stop();
+    if (mThread.joinable())
+    {
+      mThread.join();
+    }
+  }
+
+  ba::io_context &Context() { return mContext; }
+
+private:
+  ba::io_context mContext;
+  ba::executor_work_guard<ba::io_context::executor_type> mWork;
+  std::thread mThread;
+};
+
+// Creates a scratch directory, makes it the working directory (the server writes into ./uploads)
+// and removes it again on destruction.
+class ScratchDirectory
+{
+public:
+  ScratchDirectory()
+      : mOriginal(fs::current_path()),
+        mPath(fs::temp_directory_path() / fs::unique_path("filetransfer-bench-%%%%-%%%%"))
+  {
+    fs::create_directories(mPath);
+    fs::current_path(mPath);
+  }
+  ~ScratchDirectory()
+  {
+    boost::system::error_code ignored;
+    fs::current_path(mOriginal, ignored);
+    fs::remove_all(mPath, ignored);
+  }
+
+  const fs::path &Path() const { return mPath; }
+
+private:
+  fs::path mOriginal;
+  fs::path mPath;
+};
+
+inline std::string CreateRandomFile(const fs::path &path, uint64_t size)
+{
+  std::ofstream out(path.string(), std::ios_base::binary | std::ios_base::trunc);
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+  std::vector<char> block(64 * 1024);
+  for (uint64_t written = 0; written < size; written += block.size())
+  {
+    for (auto &c : block)
+    {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      c = static_cast<char>(state);
+    }
+    out.write(block.data(), std::min<uint64_t>(block.size(), size - written));
+  }
+  return path.string();
+}
+
+struct UploadResult
+{
+  bool mSuccess{false};
+  double mSeconds{0.0};
+};
+
+// Uploads one file through a fresh Client on the calling thread and times it end to end
+inline UploadResult RunUpload(unsigned short port, const std::string &path, const TransferConfig &config)
+{
+  UploadResult result;
+  ba::io_context context;
+  auto upload = std::make_shared<ParallelUpload>(context, "127.0.0.1", std::to_string(port), config);
+
+  auto start = std::chrono::steady_clock::now();
+  upload->Start(path, [&context, &result](bool success, const std::string & /*filename*/)
+                {
+                  result.mSuccess = success;
+                  context.stop(); });
+  context.run();
+  result.mSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+#endif // FILETRANSFER_BENCH_COMMON_H_
@@ -0,0 +1,140 @@
+// Measures frame checksum throughput: zlib's crc32 (protocol version 1) against the CRC32C implementations
+// (protocol version 2) over a range of payload sizes. Every implementation is checked against the portable one
+// before it is timed.
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <boost/program_options.hpp>
+#include "crc32c.h"
+
+namespace po = boost::program_options;
+
+namespace
+{
+
+struct Candidate
+{
+  std::string mName;
+  std::function<uint32_t(const char *, size_t)> mFunction;
+};
+
+// Repeats the checksum until at least minBytes were processed, returns MiB/s
+double Measure(const Candidate &candidate, const std::vector<char> &data, size_t size, uint64_t minBytes)
+{
+  const uint64_t iterations = std::max<uint64_t>(minBytes / size, 1);
+  volatile uint32_t sink = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    sink = sink + candidate.mFunction(data.data(), size);
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return iterations * size / (1024.0 * 1024.0) / seconds;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  try
+  {
+    std::vector<size_t> sizes;
+    uint64_t minBytes = 0;
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("sizes", po::value<std::vector<size_t>>(&sizes)->multitoken()
+                    ->default_value({64, 512, 4096, 16384, 65536, 1 << 20, 16 << 20}, "64 512 4096 16384 65536 1048576 16777216"),
+       "Payload sizes in bytes")
+      ("bytes", po::value<uint64_t>(&minBytes)->default_value(256 * 1024 * 1024), "Bytes to checksum per measurement");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+      std::cerr << options << "\n";
+      return 1;
+    }
+
+    std::vector<Candidate> candidates;
+    candidates.push_back({"zlib-crc32", [](const char *data, size_t length)
+                          { return static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef *>(data), length)); }});
+    candidates.push_back({"crc32c-portable", [](const char *data, size_t length)
+                          { return crc32c::Portable(0, data, length); }});
+#if FILETRANSFER_HAS_CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+      candidates.push_back({"crc32c-sse4.2-serial", [](const char *data, size_t length)
+                            { return crc32c::Sse42Serial(0, data, length); }});
+      candidates.push_back({"crc32c-sse4.2-3way", [](const char *data, size_t length)
+                            { return crc32c::Sse42<crc32c::ShiftPortable>(0, data, length); }});
+      if (__builtin_cpu_supports("pclmul"))
+      {
+        candidates.push_back({"crc32c-sse4.2-pclmul", [](const char *data, size_t length)
+                              { return crc32c::Sse42<crc32c::ShiftPclmul>(0, data, length); }});
+      }
+    }
+#endif
+
+    const size_t maxSize = sizes.empty() ? 0 : *std::max_element(sizes.begin(), sizes.end());
+    std::vector<char> data(std::max<size_t>(maxSize, 3 * 3 * 4096 + 7));
+    std::mt19937_64 random(42);
+    for (char &c : data)
+    {
+      c = static_cast<char>(random());
+    }
+
+    // Standard check value, then every implementation against the portable one at awkward lengths
+    if (crc32c::Portable(0, "123456789", 9) != 0xE3069283)
+    {
+      std::cerr << "crc32c-portable: wrong check value" << std::endl;
+      return 1;
+    }
+    for (size_t i = 2; i < candidates.size(); i++) // All but zlib and the reference itself
+    {
+      for (size_t length : {size_t(0), size_t(1), size_t(7), size_t(8), size_t(4095), size_t(3 * 4096),
+                            size_t(3 * 4096 + 1), size_t(2 * 3 * 4096 + 13), data.size() - 1})
+      {
+        // Off by one byte so the implementations also see unaligned data
+        if (candidates[i].mFunction(data.data() + 1, length) != crc32c::Portable(0, data.data() + 1, length))
+        {
+          std::cerr << candidates[i].mName << ": mismatch at length " << length << std::endl;
+          return 1;
+        }
+      }
+    }
+    std::cout << "Crc32c() uses " << crc32c::BestName() << std::endl;
+
+    std::cout << std::setw(10) << "bytes";
+    for (const auto &candidate : candidates)
+    {
+      std::cout << std::setw(22) << candidate.mName;
+    }
+    std::cout << "  (MiB/s)" << std::endl;
+
+    for (size_t size : sizes)
+    {
+      std::cout << std::setw(10) << size << std::fixed << std::setprecision(0);
+      for (const auto &candidate : candidates)
+      {
+        std::cout << std::setw(22) << Measure(candidate, data, size, minBytes);
+      }
+      std::cout << std::defaultfloat << std::endl;
+    }
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Benchmark error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
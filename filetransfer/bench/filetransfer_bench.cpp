@@ -0,0 +1,244 @@
+// Upload benchmark for tracking regressions: sweeps file size, chunk size, concurrent clients and injected RTT
+// against an in-process ServerPool on loopback and reports every run as JSON. Clients and server share the
+// process, so the CPU time covers both.
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sys/resource.h>
+#include <boost/program_options.hpp>
+#include "bench_common.h"
+
+namespace po = boost::program_options;
+
+namespace
+{
+
+struct RunResult
+{
+  uint64_t mFileSize{0};
+  uint32_t mChunkSize{0};
+  size_t mClients{0};
+  double mRttMs{0.0};
+  size_t mFailures{0};
+  double mSeconds{0.0};
+  uint64_t mChunks{0};
+  double mAckP50Us{0.0};
+  double mAckP99Us{0.0};
+  double mUserCpuSeconds{0.0};
+  double mSystemCpuSeconds{0.0};
+};
+
+// User and system CPU time of the whole process, every thread included
+void ProcessCpuSeconds(double &user, double &system)
+{
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Nearest-rank percentile of sorted samples in microseconds
+double PercentileUs(const std::vector<std::chrono::steady_clock::duration> &sorted, double percentile)
+{
+  if (sorted.empty())
+  {
+    return 0.0;
+  }
+  const size_t rank = static_cast<size_t>(std::ceil(percentile / 100.0 * sorted.size()));
+  const auto sample = sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+  return std::chrono::duration<double, std::micro>(sample).count();
+}
+
+// Uploads one file per client, each on its own thread and connection, and measures the run as a whole
+RunResult RunClients(unsigned short port, const std::vector<std::string> &paths, const TransferConfig &baseConfig)
+{
+  RunResult result;
+  std::atomic<size_t> failures{0};
+  std::vector<std::vector<std::chrono::steady_clock::duration>> latencies(paths.size());
+  std::vector<std::thread> clientThreads;
+
+  double userBefore = 0.0, systemBefore = 0.0;
+  ProcessCpuSeconds(userBefore, systemBefore);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    clientThreads.emplace_back([&, i]()
+                               {
+                                 TransferConfig config = baseConfig;
+                                 auto &samples = latencies[i];
+                                 config.mOnChunkAcked = [&samples](std::chrono::steady_clock::duration latency)
+                                 { samples.push_back(latency); };
+                                 if (!RunUpload(port, paths[i], config).mSuccess)
+                                 {
+                                   failures++;
+                                 } });
+  }
+  for (auto &thread : clientThreads)
+  {
+    thread.join();
+  }
+  result.mSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double userAfter = 0.0, systemAfter = 0.0;
+  ProcessCpuSeconds(userAfter, systemAfter);
+  result.mUserCpuSeconds = userAfter - userBefore;
+  result.mSystemCpuSeconds = systemAfter - systemBefore;
+  result.mFailures = failures;
+
+  std::vector<std::chrono::steady_clock::duration> all;
+  for (const auto &samples : latencies)
+  {
+    all.insert(all.end(), samples.begin(), samples.end());
+  }
+  std::sort(all.begin(), all.end());
+  result.mChunks = all.size();
+  result.mAckP50Us = PercentileUs(all, 50.0);
+  result.mAckP99Us = PercentileUs(all, 99.0);
+  return result;
+}
+
+void WriteJson(std::ostream &out, const std::vector<RunResult> &results, size_t workers)
+{
+  out << std::fixed << "{\n  \"benchmark\": \"filetransfer_bench\",\n  \"workers\": " << workers
+      << ",\n  \"runs\": [";
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const RunResult &run = results[i];
+    const double bytes = static_cast<double>(run.mFileSize) * run.mClients;
+    const bool success = run.mFailures == 0 && run.mSeconds > 0.0;
+    out << (i == 0 ? "\n" : ",\n") << "    {"
+        << "\"file_size\": " << run.mFileSize << ", \"chunk_size\": " << run.mChunkSize
+        << ", \"clients\": " << run.mClients << ", \"rtt_ms\": " << std::setprecision(3) << run.mRttMs
+        << ", \"success\": " << (success ? "true" : "false") << ", \"failures\": " << run.mFailures
+        << ", \"seconds\": " << std::setprecision(6) << run.mSeconds
+        << ", \"mb_per_s\": " << std::setprecision(3) << (success ? bytes / 1e6 / run.mSeconds : 0.0)
+        << ", \"chunks\": " << run.mChunks
+        << ", \"chunks_per_s\": " << (success ? run.mChunks / run.mSeconds : 0.0)
+        << ", \"ack_latency_p50_us\": " << run.mAckP50Us << ", \"ack_latency_p99_us\": " << run.mAckP99Us
+        << ", \"cpu_user_s\": " << run.mUserCpuSeconds << ", \"cpu_system_s\": " << run.mSystemCpuSeconds << "}";
+  }
+  out << "\n  ]\n}" << std::defaultfloat << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  try
+  {
+    std::vector<uint64_t> fileSizes;
+    std::vector<uint32_t> chunkSizes;
+    std::vector<size_t> clientCounts;
+    std::vector<double> rttsMs;
+    size_t workers = 0;
+    size_t windowChunks = 0;
+    std::string outputPath;
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("file-sizes", po::value<std::vector<uint64_t>>(&fileSizes)->multitoken()->default_value({16 << 20, 64 << 20}, "16777216 67108864"),
+       "Sizes of the uploaded files in bytes")
+      ("chunk-sizes", po::value<std::vector<uint32_t>>(&chunkSizes)->multitoken()->default_value({64 << 10, 1 << 20}, "65536 1048576"),
+       "Chunk sizes in bytes")
+      ("clients", po::value<std::vector<size_t>>(&clientCounts)->multitoken()->default_value({1, 4}, "1 4"),
+       "Numbers of concurrent clients, each uploading its own copy of the file over its own connection")
+      ("rtt-ms", po::value<std::vector<double>>(&rttsMs)->multitoken()->default_value({0}, "0"),
+       "Injected round-trip times in milliseconds, 0 connects to the server directly")
+      ("workers", po::value<size_t>(&workers)->default_value(std::max(1u, std::thread::hardware_concurrency())),
+       "Server worker threads")
+      ("window-chunks", po::value<size_t>(&windowChunks)->default_value(TransferConfig().mWindow.mMaxChunks),
+       "Client send window in chunks")
+      ("output", po::value<std::string>(&outputPath), "Write the JSON report to this file instead of stdout");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+      std::cerr << options << "\n";
+      return 1;
+    }
+
+    if (!outputPath.empty())
+    {
+      outputPath = fs::absolute(outputPath).string(); // Before the scratch directory becomes the working directory
+    }
+    ScratchDirectory scratch;
+    QuietStdout quiet;
+    std::ostream report(quiet.Original());
+    std::ostream &progress = std::cerr; // Keeps stdout to the JSON
+
+    ServerConfig serverConfig;
+    serverConfig.mMaxChunkSize = MAX_CHUNK_SIZE;
+    ServerPool server(workers, AcceptMode::REUSE_PORT, 0, serverConfig);
+    server.Start();
+
+    const size_t maxClients = *std::max_element(clientCounts.begin(), clientCounts.end());
+    std::vector<RunResult> results;
+    for (uint64_t fileSize : fileSizes)
+    {
+      // One name per client so concurrent uploads don't target the same file
+      const std::string source = CreateRandomFile(scratch.Path() / ("filetransfer_bench_" + std::to_string(fileSize) + ".bin"), fileSize);
+      std::vector<std::string> paths;
+      for (size_t i = 0; i < maxClients; i++)
+      {
+        fs::path path = scratch.Path() / ("filetransfer_bench_" + std::to_string(fileSize) + "_" + std::to_string(i) + ".bin");
+        fs::create_hard_link(source, path);
+        paths.push_back(path.string());
+      }
+
+      for (double rttMs : rttsMs)
+      {
+        ContextThread proxyThread;
+        const auto oneWayDelay = std::chrono::microseconds(static_cast<int64_t>(rttMs * 1000.0 / 2.0));
+        DelayProxy proxy(proxyThread.Context(), server.LocalPort(), oneWayDelay);
+        proxy.StartAccept();
+        const unsigned short port = rttMs > 0.0 ? proxy.LocalPort() : server.LocalPort();
+
+        for (uint32_t chunkSize : chunkSizes)
+        {
+          for (size_t clients : clientCounts)
+          {
+            TransferConfig config;
+            config.mChunkSize = chunkSize;
+            config.mWindow.mMaxChunks = windowChunks;
+            config.mResume = false;
+            RunResult result = RunClients(port, std::vector<std::string>(paths.begin(), paths.begin() + clients), config);
+            result.mFileSize = fileSize;
+            result.mChunkSize = chunkSize;
+            result.mClients = clients;
+            result.mRttMs = rttMs;
+            results.push_back(result);
+            fs::remove_all("uploads");
+
+            progress << "file_size " << fileSize << " chunk_size " << chunkSize << " clients " << clients << " rtt_ms "
+                     << rttMs << ": " << std::fixed << std::setprecision(1)
+                     << (result.mFailures == 0 ? fileSize * clients / 1e6 / result.mSeconds : 0.0) << " MB/s"
+                     << std::defaultfloat << (result.mFailures ? "  FAILED: " + std::to_string(result.mFailures) : "")
+                     << std::endl;
+          }
+        }
+        proxyThread.Stop();
+      }
+    }
+    server.Stop();
+
+    if (outputPath.empty())
+    {
+      WriteJson(report, results, workers);
+    }
+    else
+    {
+      std::ofstream out(outputPath);
+      WriteJson(out, results, workers);
+    }
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Benchmark error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,108 @@
+// Load test for the multi-core server: uploads from many concurrent clients against a ServerPool with
+// 1..N workers and reports aggregate throughput for each worker count.
+// Clients run in the same process, so leave spare cores for them when reading the numbers.
+#include <atomic>
+#include <iomanip>
+#include <boost/program_options.hpp>
+#include "bench_common.h"
+
+namespace po = boost::program_options;
+
+int main(int argc, char *argv[])
+{
+  try
+  {
+    uint64_t fileSize = 0;
+    uint32_t chunkSize = 0;
+    size_t clients = 0;
+    std::vector<size_t> workerCounts;
+    std::string acceptMode;
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<size_t> defaultWorkers;
+    std::string defaultWorkersText;
+    for (size_t workers = 1; workers <= cores; workers *= 2)
+    {
+      defaultWorkers.push_back(workers);
+      defaultWorkersText += (defaultWorkersText.empty() ? "" : " ") + std::to_string(workers);
+    }
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("file-size", po::value<uint64_t>(&fileSize)->default_value(32 * 1024 * 1024), "Size of each uploaded file in bytes")
+      ("chunk-size", po::value<uint32_t>(&chunkSize)->default_value(DEFAULT_CHUNK_SIZE), "Chunk size in bytes")
+      ("clients", po::value<size_t>(&clients)->default_value(2 * cores), "Concurrent client connections")
+      ("workers", po::value<std::vector<size_t>>(&workerCounts)->multitoken()->default_value(defaultWorkers, defaultWorkersText),
+       "Server worker counts to measure")
+      ("accept-mode", po::value<std::string>(&acceptMode)->default_value("reuseport"), "reuseport or shared");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+      std::cerr << options << "\n";
+      return 1;
+    }
+
+    ScratchDirectory scratch;
+    // One name per client so concurrent uploads don't target the same file
+    const std::string source = CreateRandomFile(scratch.Path() / "scaling_bench.bin", fileSize);
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < clients; i++)
+    {
+      fs::path path = scratch.Path() / ("scaling_bench_" + std::to_string(i) + ".bin");
+      fs::create_hard_link(source, path);
+      paths.push_back(path.string());
+    }
+
+    QuietStdout quiet;
+    std::ostream report(quiet.Original());
+    report << std::setw(8) << "workers" << std::setw(9) << "clients" << std::setw(12) << "seconds"
+           << std::setw(12) << "MiB/s" << std::endl;
+
+    ServerConfig serverConfig;
+    serverConfig.mMaxChunkSize = MAX_CHUNK_SIZE;
+
+    for (size_t workers : workerCounts)
+    {
+      ServerPool server(workers, acceptMode == "shared" ? AcceptMode::SHARED : AcceptMode::REUSE_PORT, 0, serverConfig);
+      server.Start();
+
+      TransferConfig config;
+      config.mChunkSize = chunkSize;
+
+      std::atomic<size_t> failures{0};
+      std::vector<std::thread> clientThreads;
+      auto start = std::chrono::steady_clock::now();
+      for (const auto &path : paths)
+      {
+        clientThreads.emplace_back([&, path]()
+                                   {
+                                     if (!RunUpload(server.LocalPort(), path, config).mSuccess)
+                                     {
+                                       failures++;
+                                     } });
+      }
+      for (auto &thread : clientThreads)
+      {
+        thread.join();
+      }
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      server.Stop();
+      fs::remove_all("uploads");
+
+      report << std::setw(8) << workers << std::setw(9) << clients << std::setw(12) << std::fixed << std::setprecision(3)
+             << seconds << std::setw(12) << std::setprecision(1)
+             << (clients * fileSize) / (1024.0 * 1024.0) / seconds << std::defaultfloat
+             << (failures ? "  FAILED: " + std::to_string(failures) : "") << std::endl;
+    }
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Benchmark error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,131 @@
+// Measures upload throughput against the client's send window size at different injected RTTs.
+// The server runs in-process on loopback behind a DelayProxy that adds RTT/2 in each direction.
+// With --allocations it also reports heap allocations per chunk in steady state.
+#include <iomanip>
+#include <boost/program_options.hpp>
+#include "alloc_counter.h"
+#include "bench_common.h"
+
+namespace po = boost::program_options;
+
+int main(int argc, char *argv[])
+{
+  try
+  {
+    uint64_t fileSize = 0;
+    uint32_t chunkSize = 0;
+    bool rawFrames = false;
+    bool countAllocations = false;
+    std::vector<double> rttsMs;
+    std::vector<size_t> windows;
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("file-size", po::value<uint64_t>(&fileSize)->default_value(64 * 1024 * 1024), "Size of the uploaded file in bytes")
+      ("chunk-size", po::value<uint32_t>(&chunkSize)->default_value(256 * 1024), "Chunk size in bytes")
+      ("raw-frames", po::bool_switch(&rawFrames), "Send chunk data as raw frames (sendfile/splice)")
+      ("rtt-ms", po::value<std::vector<double>>(&rttsMs)->multitoken()->default_value({0, 1, 5}, "0 1 5"),
+       "Injected round-trip times in milliseconds")
+      ("window-chunks", po::value<std::vector<size_t>>(&windows)->multitoken()->default_value({1, 4, 16, 64}, "1 4 16 64"),
+       "Send window sizes in chunks")
+      ("allocations", po::bool_switch(&countAllocations),
+       "Also report steady-state heap allocations per chunk for each window size (no injected RTT)");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+      std::cerr << options << "\n";
+      return 1;
+    }
+
+    ScratchDirectory scratch;
+    const std::string path = CreateRandomFile(scratch.Path() / "window_bench.bin", fileSize);
+
+    QuietStdout quiet;
+    std::ostream report(quiet.Original());
+    report << std::setw(8) << "rtt_ms" << std::setw(10) << "window" << std::setw(12) << "seconds"
+           << std::setw(12) << "MiB/s" << std::endl;
+
+    ContextThread serverThread;
+    ServerConfig serverConfig;
+    serverConfig.mMaxChunkSize = MAX_CHUNK_SIZE;
+    Server server(serverThread.Context(), 0, serverConfig);
+    server.StartAccept();
+
+    for (double rttMs : rttsMs)
+    {
+      ContextThread proxyThread;
+      const auto oneWayDelay = std::chrono::microseconds(static_cast<int64_t>(rttMs * 1000.0 / 2.0));
+      DelayProxy proxy(proxyThread.Context(), server.LocalPort(), oneWayDelay);
+      proxy.StartAccept();
+
+      for (size_t window : windows)
+      {
+        TransferConfig config;
+        config.mChunkSize = chunkSize;
+        config.mRawDataFrames = rawFrames;
+        config.mWindow.mMaxChunks = window;
+        config.mWindow.mMaxBytes = 0;
+        UploadResult result = RunUpload(proxy.LocalPort(), path, config);
+        fs::remove(fs::path("uploads") / fs::path(path).filename());
+
+        report << std::setw(8) << rttMs << std::setw(10) << window << std::setw(12) << std::fixed << std::setprecision(3)
+               << result.mSeconds << std::setw(12) << std::setprecision(1)
+               << (result.mSuccess ? fileSize / (1024.0 * 1024.0) / result.mSeconds : 0.0) << std::defaultfloat
+               << (result.mSuccess ? "" : "  FAILED") << std::endl;
+      }
+      proxyThread.Stop();
+    }
+
+    if (countAllocations)
+    {
+      // Uploading the file and half of it costs the same setup, the difference is what the extra chunks cost
+      const std::string halfPath = CreateRandomFile(scratch.Path() / "window_bench_half.bin", fileSize / 2);
+      const auto chunks = [chunkSize](uint64_t size) { return (size + chunkSize - 1) / chunkSize; };
+      const double extraChunks = static_cast<double>(chunks(fileSize) - chunks(fileSize / 2));
+
+      report << "\nSteady-state heap allocations per chunk\n"
+             << std::setw(10) << "window" << std::setw(12) << "client" << std::setw(12) << "server" << std::endl;
+      for (size_t window : windows)
+      {
+        TransferConfig config;
+        config.mChunkSize = chunkSize;
+        config.mRawDataFrames = rawFrames;
+        config.mWindow.mMaxChunks = window;
+        config.mWindow.mMaxBytes = 0;
+        // The client reads the file on its own thread too, rather than on a read-ahead thread
+        config.mReadAheadChunks = 0;
+
+        // The client runs on this thread, everything else is the server
+        const auto measure = [&](const std::string &uploadPath, uint64_t &client, uint64_t &others)
+        {
+          const AllocationCount before = CountAllocations();
+          RunUpload(server.LocalPort(), uploadPath, config);
+          std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Let the server wind the session down
+          const AllocationCount after = CountAllocations();
+          client = after.mThread - before.mThread;
+          others = (after.mTotal - before.mTotal) - client;
+          fs::remove(fs::path("uploads") / fs::path(uploadPath).filename());
+        };
+        uint64_t halfClient = 0, halfServer = 0, fullClient = 0, fullServer = 0;
+        measure(halfPath, halfClient, halfServer);
+        measure(path, fullClient, fullServer);
+
+        report << std::setw(10) << window << std::fixed << std::setprecision(2)
+               << std::setw(12) << (static_cast<double>(fullClient) - halfClient) / extraChunks
+               << std::setw(12) << (static_cast<double>(fullServer) - halfServer) / extraChunks
+               << std::defaultfloat << std::endl;
+      }
+    }
+    serverThread.Stop();
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Benchmark error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+#ifndef FILETRANSFER_BUFFER_POOL_H_
+#define FILETRANSFER_BUFFER_POOL_H_
+
+// Byte buffers recycled by one connection. A buffer handed out is a shared_ptr the pool keeps a reference to;
+// once every other holder (a disk write, say) has dropped theirs, the pool hands it out again with its capacity
+// intact, so a steady stream of equally sized chunks needs no allocations. The pool holds on to at most maxBuffers
+// buffers, whose memory stays allocated until ReleaseIdle. T is std::string, or an object owning buffers that offers
+// the same clear() and capacity().
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+template <typename T>
+class BasicBufferPool
+{
+public:
+  explicit BasicBufferPool(size_t maxBuffers = 32) : mMaxBuffers(maxBuffers) {}
+
+  BasicBufferPool(const BasicBufferPool &) = delete;
+  BasicBufferPool &operator=(const BasicBufferPool &) = delete;
+
+  // An empty buffer. Only call from the pool owner's thread or strand; the buffers may be released anywhere.
+  std::shared_ptr<T> Acquire()
+  {
+    if (mBuffers.size() > mMaxBuffers)
+    {
+      TrimIdle();
+    }
+    for (auto &pBuffer : mBuffers)
+    {
+      if (pBuffer.use_count() == 1)
+      {
+        // The last other holder released it, make its writes visible before the buffer is reused
+        std::atomic_thread_fence(std::memory_order_acquire);
+        pBuffer->clear();
+        return pBuffer;
+      }
+    }
+    auto pBuffer = std::make_shared<T>();
+    if (mBuffers.size() < mMaxBuffers)
+    {
+      mBuffers.push_back(pBuffer);
+    }
+    return pBuffer;
+  }
+
+  // Capacity of the pooled buffers nobody else holds. Same thread rule as Acquire.
+  size_t IdleBytes() const
+  {
+    size_t bytes = 0;
+    for (const auto &pBuffer : mBuffers)
+    {
+      if (pBuffer.use_count() == 1)
+      {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        bytes += pBuffer->capacity();
+      }
+    }
+    return bytes;
+  }
+
+  // Frees the pooled buffers nobody else holds. Same thread rule as Acquire.
+  void ReleaseIdle()
+  {
+    mBuffers.erase(std::remove_if(mBuffers.begin(), mBuffers.end(),
+                                  [](const std::shared_ptr<T> &pBuffer) { return pBuffer.use_count() == 1; }),
+                   mBuffers.end());
+  }
+
+  // Changes how many buffers the pool holds on to. Buffers over a lowered limit are freed once nobody else holds them.
+  // Same thread rule as Acquire.
+  void SetMaxBuffers(size_t maxBuffers)
+  {
+    mMaxBuffers = maxBuffers;
+    TrimIdle();
+  }
+
+private:
+  // Frees idle buffers, newest first, while the pool holds more than mMaxBuffers
+  void TrimIdle()
+  {
+    for (size_t i = mBuffers.size(); i-- > 0 && mBuffers.size() > mMaxBuffers;)
+    {
+      if (mBuffers[i].use_count() == 1)
+      {
+        mBuffers.erase(mBuffers.begin() + static_cast<std::ptrdiff_t>(i));
+      }
+    }
+  }
+
+  size_t mMaxBuffers;
+  std::vector<std::shared_ptr<T>> mBuffers;
+};
+
+using BufferPool = BasicBufferPool<std::string>;
+
+#endif // FILETRANSFER_BUFFER_POOL_H_
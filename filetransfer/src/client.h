@@ -0,0 +1,1413 @@
+#ifndef FILETRANSFER_CLIENT_H_
+#define FILETRANSFER_CLIENT_H_
+
+#include <iostream>
+#include <memory>
+#include <deque>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include "common.h"
+#include "zero_copy.h"
+#include "write_queue.h"
+#include "delta.h"
+#include "compression.h"
+#include "read_ahead.h"
+#include "filetransfer.pb.h"
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+namespace fs = boost::filesystem;
+
+// The connection's own writes and posts allocate from its handler memory
+using ClientWriteQueue = BasicWriteQueue<bai::tcp::socket, HandlerAllocator<void>>;
+
+class Client : public std::enable_shared_from_this<Client>
+{
+public:
+  // The message is only valid until the next one is read
+  using ReceiveHandlerT = std::function<void(const boost::system::error_code &error, size_t sz,
+                                             filetransfer::ServerMessage *)>;
+  using ConnectCompletionHandlerT = std::function<void(const boost::system::error_code &error)>;
+
+  Client(ba::io_context &context, const std::string &host, const std::string &port)
+      : mContext(context), mpSocket(std::make_shared<bai::tcp::socket>(context)),
+        mHandlerAllocator(std::make_shared<HandlerMemory>()),
+        mpWriteQueue(std::make_shared<ClientWriteQueue>(mpSocket, mHandlerAllocator)), mResolver(context)
+  {
+    mEndpoints = mResolver.resolve(host, port);
+  }
+
+  void Start(ConnectCompletionHandlerT connectHandler)
+  {
+    mConnectCompletionHandler = connectHandler;
+    ba::async_connect(*mpSocket, mEndpoints, std::bind(&Client::ConnectHandler, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+  }
+
+  void Stop()
+  {
+    mContext.post([self = shared_from_this()] () { self->mpSocket->close(); });
+  }
+
+  ba::io_context &GetContext()
+  {
+    return mContext;
+  }
+
+  // Queues message behind whatever is still being sent, handler runs once it has been written. pOwner is kept alive
+  // until then (BasicWriteQueue::Push).
+  void Send(const filetransfer::ClientMessage &message,
+            std::function<void(const boost::system::error_code &, size_t)> handler,
+            std::shared_ptr<void> pOwner = nullptr)
+  {
+    mpWriteQueue->Push(message, std::move(handler), mProtocolVersion, std::move(pOwner));
+  }
+
+#if FILETRANSFER_HAS_ZERO_COPY
+  // Sends message as a raw data frame descriptor followed by length bytes of fd, sent with sendfile
+  void SendWithFileData(const filetransfer::ClientMessage &message, int fd, uint64_t offset, size_t length,
+                        std::function<void(const boost::system::error_code &, size_t)> handler,
+                        std::shared_ptr<void> pOwner = nullptr)
+  {
+    mpWriteQueue->PushWithFileData(message, fd, offset, length, std::move(handler), mProtocolVersion,
+                                   std::move(pOwner));
+  }
+#endif
+
+  // Registers the handler of a new stream's server messages and returns the stream's ID for the messages sent on
+  // it. The first stream is 0, the only one a server without streams answers on. The handler stays registered
+  // until CloseStream, so it should hold its owner weakly.
+  uint32_t OpenStream(const ReceiveHandlerT &handler)
+  {
+    const uint32_t streamId = mNextStreamId++;
+    mStreamHandlers[streamId] = std::make_shared<ReceiveHandlerT>(handler);
+    return streamId;
+  }
+
+  void CloseStream(uint32_t streamId)
+  {
+    mStreamHandlers.erase(streamId);
+  }
+
+  const ClientWriteQueue &GetWriteQueue() const
+  {
+    return *mpWriteQueue;
+  }
+
+  // Frame version of everything sent from here on, as agreed with the server
+  void SetProtocolVersion(uint8_t version)
+  {
+    mProtocolVersion = version;
+  }
+
+private:
+  void ConnectHandler(const boost::system::error_code &error, const bai::tcp::endpoint &endpoint)
+  {
+    if (!error)
+    {
+      LOG_INFO("Client is connected to the server: " << endpoint);
+      // Chunks are pipelined, don't let Nagle hold them back until the previous one is acknowledged
+      boost::system::error_code ignored;
+      mpSocket->set_option(bai::tcp::no_delay(true), ignored);
+      ReadHeader();
+    }
+    else
+    {
+      LOG_ERROR("Connect error: " << error.message());
+    }
+
+    if (mConnectCompletionHandler)
+    {
+      mConnectCompletionHandler(error);
+    }
+  }
+
+  void ReadHeader()
+  {
+    auto self(shared_from_this());
+    AsyncReadProtobufMessageHeader(*mpSocket, mHeader,
+                                   BindAllocator(mHandlerAllocator, [self](const boost::system::error_code &error, size_t sz)
+                                   {
+                                     self->HandleReadHeader(error, sz);
+                                   }));
+  }
+
+  void ReadPayload()
+  {
+    auto self(shared_from_this());
+    LOG_DEBUG("mBuffer size: " << mHeader.mPayloadSize);
+    AsyncReadProtobufMessagePayload(*mpSocket, mHeader, mData, mMessage,
+                                    BindAllocator(mHandlerAllocator, [self](const boost::system::error_code &error, size_t sz,
+                                           filetransfer::ServerMessage *message)
+                                    {
+                                      self->HandleReadPayload(error, sz, message);
+                                    }));
+  }
+
+  void HandleReadHeader(const boost::system::error_code &error, size_t transferredByte)
+  {
+    if (!error)
+    {
+      LOG_DEBUG("Read payload");
+      ReadPayload();
+    }
+    else
+    {
+      if (error == ba::error::eof)
+      {
+        LOG_INFO("EOF error");
+        return;
+      }
+      LOG_INFO("Error in HandleReadHeader: " << error.message());
+    }
+  }
+
+  void HandleReadPayload(const boost::system::error_code &error, size_t transferredByte,
+                         filetransfer::ServerMessage *message)
+  {
+    if (!error && message)
+    {
+      auto it = mStreamHandlers.find(message->stream_id());
+      if (it != mStreamHandlers.end())
+      {
+        // The handler may close its stream, keep it alive until it returns
+        std::shared_ptr<ReceiveHandlerT> pHandler = it->second;
+        (*pHandler)(error, transferredByte, message);
+      }
+      else
+      {
+        LOG_ERROR("Message for unknown stream " << message->stream_id());
+      }
+      ReadHeader();
+    }
+    else
+    {
+      if (error == ba::error::eof)
+      {
+        LOG_INFO("EOF error");
+        return;
+      }
+
+      LOG_INFO("Error in HandleReadPayload: " << error.message());
+    }
+  }
+
+  ba::io_context& mContext;
+  std::shared_ptr<bai::tcp::socket> mpSocket;
+  HandlerAllocator<void> mHandlerAllocator; // Over the memory of the connection's asynchronous operations
+  std::shared_ptr<ClientWriteQueue> mpWriteQueue;
+  bai::tcp::resolver mResolver;
+  bai::tcp::resolver::results_type mEndpoints;
+  ProtocolHeader mHeader;   // Of the frame being read
+  std::vector<char> mData;  // Its payload, only ever grows
+  InboundMessage<filetransfer::ServerMessage> mMessage;
+  std::map<uint32_t, std::shared_ptr<ReceiveHandlerT>> mStreamHandlers;
+  uint32_t mNextStreamId{0};
+  ConnectCompletionHandlerT mConnectCompletionHandler;
+  uint8_t mProtocolVersion{PROTOCOL_VERSION_MIN};
+};
+
+enum class FileHandlerState : uint8_t
+{
+  INIT = 0,
+  TRANSFER = 1,
+  COMPLETE_CHECK = 2,
+  COMPLETED = 3,
+  FAILED = 4,
+  STOPPED = 5,
+  SIGNATURES = 6 // Receiving the block signatures of the server's copy for a delta upload
+};
+
+// Limits on how much unacknowledged data may be in flight. The server acknowledges
+// cumulatively (FileUploadStatus.bytes_received), which slides the window forward.
+struct SendWindowConfig
+{
+  size_t mMaxChunks{16};           // 1 means stop-and-wait
+  uint64_t mMaxBytes{64ULL << 20}; // 0 means no byte limit
+  // Chunks queued for sending but not written to the socket yet. They are held in memory until then; several
+  // of them go out in a single gather write.
+  size_t mMaxQueuedChunks{8};
+};
+
+struct TransferConfig
+{
+  uint32_t mChunkSize{DEFAULT_CHUNK_SIZE}; // Proposed to the server, which may lower it
+  bool mRawDataFrames{false};              // Ask for raw data frames, chunk data is sent with sendfile
+  SendWindowConfig mWindow;
+  size_t mConnections{1};                  // Connections a file is uploaded over in parallel (ParallelUpload)
+  size_t mStreams{4};                      // Files uploaded at once over one connection (BatchUpload)
+  bool mResume{true};                      // Continue an interrupted upload of the same file where the server has it
+  bool mDelta{false};                      // Send only what differs from the server's existing copy of the file
+  size_t mReadAheadChunks{4};              // Chunks read ahead of sending on a background thread, 0 reads inline
+  // Called with each chunk's time from being queued for sending until the server acknowledged it
+  std::function<void(std::chrono::steady_clock::duration)> mOnChunkAcked;
+  std::vector<filetransfer::CompressionCodec> mCompression; // Codecs offered for chunk data, preferred first
+};
+
+// Part of a file sent by one connection of a parallel upload
+struct FileRange
+{
+  std::string mTransferId; // Shared by all connections of the upload
+  uint64_t mOffset{0};
+  uint64_t mLength{0};
+};
+
+class FileHandler : public std::enable_shared_from_this<FileHandler>
+{
+public:
+  using TransferCompletionHandlerT = std::function<void(bool success, const std::string &filename)>;
+  using ChunkAckedHandlerT = std::function<void(std::chrono::steady_clock::duration)>;
+
+  FileHandler(std::shared_ptr<Client> client, const TransferConfig &config = TransferConfig())
+      : mpClient(client), mWindow(config.mWindow), mIsRawDataFrames(config.mRawDataFrames && FILETRANSFER_HAS_ZERO_COPY),
+        mIsResumeRequested(config.mResume), mIsDeltaRequested(config.mDelta), mOfferedCodecs(config.mCompression),
+        mReadAheadChunks(config.mReadAheadChunks), mChunkSize(std::min(std::max<uint32_t>(config.mChunkSize, 1), MAX_CHUNK_SIZE)),
+        mOnChunkAcked(config.mOnChunkAcked)
+  {
+    mWindow.mMaxChunks = std::max<size_t>(mWindow.mMaxChunks, 1);
+  }
+
+  ~FileHandler()
+  {
+    if (mIsStreamOpen)
+    {
+      mpClient->CloseStream(mStreamId);
+    }
+    CloseInput();
+  }
+
+  FileHandlerState GetState() const
+  {
+    return mState;
+  }
+
+  // Sends only this range of the file as part of a parallel upload, must be called before Start
+  void SetRange(const FileRange &range)
+  {
+    mRange = range;
+    mIsRanged = true;
+  }
+
+  // The whole file's checksum, when the caller has it already (the parts of a parallel upload share one), must be
+  // called before Start
+  void SetFileChecksum(uint32_t checksum)
+  {
+    mFileChecksum = checksum;
+    mIsFileChecksumKnown = true;
+  }
+
+  void Start(std::string filename, TransferCompletionHandlerT completionHandler)
+  {
+    // Server messages reach the handler only while it is alive
+    std::weak_ptr<FileHandler> pWeakSelf = weak_from_this();
+    mStreamId = mpClient->OpenStream([pWeakSelf](const boost::system::error_code &error, size_t sz,
+                                                 filetransfer::ServerMessage *message) {
+      if (auto self = pWeakSelf.lock())
+      {
+        self->ReadHandler(error, sz, message);
+      }
+    });
+    mIsStreamOpen = true;
+    mChunkMessage.set_stream_id(mStreamId);
+    mInputFilename = filename;
+    mFilename = fs::path(mInputFilename).filename().string();
+    mCompletionHandler = completionHandler;
+
+    fs::path filePath(mInputFilename);
+
+    if (!fs::exists(filePath))
+    {
+      LOG_ERROR("Error: File not found: " << mInputFilename);
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+
+    mInputFileSize = fs::file_size(filePath);
+    mInputFd = ::open(mInputFilename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (mInputFd < 0)
+    {
+      LOG_ERROR("Error: Input file could not be opened: " << mInputFilename);
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+
+    mRangeStart = 0;
+    mRangeEnd = mInputFileSize;
+    if (mIsRanged)
+    {
+      if (mRange.mOffset > mInputFileSize || mRange.mLength > mInputFileSize - mRange.mOffset)
+      {
+        LOG_ERROR("Error: Range is outside of the file: " << mInputFilename);
+        mState = FileHandlerState::FAILED;
+        SetTransferResult(false);
+        return;
+      }
+      mRangeStart = mRange.mOffset;
+      mRangeEnd = mRange.mOffset + mRange.mLength;
+    }
+    mNextOffset = mAckedOffset = mRangeStart;
+
+    // The resume identity, and the checksum the server verifies a resumed file against. Reading the whole file
+    // for it is the price of resuming, --no-resume skips it.
+    struct stat status;
+    if (mIsResumeRequested &&
+        (::fstat(mInputFd, &status) != 0 || !SampledFileHash(mInputFd, mInputFileSize, mFileHash) ||
+         (!mIsFileChecksumKnown && !FileChecksum(mInputFd, mInputFileSize, mFileChecksum))))
+    {
+      LOG_ERROR("Error: Input file could not be read: " << mInputFilename);
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+    if (mIsResumeRequested)
+    {
+      mFileMtime = static_cast<uint64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+    }
+  }
+
+  void SendInitialFileRequest()
+  {
+    if (mState != FileHandlerState::INIT)
+    {
+      LOG_ERROR("FileHandler already started or in a non-initial state.");
+      return;
+    }
+
+    filetransfer::ClientMessage message;
+    message.set_stream_id(mStreamId);
+    message.mutable_file_request()->set_filename(mFilename);
+    message.mutable_file_request()->set_filesize(mInputFileSize);
+    message.mutable_file_request()->set_chunk_size(mChunkSize);
+    message.mutable_file_request()->set_raw_data_frames(mIsRawDataFrames);
+    message.mutable_file_request()->set_resume(mIsResumeRequested);
+    message.mutable_file_request()->set_file_hash(mFileHash);
+    message.mutable_file_request()->set_file_mtime(mFileMtime);
+    message.mutable_file_request()->set_file_checksum(mFileChecksum);
+    message.mutable_file_request()->set_delta(mIsDeltaRequested && !mIsRanged);
+    for (auto codec : mOfferedCodecs)
+    {
+      message.mutable_file_request()->add_compression(codec);
+    }
+    message.mutable_file_request()->set_protocol_version(PROTOCOL_VERSION);
+    message.mutable_file_request()->set_compact_acks(true);
+    message.mutable_file_request()->set_send_window_chunks(static_cast<uint32_t>(mWindow.mMaxChunks));
+    message.mutable_file_request()->set_send_window_bytes(mWindow.mMaxBytes);
+    if (mIsRanged)
+    {
+      message.mutable_file_request()->set_transfer_id(mRange.mTransferId);
+      message.mutable_file_request()->set_range_offset(mRange.mOffset);
+      message.mutable_file_request()->set_range_length(mRange.mLength);
+    }
+
+    LOG_INFO("Sending file transfer request for: " << fs::path(mInputFilename).filename());
+    mpClient->Send(message, std::bind(&FileHandler::FileRequestSentHandler, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+  }
+
+  void Stop()
+  {
+    if (mState != FileHandlerState::COMPLETED && mState != FileHandlerState::FAILED && mState != FileHandlerState::STOPPED)
+    {
+      mIsStopRequested = true;
+      LOG_INFO("\nStop requested for file transfer.");
+    }
+    CloseInput();
+  }
+
+private:
+  void FileRequestSentHandler(const boost::system::error_code &error, size_t /*bytes_transferred*/)
+  {
+    if (error)
+    {
+      LOG_ERROR("\nFile request send error: " << error.message());
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+    }
+    else
+    {
+      // Request sent, now waiting for server's initial status message in ReadHandler.
+      // No state change here.
+    }
+  }
+
+  void ReadHandler(const boost::system::error_code &error,
+                   size_t /*bytesTransferred*/,
+                   filetransfer::ServerMessage *message)
+  {
+
+    if (error)
+    {
+      if (mState != FileHandlerState::COMPLETED && mState != FileHandlerState::FAILED && mState != FileHandlerState::STOPPED)
+      {
+        mState = FileHandlerState::FAILED;
+        SetTransferResult(false);
+      }
+      return;
+    }
+
+    if (message && message->has_ack())
+    {
+      HandleAck(message->ack().bytes_received());
+      return;
+    }
+
+    if (message && message->has_block_signatures())
+    {
+      HandleBlockSignatures(message->block_signatures());
+      return;
+    }
+
+    if (!message || !message->has_upload_status())
+    {
+      LOG_ERROR("Received invalid or unexpected message from server (no upload status).");
+      if (mState != FileHandlerState::COMPLETED && mState != FileHandlerState::FAILED && mState != FileHandlerState::STOPPED)
+      {
+        mState = FileHandlerState::FAILED;
+        SetTransferResult(false);
+      }
+      return;
+    }
+
+    const auto &status = message->upload_status();
+    const auto success = status.success();
+    const auto &filename = status.filename();
+    const auto &statusMessage = status.status_message();
+    const auto bytesReceived = status.bytes_received();
+
+    LOG_STATUS("\r" << "Server Status for " << filename << ": " << statusMessage
+               << " (" << bytesReceived << " bytes received by server)");
+
+    if (mIsStopRequested)
+    {
+      LOG_INFO("\nFile transfer stopped by request.");
+      mState = FileHandlerState::STOPPED;
+      SetTransferResult(false);
+      return;
+    }
+
+    switch (mState)
+    {
+    case FileHandlerState::INIT:
+    {
+      if (success)
+      {
+        // Servers that don't negotiate leave chunk_size unset, keep our proposal then
+        if (status.chunk_size() != 0)
+        {
+          mChunkSize = std::min(status.chunk_size(), mChunkSize);
+        }
+        mIsRawDataFrames = mIsRawDataFrames && status.raw_data_frames();
+        mCompression = IsCodecSupported(status.compression()) ? status.compression() : filetransfer::COMPRESSION_NONE;
+        mpClient->SetProtocolVersion(NegotiateProtocolVersion(status.protocol_version()));
+        if (mIsDeltaRequested && status.delta_block_size() != 0)
+        {
+          // Chunks are computed against the server's copy once all of its signatures are in
+          mDeltaBlockSize = status.delta_block_size();
+          mState = FileHandlerState::SIGNATURES;
+          break;
+        }
+        // The server already has our range up to resume_offset from an interrupted upload
+        if (mIsResumeRequested && status.resume_offset() > mRangeStart && status.resume_offset() <= mRangeEnd)
+        {
+          LOG_INFO("\nResuming upload at offset " << status.resume_offset());
+          mNextOffset = mAckedOffset = status.resume_offset();
+        }
+        mState = FileHandlerState::TRANSFER;
+        StartReadAhead();
+        FillWindow(); // Start sending the first window of chunks
+      }
+      else
+      {
+        mState = FileHandlerState::FAILED;
+        LOG_ERROR("\nTransfer initialization error from server: " << statusMessage);
+        SetTransferResult(false);
+      }
+      break;
+    }
+    case FileHandlerState::TRANSFER:
+    {
+      if (success)
+      {
+        SlideWindow(bytesReceived);
+      }
+      else
+      {
+        LOG_ERROR("\nTransfer error from server: " << statusMessage);
+        mState = FileHandlerState::FAILED;
+        SetTransferResult(false);
+      }
+      break;
+    }
+    case FileHandlerState::COMPLETE_CHECK:
+    {
+      // A range is only done once the server has every range of the file
+      if (success && bytesReceived >= mInputFileSize && (!mIsRanged || status.transfer_complete()))
+      {
+        LOG_INFO("\nTransfer completed successfully: " << filename);
+        if (mpDeltaEncoder)
+        {
+          LOG_INFO("Delta: " << mpDeltaEncoder->MatchedBytes() << " of " << mInputFileSize
+                   << " bytes matched the server's copy");
+        }
+        if (mCompression != filetransfer::COMPRESSION_NONE)
+        {
+          LOG_INFO("Compression (" << CodecName(mCompression) << "): " << mCompressionStats.mRawBytes << " -> "
+                   << mCompressionStats.mWireBytes << " bytes (ratio " << mCompressionStats.Ratio() << "), "
+                   << mCompressionStats.mCompressedChunks << " chunks compressed, " << mCompressionStats.mBypassedChunks
+                   << " sent as is, " << mCompressionStats.mCpuNanos / 1e6 << " ms CPU compressing");
+        }
+        if (mpReadAhead)
+        {
+          LOG_INFO("Read ahead: sending waited for the disk " << mpReadAhead->ConsumerStalls()
+                   << " times, the reader for the network " << mpReadAhead->ReaderStalls() << " times");
+        }
+        const ClientWriteQueue &writeQueue = mpClient->GetWriteQueue();
+        LOG_INFO("Sent " << writeQueue.WrittenFrames() << " frames in " << writeQueue.Writes() << " writes");
+        mState = FileHandlerState::COMPLETED;
+        SetTransferResult(true);
+      }
+      else
+      {
+        LOG_ERROR("\nTransfer completion check error or size mismatch: " << statusMessage);
+        mState = FileHandlerState::FAILED;
+        SetTransferResult(false);
+      }
+      break;
+    }
+    case FileHandlerState::SIGNATURES:
+    case FileHandlerState::COMPLETED:
+    case FileHandlerState::FAILED:
+    case FileHandlerState::STOPPED:
+    default:
+    {
+      LOG_ERROR("\nUnexpected message in terminal state " << static_cast<int>(mState) << ": " << statusMessage);
+      break;
+    }
+    };
+  }
+
+  void HandleBlockSignatures(const filetransfer::BlockSignatures &signatures)
+  {
+    if (mState != FileHandlerState::SIGNATURES || signatures.first_block() != mBasisWeak.size() ||
+        signatures.weak_size() != signatures.strong_size())
+    {
+      LOG_ERROR("\nUnexpected block signatures from server.");
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+    mBasisWeak.insert(mBasisWeak.end(), signatures.weak().begin(), signatures.weak().end());
+    mBasisStrong.insert(mBasisStrong.end(), signatures.strong().begin(), signatures.strong().end());
+    if (!signatures.is_last())
+    {
+      return;
+    }
+
+    mpInputMapping = std::make_unique<MappedFile>(mInputFd, mInputFileSize);
+    if (!mpInputMapping->IsValid())
+    {
+      LOG_ERROR("\nInput file could not be mapped: " << mInputFilename);
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+    LOG_INFO("\nReceived " << mBasisWeak.size() << " block signatures of " << mDeltaBlockSize << " bytes");
+    mpDeltaEncoder = std::make_unique<DeltaEncoder>(mpInputMapping->Data(), mInputFileSize, mDeltaBlockSize,
+                                                    mBasisWeak, mBasisStrong);
+    mState = FileHandlerState::TRANSFER;
+    FillWindow();
+  }
+
+  // Compact cumulative ack (UploadAck). It only moves the window, errors and completion still come as FileUploadStatus.
+  void HandleAck(uint64_t bytesReceived)
+  {
+    LOG_STATUS("\r" << "Server acknowledged " << bytesReceived << " bytes");
+
+    if (mIsStopRequested)
+    {
+      LOG_INFO("\nFile transfer stopped by request.");
+      mState = FileHandlerState::STOPPED;
+      SetTransferResult(false);
+      return;
+    }
+    if (mState == FileHandlerState::TRANSFER)
+    {
+      SlideWindow(bytesReceived);
+    }
+  }
+
+  // Server's received bytes are cumulative from the start of our range, slide the window up to them
+  void SlideWindow(uint64_t bytesReceived)
+  {
+    mAckedOffset = std::max<uint64_t>(mAckedOffset, mRangeStart + bytesReceived);
+    while (!mInFlightChunks.empty() && mInFlightChunks.front().mEnd <= mAckedOffset)
+    {
+      if (mOnChunkAcked)
+      {
+        mOnChunkAcked(std::chrono::steady_clock::now() - mInFlightChunks.front().mQueuedAt);
+      }
+      mInFlightChunks.pop_front();
+    }
+    FillWindow();
+  }
+
+  bool IsWindowOpen() const
+  {
+    if (mInFlightChunks.size() >= mWindow.mMaxChunks)
+    {
+      return false;
+    }
+    // Always allow one chunk when nothing is in flight, so a small byte limit cannot stall the transfer
+    return mWindow.mMaxBytes == 0 || mInFlightChunks.empty() || (mNextOffset - mAckedOffset) < mWindow.mMaxBytes;
+  }
+
+  // Chunk data comes from a reader thread that stays a few chunks ahead, so reading the next chunk overlaps with
+  // sending the previous ones. Raw data frames are sent from the file by the kernel and delta uploads encode from
+  // a mapping, both keep reading inline.
+  void StartReadAhead()
+  {
+    if (mReadAheadChunks == 0 || mIsRawDataFrames || mNextOffset >= mRangeEnd)
+    {
+      return;
+    }
+    std::weak_ptr<FileHandler> weakSelf = weak_from_this();
+    mpReadAhead = std::make_unique<ReadAhead>(mInputFd, mNextOffset, mRangeEnd, mChunkSize, mReadAheadChunks,
+                                              mpClient->GetContext().get_executor(),
+                                              [weakSelf]()
+                                              {
+                                                if (auto self = weakSelf.lock())
+                                                {
+                                                  self->mIsWaitingForRead = false;
+                                                  self->FillWindow();
+                                                }
+                                              });
+  }
+
+  // Keeps at most one write outstanding on the socket; ChunkSentHandler re-enters until the window is full.
+  void FillWindow()
+  {
+    if (mState != FileHandlerState::TRANSFER)
+    {
+      return;
+    }
+
+    if (mAckedOffset >= mRangeEnd)
+    {
+      mState = FileHandlerState::COMPLETE_CHECK;
+      SendUploadFinishedMessage();
+      return;
+    }
+
+    // Chunks queued behind a write in progress go out together with the next one
+    while (mState == FileHandlerState::TRANSFER && mNextOffset < mRangeEnd && IsWindowOpen() &&
+           mQueuedChunks < std::max<size_t>(mWindow.mMaxQueuedChunks, 1) && !mIsWaitingForRead)
+    {
+      SendNextChunk(mNextOffset);
+    }
+  }
+
+  void SendNextChunk(uint64_t offset)
+  {
+    if (mIsStopRequested)
+    {
+      mState = FileHandlerState::STOPPED;
+      SetTransferResult(false);
+      return;
+    }
+
+    if (mInputFd < 0)
+    {
+      LOG_ERROR("File is not open, cannot send chunk.");
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+
+    if (offset >= mRangeEnd)
+    {
+      LOG_INFO("\nAll local data read. Sending finalization message.");
+      SendUploadFinishedMessage();
+      return;
+    }
+
+    // Every chunk is built in the same message, cleared in place so its strings keep their capacity. The write
+    // queue serializes it right away, and the sent handler only captures this while the queue holds the reference
+    // keeping this alive, so a steady stream of chunks allocates nothing.
+    auto sentHandler = [this](const boost::system::error_code &error, size_t bytesTransferred)
+    { ChunkSentHandler(error, bytesTransferred); };
+    std::shared_ptr<void> pOwner = shared_from_this();
+
+    if (mpDeltaEncoder)
+    {
+      // Literal runs and references to the server's blocks describing the next chunk size bytes of the file
+      filetransfer::DeltaChunk *deltaChunk = mChunkMessage.mutable_delta_chunk();
+      deltaChunk->Clear();
+      mpDeltaEncoder->NextChunk(*deltaChunk, mChunkSize);
+      deltaChunk->set_filename(mFilename);
+
+      mNextOffset = deltaChunk->offset() + deltaChunk->target_length();
+      mInFlightChunks.push_back({mNextOffset, std::chrono::steady_clock::now()});
+      ++mQueuedChunks;
+      mpClient->Send(mChunkMessage, sentHandler, std::move(pOwner));
+      return;
+    }
+
+    filetransfer::FileChunk *fileChunk = mChunkMessage.mutable_file_chunk();
+    fileChunk->Clear();
+    fileChunk->set_filename(mFilename);
+    fileChunk->set_offset(offset);
+    const size_t length = std::min<uint64_t>(mChunkSize, mRangeEnd - offset);
+
+#if FILETRANSFER_HAS_ZERO_COPY
+    if (mIsRawDataFrames)
+    {
+      // Only a descriptor is serialized, the file data goes from the file to the socket in the kernel
+      fileChunk->set_raw_length(static_cast<uint32_t>(length));
+      fileChunk->set_is_last_chunk((offset + length) >= mRangeEnd);
+
+      mNextOffset = offset + length;
+      mInFlightChunks.push_back({mNextOffset, std::chrono::steady_clock::now()});
+      ++mQueuedChunks;
+      mpClient->SendWithFileData(mChunkMessage, mInputFd, offset, length, sentHandler, std::move(pOwner));
+      return;
+    }
+#endif
+
+    // Uncompressed data is read straight into the message, data to compress into a buffer first
+    std::string &readBuffer = mCompression == filetransfer::COMPRESSION_NONE ? *fileChunk->mutable_data() : mReadBuffer;
+    ssize_t bytesRead = -1;
+    if (mpReadAhead)
+    {
+      // The read chunk's buffer is swapped in, ours goes back to the reader for a later chunk
+      uint64_t readOffset = 0;
+      bool isReadError = false;
+      if (!mpReadAhead->Take(readBuffer, readOffset, isReadError))
+      {
+        mIsWaitingForRead = true; // The reader resumes FillWindow once the chunk is in
+        return;
+      }
+      if (!isReadError && readOffset == offset)
+      {
+        bytesRead = static_cast<ssize_t>(readBuffer.length());
+      }
+    }
+    else
+    {
+      readBuffer.resize(length);
+      bytesRead = ReadAllAt(mInputFd, &readBuffer[0], length, offset);
+    }
+
+    if (bytesRead <= 0)
+    {
+      LOG_ERROR("\nNo bytes read from file at offset " << offset << ". Unexpected.");
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+    readBuffer.resize(bytesRead);
+    if (mCompression != filetransfer::COMPRESSION_NONE)
+    {
+      CompressChunkData(*fileChunk, readBuffer);
+    }
+    fileChunk->set_is_last_chunk((offset + bytesRead) >= mRangeEnd);
+
+    mNextOffset = offset + bytesRead;
+    mInFlightChunks.push_back({mNextOffset, std::chrono::steady_clock::now()});
+    ++mQueuedChunks;
+    mpClient->Send(mChunkMessage, sentHandler, std::move(pOwner));
+  }
+
+  // Compresses data into the chunk while the policy says that pays off, otherwise (or if it doesn't shrink) sends
+  // it as is
+  void CompressChunkData(filetransfer::FileChunk &chunk, const std::string &data)
+  {
+    const size_t length = data.length();
+    mCompressionStats.mRawBytes += length;
+    if (mCompressionPolicy.ShouldCompress())
+    {
+      std::string &compressed = *chunk.mutable_data();
+      const uint64_t start = ThreadCpuNanos();
+      const bool isCompressed = CompressChunk(mCompression, data.data(), length, compressed);
+      mCompressionStats.mCpuNanos += ThreadCpuNanos() - start;
+      if (isCompressed)
+      {
+        mCompressionPolicy.Record(length, compressed.length());
+      }
+      if (isCompressed && compressed.length() < length)
+      {
+        chunk.set_compression(mCompression);
+        chunk.set_uncompressed_length(static_cast<uint32_t>(length));
+        mCompressionStats.mWireBytes += compressed.length();
+        ++mCompressionStats.mCompressedChunks;
+        return;
+      }
+    }
+    mCompressionStats.mWireBytes += length;
+    ++mCompressionStats.mBypassedChunks;
+    chunk.set_data(data);
+  }
+
+  void ChunkSentHandler(const boost::system::error_code &error, size_t /*bytes_transferred*/)
+  {
+    --mQueuedChunks;
+    if (error)
+    {
+      LOG_ERROR("\nError sending file chunk: " << error.message());
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+      return;
+    }
+    // Keep sending while the window is open, otherwise the server's status message (ReadHandler) reopens it
+    FillWindow();
+  }
+
+  void SendUploadFinishedMessage()
+  {
+    filetransfer::ClientMessage sendMessage;
+    sendMessage.set_stream_id(mStreamId);
+    filetransfer::FileUploadFinished *uploadFinished = sendMessage.mutable_upload_finished();
+    uploadFinished->set_filename(mFilename);
+    uploadFinished->set_message("Upload Finished");
+
+    mpClient->Send(sendMessage, std::bind(&FileHandler::UploadFinishedSentHandler, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+  }
+
+  void UploadFinishedSentHandler(const boost::system::error_code &error, size_t /*bytes_transferred*/)
+  {
+    if (error)
+    {
+      LOG_ERROR("\nError sending upload finished message: " << error.message());
+      mState = FileHandlerState::FAILED;
+      SetTransferResult(false);
+    }
+    else
+    {
+      LOG_INFO("\nUpload finished message sent. Waiting for final server confirmation.");
+    }
+  }
+
+  void SetTransferResult(bool success)
+  {
+    if (mCompletionHandler && (mState == FileHandlerState::COMPLETED || mState == FileHandlerState::FAILED || mState == FileHandlerState::STOPPED))
+    {
+      mCompletionHandler(success, mInputFilename);
+      mCompletionHandler = nullptr; // Clear the handler to prevent multiple calls
+    }
+
+    CloseInput();
+  }
+
+  void CloseInput()
+  {
+    mpReadAhead.reset(); // Joins the reader before its file is closed
+    if (mInputFd >= 0)
+    {
+      ::close(mInputFd);
+      mInputFd = -1;
+    }
+  }
+
+  std::shared_ptr<Client> mpClient;
+  uint32_t mStreamId{0}; // Stream of this upload on the client's connection
+  bool mIsStreamOpen{false}; // From Start on
+  FileHandlerState mState{FileHandlerState::INIT};
+  bool mIsStopRequested{false};
+  int mInputFd{-1};
+  std::string mInputFilename;
+  std::string mFilename; // As sent to the server, without the directory
+  uint64_t mInputFileSize = 0;
+  FileRange mRange;
+  bool mIsRanged{false};
+  uint64_t mRangeStart{0};
+  uint64_t mRangeEnd{0};
+  SendWindowConfig mWindow;
+  bool mIsRawDataFrames;
+  bool mIsResumeRequested;
+  uint32_t mFileHash{0};
+  uint64_t mFileMtime{0};
+  uint32_t mFileChecksum{0};
+  bool mIsFileChecksumKnown{false};
+  bool mIsDeltaRequested;
+  uint32_t mDeltaBlockSize{0};
+  std::vector<uint32_t> mBasisWeak;
+  std::vector<uint64_t> mBasisStrong;
+  std::unique_ptr<MappedFile> mpInputMapping;
+  std::unique_ptr<DeltaEncoder> mpDeltaEncoder;
+  std::vector<filetransfer::CompressionCodec> mOfferedCodecs;
+  size_t mReadAheadChunks;
+  std::unique_ptr<ReadAhead> mpReadAhead;
+  bool mIsWaitingForRead{false}; // Next chunk isn't read yet, the reader resumes sending
+  filetransfer::CompressionCodec mCompression{filetransfer::COMPRESSION_NONE};
+  CompressionPolicy mCompressionPolicy;
+  CompressionStats mCompressionStats;
+  uint32_t mChunkSize;
+  uint64_t mNextOffset{0};
+  uint64_t mAckedOffset{0};
+  struct InFlightChunk
+  {
+    uint64_t mEnd;
+    std::chrono::steady_clock::time_point mQueuedAt;
+  };
+  std::deque<InFlightChunk> mInFlightChunks;
+  ChunkAckedHandlerT mOnChunkAcked;
+  size_t mQueuedChunks{0}; // Sent to the write queue, not written yet
+  filetransfer::ClientMessage mChunkMessage; // Reused for every chunk
+  std::string mReadBuffer;                   // Chunk data read for compression
+  TransferCompletionHandlerT mCompletionHandler;
+};
+
+// Fetches a file from the server's uploads directory into downloads/, on a stream of the client's connection.
+// Chunks are written as they arrive and acknowledged cumulatively, twice per window, which lets the server send
+// further chunks.
+class FileDownloader : public std::enable_shared_from_this<FileDownloader>
+{
+public:
+  using TransferCompletionHandlerT = FileHandler::TransferCompletionHandlerT;
+
+  FileDownloader(std::shared_ptr<Client> client, const TransferConfig &config = TransferConfig())
+      : mpClient(client), mChunkSize(std::min(std::max<uint32_t>(config.mChunkSize, 1), MAX_CHUNK_SIZE)),
+        mWindowChunks(std::max<size_t>(config.mWindow.mMaxChunks, 1))
+  {
+  }
+
+  ~FileDownloader()
+  {
+    if (mIsStreamOpen)
+    {
+      mpClient->CloseStream(mStreamId);
+    }
+    CloseOutput();
+  }
+
+  // Must be called once the client is connected
+  void Start(const std::string &filename, TransferCompletionHandlerT completionHandler)
+  {
+    // Server messages reach the downloader only while it is alive
+    std::weak_ptr<FileDownloader> pWeakSelf = weak_from_this();
+    mStreamId = mpClient->OpenStream([pWeakSelf](const boost::system::error_code &error, size_t sz,
+                                                 filetransfer::ServerMessage *message) {
+      if (auto self = pWeakSelf.lock())
+      {
+        self->ReadHandler(error, sz, message);
+      }
+    });
+    mIsStreamOpen = true;
+    mAckMessage.set_stream_id(mStreamId);
+    mFilename = filename;
+    mCompletionHandler = completionHandler;
+
+    fs::create_directories("downloads");
+    // The server only serves plain names, never write outside downloads/ whatever was asked for
+    mOutputPath = "downloads/" + fs::path(mFilename).filename().string();
+    mOutputFd = ::open(mOutputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (mOutputFd < 0)
+    {
+      LOG_ERROR("Error: Output file could not be opened: " << mOutputPath);
+      Finish(false);
+      return;
+    }
+
+    filetransfer::ClientMessage message;
+    message.set_stream_id(mStreamId);
+    filetransfer::FileDownloadRequest *request = message.mutable_download_request();
+    request->set_filename(mFilename);
+    request->set_chunk_size(mChunkSize);
+    request->set_window_chunks(static_cast<uint32_t>(mWindowChunks));
+    LOG_INFO("Sending file download request for: " << mFilename);
+    mStartTime = std::chrono::steady_clock::now();
+    auto self(shared_from_this());
+    mpClient->Send(message, [self](const boost::system::error_code &error, size_t /*sz*/)
+                   {
+                     if (error)
+                     {
+                       LOG_ERROR("\nFile request send error: " << error.message());
+                       self->Finish(false);
+                     }
+                   });
+  }
+
+private:
+  void ReadHandler(const boost::system::error_code &error, size_t /*bytesTransferred*/,
+                   filetransfer::ServerMessage *message)
+  {
+    if (error || !message || !mCompletionHandler)
+    {
+      return;
+    }
+    if (message->has_download_status())
+    {
+      const auto &status = message->download_status();
+      if (!status.success())
+      {
+        LOG_ERROR("\nDownload error from server: " << status.status_message());
+        Finish(false);
+        return;
+      }
+      mFileSize = status.filesize();
+      mChunkSize = status.chunk_size() != 0 ? status.chunk_size() : mChunkSize;
+      if (mFileSize == 0)
+      {
+        Finish(true);
+      }
+      return;
+    }
+    if (message->has_download_chunk())
+    {
+      HandleChunk(message->download_chunk());
+      return;
+    }
+    LOG_ERROR("Received unexpected message from server for download of " << mFilename);
+  }
+
+  void HandleChunk(const filetransfer::FileChunk &chunk)
+  {
+    if (chunk.offset() != mReceived || !WriteAllAt(mOutputFd, chunk.data().data(), chunk.data().length(), chunk.offset()))
+    {
+      LOG_ERROR("\nDownloaded chunk couldn't be written at offset " << chunk.offset());
+      Finish(false);
+      return;
+    }
+    mReceived += chunk.data().length();
+    ++mUnackedChunks;
+
+    LOG_STATUS("\r" << "Downloaded " << mReceived << " of " << mFileSize << " bytes of " << mFilename);
+
+    const bool isComplete = mReceived >= mFileSize || chunk.is_last_chunk();
+    if (!isComplete && mUnackedChunks < std::max<size_t>(mWindowChunks / 2, 1))
+    {
+      return;
+    }
+    mUnackedChunks = 0;
+    mAckMessage.mutable_download_ack()->set_offset(mReceived);
+    if (!isComplete)
+    {
+      mpClient->Send(mAckMessage, nullptr);
+      return;
+    }
+    // Done once the server knows, so it can let go of the file
+    auto self(shared_from_this());
+    mpClient->Send(mAckMessage, [self](const boost::system::error_code &error, size_t /*sz*/)
+                   { self->Finish(!error && self->mReceived == self->mFileSize); });
+  }
+
+  void Finish(bool success)
+  {
+    CloseOutput();
+    if (!mCompletionHandler)
+    {
+      return;
+    }
+    if (success)
+    {
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartTime).count();
+      LOG_INFO("\nDownload completed successfully: " << mOutputPath << " (" << mFileSize << " bytes in " << seconds
+               << " s, " << mFileSize / (1024.0 * 1024.0) / std::max(seconds, 1e-9) << " MiB/s)");
+    }
+    auto handler = std::move(mCompletionHandler);
+    mCompletionHandler = nullptr;
+    handler(success, mFilename);
+  }
+
+  void CloseOutput()
+  {
+    if (mOutputFd >= 0)
+    {
+      ::close(mOutputFd);
+      mOutputFd = -1;
+    }
+  }
+
+  std::shared_ptr<Client> mpClient;
+  uint32_t mStreamId{0};
+  bool mIsStreamOpen{false}; // From Start on
+  uint32_t mChunkSize;
+  size_t mWindowChunks;
+  std::string mFilename;
+  std::string mOutputPath;
+  int mOutputFd{-1};
+  uint64_t mFileSize{0};
+  uint64_t mReceived{0};
+  size_t mUnackedChunks{0};
+  filetransfer::ClientMessage mAckMessage; // Reused for every ack
+  std::chrono::steady_clock::time_point mStartTime;
+  TransferCompletionHandlerT mCompletionHandler;
+};
+
+// Uploads one file over TransferConfig::mConnections connections at once, each sending one contiguous,
+// chunk aligned range under a shared transfer ID. The server reassembles the ranges and confirms each
+// connection once the whole file is on disk. With one connection this is a plain FileHandler upload.
+class ParallelUpload : public std::enable_shared_from_this<ParallelUpload>
+{
+public:
+  using TransferCompletionHandlerT = FileHandler::TransferCompletionHandlerT;
+
+  ParallelUpload(ba::io_context &context, const std::string &host, const std::string &port,
+                 const TransferConfig &config = TransferConfig())
+      : mContext(context), mHost(host), mPort(port), mConfig(config)
+  {
+  }
+
+  void Start(const std::string &filename, TransferCompletionHandlerT completionHandler)
+  {
+    mFilename = filename;
+    mCompletionHandler = completionHandler;
+
+    boost::system::error_code error;
+    const uint64_t fileSize = fs::file_size(filename, error);
+    if (error)
+    {
+      LOG_ERROR("Error: File not found: " << filename);
+      OnPartDone(false);
+      return;
+    }
+
+    // Never more connections than chunks, so every range has data
+    const uint64_t chunkSize = std::max<uint32_t>(mConfig.mChunkSize, 1);
+    const uint64_t chunks = (fileSize + chunkSize - 1) / chunkSize;
+    // A delta is computed over the whole file, so it always goes over one connection
+    const uint64_t connections = mConfig.mDelta ? 1 : std::max<uint64_t>(std::min<uint64_t>(mConfig.mConnections, chunks), 1);
+    if (connections == 1)
+    {
+      StartPart(nullptr);
+      return;
+    }
+
+    // Every part sends the checksum of the whole file, read once here
+    if (mConfig.mResume)
+    {
+      FileDescriptor file(::open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+      uint32_t checksum = 0;
+      if (file.Get() < 0 || !FileChecksum(file.Get(), fileSize, checksum))
+      {
+        LOG_ERROR("Error: Input file could not be read: " << filename);
+        OnPartDone(false);
+        return;
+      }
+      mFileChecksum = checksum;
+      mIsFileChecksumKnown = true;
+    }
+
+    const std::string transferId = MakeTransferId();
+    const uint64_t rangeLength = (chunks + connections - 1) / connections * chunkSize;
+    LOG_INFO("Uploading " << filename << " over " << connections << " connections, transfer " << transferId);
+    for (uint64_t offset = 0; offset < fileSize && mCompletionHandler; offset += rangeLength)
+    {
+      FileRange range{transferId, offset, std::min(rangeLength, fileSize - offset)};
+      StartPart(&range);
+    }
+  }
+
+  void Stop()
+  {
+    for (auto &part : mParts)
+    {
+      part.second->Stop();
+      part.first->Stop();
+    }
+  }
+
+private:
+  void StartPart(const FileRange *range)
+  {
+    auto client = std::make_shared<Client>(mContext, mHost, mPort);
+    auto fileHandler = std::make_shared<FileHandler>(client, mConfig);
+    if (range)
+    {
+      fileHandler->SetRange(*range);
+    }
+    if (mIsFileChecksumKnown)
+    {
+      fileHandler->SetFileChecksum(mFileChecksum);
+    }
+    mParts.emplace_back(client, fileHandler);
+
+    auto self(shared_from_this());
+    client->Start([self, fileHandler](const boost::system::error_code &error)
+                  {
+                    if (!error)
+                    {
+                      fileHandler->SendInitialFileRequest();
+                    }
+                    else
+                    {
+                      self->OnPartDone(false);
+                    } });
+    fileHandler->Start(mFilename, [self](bool success, const std::string & /*filename*/)
+                       { self->OnPartDone(success); });
+  }
+
+  // Reports success once every part has completed, or failure as soon as one fails. The other
+  // connections are closed then, as the server would keep them waiting for the missing range.
+  void OnPartDone(bool success)
+  {
+    if (!mCompletionHandler)
+    {
+      return;
+    }
+    if (success && ++mCompletedParts < mParts.size())
+    {
+      return;
+    }
+    auto handler = std::move(mCompletionHandler);
+    mCompletionHandler = nullptr;
+    if (!success)
+    {
+      Stop();
+    }
+    handler(success, mFilename);
+  }
+
+  static std::string MakeTransferId()
+  {
+    std::random_device random;
+    std::ostringstream id;
+    for (int i = 0; i < 4; i++)
+    {
+      id << std::hex << std::setw(8) << std::setfill('0') << random();
+    }
+    return id.str();
+  }
+
+  ba::io_context &mContext;
+  std::string mHost;
+  std::string mPort;
+  TransferConfig mConfig;
+  std::string mFilename;
+  uint32_t mFileChecksum{0};
+  bool mIsFileChecksumKnown{false};
+  std::vector<std::pair<std::shared_ptr<Client>, std::shared_ptr<FileHandler>>> mParts;
+  size_t mCompletedParts{0};
+  TransferCompletionHandlerT mCompletionHandler;
+};
+
+// Uploads several files over one connection, up to TransferConfig::mStreams of them at once, each on a stream of
+// its own. The FileHandlers share the Client: their chunks interleave in the same write queue and gather writes
+// while each keeps its own send window. A batch of files costs one handshake and one slow start instead of one per
+// file.
+class BatchUpload : public std::enable_shared_from_this<BatchUpload>
+{
+public:
+  using FileCompletionHandlerT = FileHandler::TransferCompletionHandlerT;
+  using CompletionHandlerT = std::function<void(size_t succeeded, size_t failed)>;
+
+  BatchUpload(ba::io_context &context, const std::string &host, const std::string &port,
+              const TransferConfig &config = TransferConfig())
+      : mContext(context), mpClient(std::make_shared<Client>(context, host, port)), mConfig(config)
+  {
+  }
+
+  // fileHandler runs as each file completes, completionHandler once all of them have
+  void Start(std::vector<std::string> filenames, FileCompletionHandlerT fileHandler, CompletionHandlerT completionHandler)
+  {
+    mFilenames = std::move(filenames);
+    mFileCompletionHandler = fileHandler;
+    mCompletionHandler = completionHandler;
+
+    auto self(shared_from_this());
+    mpClient->Start([self](const boost::system::error_code &error)
+                    {
+                      if (error)
+                      {
+                        // Nothing can be sent, every file fails
+                        self->mFailed = self->mFilenames.size();
+                        self->mNextFile = self->mFilenames.size();
+                        self->CheckDone();
+                        return;
+                      }
+                      self->StartNext();
+                    });
+  }
+
+  void Stop()
+  {
+    for (auto &entry : mActive)
+    {
+      entry.second->Stop();
+    }
+    mpClient->Stop();
+  }
+
+private:
+  void StartNext()
+  {
+    const size_t streams = std::max<size_t>(mConfig.mStreams, 1);
+    while (mActive.size() < streams && mNextFile < mFilenames.size())
+    {
+      const size_t index = mNextFile++;
+      auto fileHandler = std::make_shared<FileHandler>(mpClient, mConfig);
+      mActive[index] = fileHandler;
+      auto self(shared_from_this());
+      fileHandler->Start(mFilenames[index], [self, index](bool success, const std::string &filename)
+                         { self->OnFileDone(index, success, filename); });
+      if (fileHandler->GetState() == FileHandlerState::INIT)
+      {
+        fileHandler->SendInitialFileRequest();
+      }
+    }
+    CheckDone();
+  }
+
+  // Runs inside the finished handler, which is released once it has returned. A failed upload may still have
+  // chunks in the write queue referring to it, it is kept until the whole batch is done.
+  void OnFileDone(size_t index, bool success, const std::string &filename)
+  {
+    auto it = mActive.find(index);
+    if (it == mActive.end())
+    {
+      return;
+    }
+    std::shared_ptr<FileHandler> fileHandler = it->second;
+    mActive.erase(it);
+    if (success)
+    {
+      ++mSucceeded;
+      ba::post(mContext, [fileHandler]() {});
+    }
+    else
+    {
+      ++mFailed;
+      mFailedHandlers.push_back(fileHandler);
+    }
+    if (mFileCompletionHandler)
+    {
+      mFileCompletionHandler(success, filename);
+    }
+    // Start the next file from a fresh handler, not from within the finished one
+    auto self(shared_from_this());
+    ba::post(mContext, [self]() { self->StartNext(); });
+  }
+
+  void CheckDone()
+  {
+    if (!mCompletionHandler || !mActive.empty() || mNextFile < mFilenames.size())
+    {
+      return;
+    }
+    auto handler = std::move(mCompletionHandler);
+    mCompletionHandler = nullptr;
+    handler(mSucceeded, mFailed);
+  }
+
+  ba::io_context &mContext;
+  std::shared_ptr<Client> mpClient;
+  TransferConfig mConfig;
+  std::vector<std::string> mFilenames;
+  size_t mNextFile{0};
+  std::map<size_t, std::shared_ptr<FileHandler>> mActive; // By index into mFilenames
+  std::vector<std::shared_ptr<FileHandler>> mFailedHandlers;
+  size_t mSucceeded{0};
+  size_t mFailed{0};
+  FileCompletionHandlerT mFileCompletionHandler;
+  CompletionHandlerT mCompletionHandler;
+};
+
+#endif // FILETRANSFER_CLIENT_H_
@@ -4,24 +4,36 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <chrono>
 #include <boost/asio.hpp>
 #include <arpa/inet.h> // For htonl/ntohl
 #include <memory>      // For std::shared_ptr, std::unique_ptr
 #include <functional>  // For std::function
 #include <zlib.h>      // For crc32
+#include <unistd.h>    // For pread/pwrite
+#include <sys/mman.h>  // For mmap
+#include "crc32c.h"
+#include "handler_memory.h"
+#include "logger.h"
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
 #include "filetransfer.pb.h"
 
 namespace ba = boost::asio;
 namespace bai = boost::asio::ip;
 
 const short PORT = 12345;
-const size_t CHUNK_SIZE = 4; // 4 MB chunk size
+const uint32_t DEFAULT_CHUNK_SIZE = 1024 * 1024;   // 1 MB, proposed by the client unless configured
+const uint32_t MAX_CHUNK_SIZE = 64 * 1024 * 1024;  // 64 MB, upper bound either side will agree to
 
 // Protocol Header
 struct ProtocolHeader
 {
   uint32_t mMagicBytes;
   uint8_t mVersion;
+  uint8_t mFlags;     // FRAME_FLAG_* bits
+  uint16_t mReserved; // Always zero
   uint32_t mPayloadSize;
   uint32_t mChecksum;
 
@@ -40,117 +52,369 @@ struct ProtocolHeader
   }
 };
 
+static_assert(sizeof(ProtocolHeader) == 16, "ProtocolHeader is sent as is and must stay 16 bytes");
+
 const uint32_t PROTOCOL_MAGIC_BYTES = 0xDEADBEEF;
-const uint8_t PROTOCOL_VERSION = 0x01;
+// The frame version selects the payload checksum: 1 is zlib's crc32, 2 is CRC32C (hardware accelerated where the
+// CPU has it). Every connection starts at PROTOCOL_VERSION_MIN; the client offers its highest version in the
+// FileTransferRequest and both sides switch to the version the server returns. Frames of any supported version are
+// accepted at any time, each checked according to its own header.
+const uint8_t PROTOCOL_VERSION_MIN = 0x01;
+const uint8_t PROTOCOL_VERSION_CRC32C = 0x02;
+const uint8_t PROTOCOL_VERSION = PROTOCOL_VERSION_CRC32C;
+
+// The payload is a descriptor (FileChunk with raw_length set) and raw_length bytes of file data follow it
+// on the wire, outside of the payload and its checksum. Only sent once negotiated via raw_data_frames.
+const uint8_t FRAME_FLAG_RAW_DATA = 0x01;
+const uint8_t FRAME_FLAGS_KNOWN = FRAME_FLAG_RAW_DATA;
+
+// pwrite until everything is written
+inline bool WriteAllAt(int fd, const char *data, size_t length, uint64_t offset)
+{
+  while (length > 0)
+  {
+    ssize_t n = ::pwrite(fd, data, length, static_cast<off_t>(offset));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    data += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// pread until length bytes are read or end of file, returns the number of bytes read or -1 on error
+inline ssize_t ReadAllAt(int fd, char *data, size_t length, uint64_t offset)
+{
+  size_t total = 0;
+  while (total < length)
+  {
+    ssize_t n = ::pread(fd, data + total, length - total, static_cast<off_t>(offset + total));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0)
+    {
+      break;
+    }
+    total += n;
+  }
+  return static_cast<ssize_t>(total);
+}
+
+// Whether a client-supplied filename names a file directly in the uploads directory: not empty, no directory
+// separator, no "..", no NUL. Every path the server builds from a filename (the file, its manifest, its delta
+// output) relies on it.
+inline bool IsPlainFilename(const std::string &filename)
+{
+  return !filename.empty() && filename != "." && filename.find('/') == std::string::npos &&
+         filename.find("..") == std::string::npos && filename.find('\0') == std::string::npos;
+}
+
+// Identifies a file's content cheaply enough for multi-GB files: CRC32 over the size and FILE_HASH_SAMPLES blocks
+// spread evenly over the file (all of it when small). Returns false if the file can't be read.
+const size_t FILE_HASH_SAMPLES = 64;
+const size_t FILE_HASH_SAMPLE_SIZE = 64 * 1024;
+
+inline bool SampledFileHash(int fd, uint64_t size, uint32_t &hash)
+{
+  uint64_t sizeBytes = size;
+  uLong crc = crc32(0L, reinterpret_cast<const Bytef *>(&sizeBytes), sizeof(sizeBytes));
+  std::vector<char> sample(FILE_HASH_SAMPLE_SIZE);
+  const uint64_t stride = std::max<uint64_t>(size / FILE_HASH_SAMPLES, FILE_HASH_SAMPLE_SIZE);
+  for (uint64_t offset = 0; offset < size; offset += stride)
+  {
+    ssize_t n = ReadAllAt(fd, sample.data(), std::min<uint64_t>(FILE_HASH_SAMPLE_SIZE, size - offset), offset);
+    if (n < 0)
+    {
+      return false;
+    }
+    crc = crc32(crc, reinterpret_cast<const Bytef *>(sample.data()), static_cast<uInt>(n));
+  }
+  hash = static_cast<uint32_t>(crc);
+  return true;
+}
+
+// CRC32C of the first size bytes of the file, read front to back. Returns false if the file can't be read.
+inline bool FileChecksum(int fd, uint64_t size, uint32_t &checksum)
+{
+  std::vector<char> buffer(1024 * 1024);
+  uint32_t crc = 0;
+  for (uint64_t offset = 0; offset < size;)
+  {
+    const ssize_t n = ReadAllAt(fd, buffer.data(), std::min<uint64_t>(buffer.size(), size - offset), offset);
+    if (n <= 0)
+    {
+      return false;
+    }
+    crc = Crc32c(crc, buffer.data(), static_cast<size_t>(n));
+    offset += static_cast<uint64_t>(n);
+  }
+  checksum = crc;
+  return true;
+}
+
+// Owns a POSIX file descriptor. Shared between a session and its in-flight disk writes,
+// so the descriptor can't be closed (and its number reused) under a pending write.
+class FileDescriptor
+{
+public:
+  explicit FileDescriptor(int fd) : mFd(fd) {}
+  FileDescriptor(const FileDescriptor &) = delete;
+  FileDescriptor &operator=(const FileDescriptor &) = delete;
+  ~FileDescriptor()
+  {
+    if (mFd >= 0)
+    {
+      ::close(mFd);
+    }
+  }
+
+  int Get() const { return mFd; }
+
+private:
+  int mFd;
+};
+
+// Read-only mapping of a whole file. Empty files aren't mapped, Data() is nullptr then.
+class MappedFile
+{
+public:
+  MappedFile(int fd, uint64_t size) : mSize(size)
+  {
+    if (mSize > 0)
+    {
+      void *data = ::mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+      mData = data != MAP_FAILED ? static_cast<const unsigned char *>(data) : nullptr;
+    }
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile()
+  {
+    if (mData)
+    {
+      ::munmap(const_cast<unsigned char *>(mData), mSize);
+    }
+  }
+
+  bool IsValid() const { return mData || mSize == 0; }
+  const unsigned char *Data() const { return mData; }
+  uint64_t Size() const { return mSize; }
+
+private:
+  const unsigned char *mData{nullptr};
+  uint64_t mSize;
+};
+
+// Version both sides use given the peer's highest one, 0 for peers that predate the negotiation
+inline uint8_t NegotiateProtocolVersion(uint32_t peerVersion)
+{
+  return static_cast<uint8_t>(std::min<uint32_t>(std::max<uint32_t>(peerVersion, PROTOCOL_VERSION_MIN), PROTOCOL_VERSION));
+}
 
-// Serialize a protobuf message
+// Payload checksum of a frame of the given version
+inline uint32_t FrameChecksum(uint8_t version, const char *data, size_t length)
+{
+  if (version >= PROTOCOL_VERSION_CRC32C)
+  {
+    return Crc32c(0, data, length);
+  }
+  return crc32(0L, reinterpret_cast<const Bytef *>(data), length);
+}
+
+// Header and serialized payload of an outgoing message. Owned by the connection's write queue until written,
+// since both must outlive the write.
+struct OutboundFrame
+{
+  ProtocolHeader mHeader;
+  std::string mSerializedData;
+};
+
+// Serializes a message into frame, reusing the capacity of its buffer. Returns false if serialization fails.
 template <typename T>
-void AsyncWriteProtobufMessage(bai::tcp::socket &socket, const T &message,
-                               std::function<void(const boost::system::error_code &, size_t)> handler)
+bool SerializeFrame(const T &message, OutboundFrame &frame, uint8_t flags = 0, uint8_t version = PROTOCOL_VERSION_MIN)
 {
-  std::string serializedData;
+  std::string &serializedData = frame.mSerializedData;
   if (!message.SerializeToString(&serializedData))
   {
-    boost::system::error_code ec(boost::system::errc::make_error_code(boost::system::errc::no_message));
-    ba::post(socket.get_executor(), [handler, ec]()
-             { handler(ec, 0); });
-    return;
+    return false;
   }
 
-  ProtocolHeader header;
+  ProtocolHeader &header = frame.mHeader;
   header.mMagicBytes = PROTOCOL_MAGIC_BYTES;
-  header.mVersion = PROTOCOL_VERSION;
+  header.mVersion = version;
+  header.mFlags = flags;
+  header.mReserved = 0;
   header.mPayloadSize = static_cast<uint32_t>(serializedData.length());
-  // Calculate checksum
-  header.mChecksum = crc32(0L, reinterpret_cast<const Bytef *>(serializedData.data()), serializedData.length());
+  header.mChecksum = FrameChecksum(version, serializedData.data(), serializedData.length());
 
   header.ToNetworkByteOrder();
-
-  std::vector<ba::const_buffer> buffers;
-  buffers.push_back(ba::buffer(&header, sizeof(ProtocolHeader)));
-  buffers.push_back(ba::buffer(serializedData, header.mPayloadSize));
-
-  ba::async_write(socket, buffers, handler);
+  return true;
 }
 
-// Read Protobug message header from socket
-void AsyncReadProtobufMessageHeader(std::shared_ptr<bai::tcp::socket> socket, ba::streambuf &buffer,
-                                    std::function<void(const boost::system::error_code &, size_t, std::shared_ptr<ProtocolHeader>)> handler)
+// The parsed message of a connection's current frame. It lives on a protobuf arena and is reused in place: as long
+// as consecutive frames carry the same content (a run of chunks, a run of acks), parsing reuses the previous
+// sub-message and the capacity of its strings and allocates nothing. When the content switches, the old
+// sub-message stays behind on the arena until the next parse resets it. T is a ClientMessage or ServerMessage,
+// whose only fields are one oneof of messages.
+template <typename T>
+class InboundMessage
 {
-  auto pHeader = std::make_shared<ProtocolHeader>();
+public:
+  InboundMessage() : mpMessage(google::protobuf::Arena::CreateMessage<T>(&mArena)) {}
+  InboundMessage(const InboundMessage &) = delete;
+  InboundMessage &operator=(const InboundMessage &) = delete;
 
-  ba::async_read(*socket, ba::buffer(pHeader.get(), sizeof(ProtocolHeader)),
-                 [&socket, &buffer, handler, pHeader](const boost::system::error_code &error, size_t bytes_transferred)
+  // Parses size bytes of data, the result is valid until the next call. Returns nullptr if they don't parse.
+  T *Parse(const char *data, size_t size)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    if (mIsStale)
+    {
+      mArena.Reset();
+      mpMessage = google::protobuf::Arena::CreateMessage<T>(&mArena);
+      mIsStale = false;
+    }
+
+    const google::protobuf::Reflection *reflection = mpMessage->GetReflection();
+    const google::protobuf::Descriptor *descriptor = mpMessage->GetDescriptor();
+    const google::protobuf::OneofDescriptor *content = descriptor->oneof_decl(0);
+    const google::protobuf::FieldDescriptor *previous = reflection->GetOneofFieldDescriptor(*mpMessage, content);
+    if (previous)
+    {
+      // Clear() would drop the sub-message, clearing it in place keeps its allocations for the merge below
+      reflection->MutableMessage(mpMessage, previous)->Clear();
+    }
+    // Fields next to the oneof are scalars, the merge would keep their old value where the new message omits them
+    for (int i = 0; i < descriptor->field_count(); i++)
+    {
+      if (descriptor->field(i)->containing_oneof() != content)
+      {
+        reflection->ClearField(mpMessage, descriptor->field(i));
+      }
+    }
+
+    google::protobuf::io::CodedInputStream input(reinterpret_cast<const uint8_t *>(data), static_cast<int>(size));
+    const bool isParsed = mpMessage->MergeFromCodedStream(&input) && input.ConsumedEntireMessage();
+    const google::protobuf::FieldDescriptor *current = reflection->GetOneofFieldDescriptor(*mpMessage, content);
+    mIsStale = !isParsed || (previous && current != previous);
+    mLastParseNanos = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    return isParsed ? mpMessage : nullptr;
+  }
+
+  // Time the last Parse took
+  uint64_t LastParseNanos() const
+  {
+    return mLastParseNanos;
+  }
+
+private:
+  google::protobuf::Arena mArena;
+  T *mpMessage;
+  bool mIsStale{false};
+  uint64_t mLastParseNanos{0};
+};
+
+// Reads a frame header from socket into header, which the caller owns and keeps alive until handler runs.
+// handler(error, bytesTransferred) gets an error for a header that doesn't pass the magic, version and flags checks.
+// The read allocates through handler's associated allocator.
+template <typename SocketT, typename Handler>
+void AsyncReadProtobufMessageHeader(SocketT &socket, ProtocolHeader &header, Handler handler)
+{
+  const auto allocator = ba::get_associated_allocator(handler);
+  ba::async_read(socket, ba::buffer(&header, sizeof(ProtocolHeader)),
+                 BindAllocator(allocator, [&header, handler = std::move(handler)](const boost::system::error_code &error, size_t bytesTransferred) mutable
                  {
-                   if (!error)
+                   if (error)
                    {
-                     pHeader->ToHostByteOrder();
-
-                     // Magic bytes check
-                     if (pHeader->mMagicBytes != PROTOCOL_MAGIC_BYTES)
-                     {
-                       std::cerr << "Error: Invalid magic bytes. Expected: 0x"
-                                 << std::hex << PROTOCOL_MAGIC_BYTES << ", Received: 0x"
-                                 << std::hex << pHeader->mMagicBytes << std::endl;
-                       handler(boost::asio::error::invalid_argument, 0, nullptr);
-                       return;
-                     }
-                     // Version check
-                     if (pHeader->mVersion != PROTOCOL_VERSION)
-                     {
-                       std::cerr << "Error Protocol Version Expected: "
-                                 << (int)PROTOCOL_VERSION << ", Received: " << (int)pHeader->mVersion << std::endl;
-                       handler(boost::system::errc::make_error_code(boost::system::errc::errc_t::protocol_error), 0, nullptr);
-                       return;
-                     }
-
-                     handler(boost::system::error_code(), bytes_transferred, pHeader);
+                     handler(error, 0);
                      return;
                    }
 
-                   handler(error, 0, nullptr);
-                 });
+                   header.ToHostByteOrder();
+
+                   // Magic bytes check
+                   if (header.mMagicBytes != PROTOCOL_MAGIC_BYTES)
+                   {
+                     LOG_ERROR("Error: Invalid magic bytes. Expected: 0x"
+                              << std::hex << PROTOCOL_MAGIC_BYTES << ", Received: 0x"
+                              << std::hex << header.mMagicBytes << std::dec);
+                     handler(boost::asio::error::invalid_argument, 0);
+                     return;
+                   }
+                   // Version check
+                   if (header.mVersion < PROTOCOL_VERSION_MIN || header.mVersion > PROTOCOL_VERSION)
+                   {
+                     LOG_ERROR("Error Protocol Version Expected: " << (int)PROTOCOL_VERSION_MIN << ".."
+                              << (int)PROTOCOL_VERSION << ", Received: " << (int)header.mVersion);
+                     handler(boost::system::errc::make_error_code(boost::system::errc::errc_t::protocol_error), 0);
+                     return;
+                   }
+                   // Flags check
+                   if ((header.mFlags & ~FRAME_FLAGS_KNOWN) != 0)
+                   {
+                     LOG_ERROR("Error: Unknown frame flags: 0x" << std::hex << (int)header.mFlags << std::dec);
+                     handler(boost::system::errc::make_error_code(boost::system::errc::errc_t::protocol_error), 0);
+                     return;
+                   }
+
+                   handler(boost::system::error_code(), bytesTransferred);
+                 }));
 }
 
-// Read a Protobuf message from socket
-template <typename T>
-void AsyncReadProtobufMessagePayload(std::shared_ptr<bai::tcp::socket> socket, std::vector<char> &buffer, std::shared_ptr<ProtocolHeader> pHeader,
-                                     std::function<void(const boost::system::error_code &, size_t, std::shared_ptr<T>)> handler)
+// Reads the payload announced by header into buffer, which only ever grows, checks it and parses it into message.
+// handler(error, bytesTransferred, T*) gets the parsed message, valid until the next parse, or nullptr on error.
+// The read allocates through handler's associated allocator.
+template <typename T, typename SocketT, typename Handler>
+void AsyncReadProtobufMessagePayload(SocketT &socket, const ProtocolHeader &header, std::vector<char> &buffer,
+                                     InboundMessage<T> &message, Handler handler)
 {
-  // Read payload
-  ba::async_read(*socket, ba::buffer(buffer.data(), pHeader->mPayloadSize),
-                 [&socket, &buffer, handler, pHeader](const boost::system::error_code &error, size_t bytesTransferred)
+  if (buffer.size() < header.mPayloadSize)
+  {
+    buffer.resize(header.mPayloadSize);
+  }
+  const auto allocator = ba::get_associated_allocator(handler);
+  ba::async_read(socket, ba::buffer(buffer.data(), header.mPayloadSize),
+                 BindAllocator(allocator, [&header, &buffer, &message, handler = std::move(handler)](const boost::system::error_code &error,
+                                                                            size_t bytesTransferred) mutable
                  {
-                   if (!error)
+                   if (error)
                    {
-                     // Payload checksum check
-                     uint32_t calculated_checksum = crc32(0L,
-                                                          reinterpret_cast<const Bytef *>(buffer.data()),
-                                                          buffer.size());
-
-                     if (calculated_checksum != pHeader->mChecksum)
-                     {
-                       std::cerr << "Error: Checksum not valid! Expected: 0x" << std::hex << pHeader->mChecksum
-                                 << ", Calculated: 0x" << std::hex << calculated_checksum << std::endl;
-                       handler(boost::asio::error::fault, 0, nullptr);
-                       return;
-                     }
-
-                     auto message_ptr = std::make_shared<T>();
-                     if (message_ptr->ParseFromArray(buffer.data(), buffer.size()))
-                     {
-                       handler(boost::system::error_code(), bytesTransferred, message_ptr);
-                     }
-                     else
-                     {
-                       handler(boost::asio::error::invalid_argument, 0, nullptr);
-                     }
+                     handler(error, 0, nullptr);
+                     return;
                    }
-                   else
+
+                   // Payload checksum check
+                   const uint32_t calculatedChecksum = FrameChecksum(header.mVersion, buffer.data(), header.mPayloadSize);
+                   if (calculatedChecksum != header.mChecksum)
                    {
-                     handler(error, 0, nullptr);
+                     LOG_ERROR("Error: Checksum not valid! Expected: 0x" << std::hex << header.mChecksum
+                              << ", Calculated: 0x" << calculatedChecksum << std::dec);
+                     handler(boost::asio::error::fault, 0, nullptr);
+                     return;
+                   }
+
+                   T *pMessage = message.Parse(buffer.data(), header.mPayloadSize);
+                   if (!pMessage)
+                   {
+                     handler(boost::asio::error::invalid_argument, 0, nullptr);
+                     return;
                    }
-                 });
+                   handler(boost::system::error_code(), bytesTransferred, pMessage);
+                 }));
 }
 
-#endif // FILETRANSFER_COMMON_H_
\ No newline at end of file
+#endif // FILETRANSFER_COMMON_H_
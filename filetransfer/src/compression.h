@@ -0,0 +1,217 @@
+#ifndef FILETRANSFER_COMPRESSION_H_
+#define FILETRANSFER_COMPRESSION_H_
+
+// Per-chunk compression of FileChunk.data. zlib is always available, LZ4 and zstd when built with
+// FILETRANSFER_WITH_LZ4 / FILETRANSFER_WITH_ZSTD.
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <zlib.h>
+#ifndef FILETRANSFER_HAS_LZ4
+#define FILETRANSFER_HAS_LZ4 0
+#endif
+#ifndef FILETRANSFER_HAS_ZSTD
+#define FILETRANSFER_HAS_ZSTD 0
+#endif
+#if FILETRANSFER_HAS_LZ4
+#include <lz4.h>
+#endif
+#if FILETRANSFER_HAS_ZSTD
+#include <zstd.h>
+#endif
+#include "filetransfer.pb.h"
+
+inline bool IsCodecSupported(filetransfer::CompressionCodec codec)
+{
+  switch (codec)
+  {
+  case filetransfer::COMPRESSION_NONE:
+  case filetransfer::COMPRESSION_ZLIB:
+    return true;
+  case filetransfer::COMPRESSION_LZ4:
+    return FILETRANSFER_HAS_LZ4;
+  case filetransfer::COMPRESSION_ZSTD:
+    return FILETRANSFER_HAS_ZSTD;
+  default:
+    return false;
+  }
+}
+
+inline const char *CodecName(filetransfer::CompressionCodec codec)
+{
+  switch (codec)
+  {
+  case filetransfer::COMPRESSION_ZLIB:
+    return "zlib";
+  case filetransfer::COMPRESSION_LZ4:
+    return "lz4";
+  case filetransfer::COMPRESSION_ZSTD:
+    return "zstd";
+  default:
+    return "none";
+  }
+}
+
+// Codecs this build supports, fastest first, as offered by the client
+inline std::vector<filetransfer::CompressionCodec> SupportedCodecs()
+{
+  std::vector<filetransfer::CompressionCodec> codecs;
+  for (auto codec : {filetransfer::COMPRESSION_LZ4, filetransfer::COMPRESSION_ZSTD, filetransfer::COMPRESSION_ZLIB})
+  {
+    if (IsCodecSupported(codec))
+    {
+      codecs.push_back(codec);
+    }
+  }
+  return codecs;
+}
+
+// Compresses length bytes of data into out with the codec's fastest level. Returns false on failure.
+inline bool CompressChunk(filetransfer::CompressionCodec codec, const char *data, size_t length, std::string &out)
+{
+  switch (codec)
+  {
+  case filetransfer::COMPRESSION_ZLIB:
+  {
+    uLongf outLength = compressBound(static_cast<uLong>(length));
+    out.resize(outLength);
+    if (compress2(reinterpret_cast<Bytef *>(&out[0]), &outLength, reinterpret_cast<const Bytef *>(data),
+                  static_cast<uLong>(length), Z_BEST_SPEED) != Z_OK)
+    {
+      return false;
+    }
+    out.resize(outLength);
+    return true;
+  }
+#if FILETRANSFER_HAS_LZ4
+  case filetransfer::COMPRESSION_LZ4:
+  {
+    out.resize(LZ4_compressBound(static_cast<int>(length)));
+    int outLength = LZ4_compress_default(data, &out[0], static_cast<int>(length), static_cast<int>(out.size()));
+    if (outLength <= 0)
+    {
+      return false;
+    }
+    out.resize(outLength);
+    return true;
+  }
+#endif
+#if FILETRANSFER_HAS_ZSTD
+  case filetransfer::COMPRESSION_ZSTD:
+  {
+    out.resize(ZSTD_compressBound(length));
+    size_t outLength = ZSTD_compress(&out[0], out.size(), data, length, 1);
+    if (ZSTD_isError(outLength))
+    {
+      return false;
+    }
+    out.resize(outLength);
+    return true;
+  }
+#endif
+  default:
+    return false;
+  }
+}
+
+// Decompresses in into out, which must come out exactly length bytes long. Returns false on failure.
+inline bool DecompressChunk(filetransfer::CompressionCodec codec, const std::string &in, size_t length, std::string &out)
+{
+  out.resize(length);
+  switch (codec)
+  {
+  case filetransfer::COMPRESSION_ZLIB:
+  {
+    uLongf outLength = static_cast<uLongf>(length);
+    return uncompress(reinterpret_cast<Bytef *>(&out[0]), &outLength, reinterpret_cast<const Bytef *>(in.data()),
+                      static_cast<uLong>(in.length())) == Z_OK &&
+           outLength == length;
+  }
+#if FILETRANSFER_HAS_LZ4
+  case filetransfer::COMPRESSION_LZ4:
+    return LZ4_decompress_safe(in.data(), &out[0], static_cast<int>(in.length()), static_cast<int>(length)) ==
+           static_cast<int>(length);
+#endif
+#if FILETRANSFER_HAS_ZSTD
+  case filetransfer::COMPRESSION_ZSTD:
+  {
+    size_t outLength = ZSTD_decompress(&out[0], length, in.data(), in.length());
+    return !ZSTD_isError(outLength) && outLength == length;
+  }
+#endif
+  default:
+    return false;
+  }
+}
+
+// CPU time of the calling thread, which is what (de)compression costs regardless of what else the process does
+inline uint64_t ThreadCpuNanos()
+{
+  timespec now;
+  ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+// Totals of one transfer, updated from whichever thread does the work
+struct CompressionStats
+{
+  std::atomic<uint64_t> mRawBytes{0};   // Chunk data before compression
+  std::atomic<uint64_t> mWireBytes{0};  // Chunk data as sent
+  std::atomic<uint64_t> mCpuNanos{0};   // Spent compressing or decompressing, including bypassed attempts
+  std::atomic<uint64_t> mCompressedChunks{0};
+  std::atomic<uint64_t> mBypassedChunks{0};
+
+  double Ratio() const
+  {
+    return mRawBytes ? static_cast<double>(mWireBytes) / mRawBytes : 1.0;
+  }
+};
+
+// Decides per chunk whether compression is worth trying. Every chunk is compressed while that pays off; once
+// mMaxPoorSamples chunks in a row save less than mMinSavings, chunks go out uncompressed and only every
+// mResampleInterval-th one is tried again, to notice when the data becomes compressible.
+class CompressionPolicy
+{
+public:
+  CompressionPolicy(double minSavings = 0.1, size_t maxPoorSamples = 4, size_t resampleInterval = 32)
+      : mMinSavings(minSavings), mMaxPoorSamples(maxPoorSamples), mResampleInterval(std::max<size_t>(resampleInterval, 1))
+  {
+  }
+
+  bool ShouldCompress()
+  {
+    if (!mIsBypassing)
+    {
+      return true;
+    }
+    return ++mSkippedChunks % mResampleInterval == 0;
+  }
+
+  void Record(size_t rawLength, size_t compressedLength)
+  {
+    if (compressedLength > rawLength * (1.0 - mMinSavings))
+    {
+      mIsBypassing = mIsBypassing || ++mPoorSamples >= mMaxPoorSamples;
+    }
+    else
+    {
+      mPoorSamples = 0;
+      mIsBypassing = false;
+    }
+  }
+
+  bool IsBypassing() const { return mIsBypassing; }
+
+private:
+  double mMinSavings;
+  size_t mMaxPoorSamples;
+  size_t mResampleInterval;
+  size_t mPoorSamples{0};
+  size_t mSkippedChunks{0};
+  bool mIsBypassing{false};
+};
+
+#endif // FILETRANSFER_COMPRESSION_H_
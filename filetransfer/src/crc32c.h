@@ -0,0 +1,226 @@
+#ifndef FILETRANSFER_CRC32C_H_
+#define FILETRANSFER_CRC32C_H_
+
+// CRC32C (Castagnoli), the frame checksum from protocol version 2 on. On x86-64 CPUs with SSE4.2 it runs on the
+// crc32 instruction over three interleaved streams, whose CRCs are then merged with a carry-less multiply
+// (PCLMULQDQ) or, without it, a portable multiply. Everything else uses a slicing-by-8 table implementation.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FILETRANSFER_HAS_CRC32C_X86 1
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#else
+#define FILETRANSFER_HAS_CRC32C_X86 0
+#endif
+
+namespace crc32c
+{
+
+const uint32_t POLY = 0x82F63B78; // Reflected Castagnoli polynomial
+
+// Slicing-by-8 lookup tables
+struct Tables
+{
+  uint32_t mTable[8][256];
+
+  Tables()
+  {
+    for (uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t crc = n;
+      for (int k = 0; k < 8; k++)
+      {
+        crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+      }
+      mTable[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+      for (int k = 1; k < 8; k++)
+      {
+        mTable[k][n] = (mTable[k - 1][n] >> 8) ^ mTable[0][mTable[k - 1][n] & 0xff];
+      }
+    }
+  }
+};
+
+inline const Tables &GetTables()
+{
+  static const Tables tables;
+  return tables;
+}
+
+// crc is the CRC of the data so far (0 to start), the result is that of the data so far followed by length bytes of data
+inline uint32_t Portable(uint32_t crc, const void *data, size_t length)
+{
+  const auto &t = GetTables().mTable;
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  crc = ~crc;
+  for (; length >= 8; p += 8, length -= 8)
+  {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word)); // Little endian hosts only, like the rest of the wire format handling
+    word ^= crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+          t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+  }
+  for (; length > 0; p++, length--)
+  {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+  }
+  return ~crc;
+}
+
+// a * b modulo POLY, both reflected
+inline uint32_t MultiplyModP(uint32_t a, uint32_t b)
+{
+  uint32_t m = 1u << 31;
+  uint32_t product = 0;
+  for (;;)
+  {
+    if (a & m)
+    {
+      product ^= b;
+      if ((a & (m - 1)) == 0)
+      {
+        break;
+      }
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+  }
+  return product;
+}
+
+// x^n modulo POLY, reflected
+inline uint32_t XPowModP(uint64_t n)
+{
+  uint32_t result = 1u << 31; // x^0
+  uint32_t square = 1u << 30; // x^1, then x^2, x^4, ...
+  for (; n > 0; n >>= 1)
+  {
+    if (n & 1)
+    {
+      result = MultiplyModP(square, result);
+    }
+    square = MultiplyModP(square, square);
+  }
+  return result;
+}
+
+#if FILETRANSFER_HAS_CRC32C_X86
+
+// Each of the three streams covers STRIDE bytes per round
+const size_t STRIDE = 4096;
+
+// Raw CRC register value (no pre/post inversion) of the crc32 instruction over length bytes
+__attribute__((target("sse4.2"))) inline uint64_t Sse42Raw(uint64_t crc, const unsigned char *p, size_t length)
+{
+  for (; length >= 8; p += 8, length -= 8)
+  {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+  for (; length > 0; p++, length--)
+  {
+    crc = _mm_crc32_u8(static_cast<uint32_t>(crc), *p);
+  }
+  return crc;
+}
+
+// Shifts a raw register value over STRIDE zero bytes: portable multiply by x^(8 * STRIDE)
+inline uint32_t ShiftPortable(uint32_t crc)
+{
+  static const uint32_t factor = XPowModP(8 * STRIDE);
+  return MultiplyModP(factor, crc);
+}
+
+// The same with one carry-less multiply, reduced back to 32 bits by the crc32 instruction. The product of two
+// reflected values comes out one bit short and the reduction multiplies by x^32, hence the -33.
+__attribute__((target("sse4.2,pclmul"))) inline uint32_t ShiftPclmul(uint32_t crc)
+{
+  static const uint32_t factor = XPowModP(8 * STRIDE - 33);
+  __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)),
+                                         _mm_cvtsi32_si128(static_cast<int>(factor)), 0);
+  return static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(product))));
+}
+
+// Three independent crc32 chains keep the instruction's pipeline full (one result per cycle instead of one every
+// three cycles), then the three CRCs are merged by shifting them over the bytes that followed them
+template <uint32_t (*Shift)(uint32_t)>
+__attribute__((target("sse4.2"))) inline uint32_t Sse42(uint32_t crc, const void *data, size_t length)
+{
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  uint64_t crc0 = static_cast<uint32_t>(~crc);
+  while (length >= 3 * STRIDE)
+  {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for (size_t i = 0; i < STRIDE; i += 8)
+    {
+      uint64_t word0, word1, word2;
+      std::memcpy(&word0, p + i, sizeof(word0));
+      std::memcpy(&word1, p + STRIDE + i, sizeof(word1));
+      std::memcpy(&word2, p + 2 * STRIDE + i, sizeof(word2));
+      crc0 = _mm_crc32_u64(crc0, word0);
+      crc1 = _mm_crc32_u64(crc1, word1);
+      crc2 = _mm_crc32_u64(crc2, word2);
+    }
+    crc0 = Shift(static_cast<uint32_t>(crc0)) ^ crc1;
+    crc0 = Shift(static_cast<uint32_t>(crc0)) ^ crc2;
+    p += 3 * STRIDE;
+    length -= 3 * STRIDE;
+  }
+  return ~static_cast<uint32_t>(Sse42Raw(crc0, p, length));
+}
+
+// The crc32 instruction one stream at a time, for comparison
+__attribute__((target("sse4.2"))) inline uint32_t Sse42Serial(uint32_t crc, const void *data, size_t length)
+{
+  return ~static_cast<uint32_t>(Sse42Raw(static_cast<uint32_t>(~crc), static_cast<const unsigned char *>(data), length));
+}
+
+#endif // FILETRANSFER_HAS_CRC32C_X86
+
+using FunctionT = uint32_t (*)(uint32_t, const void *, size_t);
+
+// Fastest implementation this CPU supports, picked on first use
+inline FunctionT Best()
+{
+#if FILETRANSFER_HAS_CRC32C_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    return __builtin_cpu_supports("pclmul") ? &Sse42<ShiftPclmul> : &Sse42<ShiftPortable>;
+  }
+#endif
+  return &Portable;
+}
+
+inline const char *BestName()
+{
+#if FILETRANSFER_HAS_CRC32C_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    return __builtin_cpu_supports("pclmul") ? "sse4.2+pclmul" : "sse4.2";
+  }
+#endif
+  return "portable";
+}
+
+} // namespace crc32c
+
+// CRC32C of length bytes of data, continuing from crc (0 to start)
+inline uint32_t Crc32c(uint32_t crc, const void *data, size_t length)
+{
+  static const crc32c::FunctionT function = crc32c::Best();
+  return function(crc, data, length);
+}
+
+#endif // FILETRANSFER_CRC32C_H_
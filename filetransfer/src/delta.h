@@ -0,0 +1,375 @@
+#ifndef FILETRANSFER_DELTA_H_
+#define FILETRANSFER_DELTA_H_
+
+// rsync-style delta transfer. The server splits its existing copy of a file (the basis) into fixed size blocks and
+// sends a weak rolling checksum and a strong hash of each. The client slides a block sized window over its new
+// version, looks the rolling checksum up at every byte offset and confirms candidates with the strong hash, then sends
+// the new file as literal runs and references to basis blocks. The server rebuilds the file from those.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include <boost/system/error_code.hpp>
+#include <zlib.h>
+#include "common.h"
+#include "filetransfer.pb.h"
+
+const uint32_t DELTA_MIN_BLOCK_SIZE = 2 * 1024;
+const uint32_t DELTA_MAX_BLOCK_SIZE = 64 * 1024;
+const size_t DELTA_SIGNATURES_PER_MESSAGE = 8192;
+
+// About sqrt(size) like rsync, which balances signature size against match granularity
+inline uint32_t DeltaBlockSize(uint64_t basisSize)
+{
+  uint64_t blockSize = static_cast<uint64_t>(std::sqrt(static_cast<double>(basisSize)));
+  blockSize = (blockSize + 1023) / 1024 * 1024;
+  return static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(blockSize, DELTA_MIN_BLOCK_SIZE), DELTA_MAX_BLOCK_SIZE));
+}
+
+// rsync's weak checksum: two 16 bit sums over a window that can be moved one byte in constant time
+class RollingChecksum
+{
+public:
+  void Reset(const unsigned char *data, size_t length)
+  {
+    mA = mB = 0;
+    mLength = static_cast<uint32_t>(length);
+    for (size_t i = 0; i < length; i++)
+    {
+      mA += data[i];
+      mB += static_cast<uint32_t>(length - i) * data[i];
+    }
+  }
+
+  // Moves the window one byte forward: out leaves at the front, in enters at the back
+  void Roll(unsigned char out, unsigned char in)
+  {
+    mA += in - out;
+    mB += mA - mLength * out;
+  }
+
+  uint32_t Digest() const
+  {
+    return (mA & 0xffff) | (mB << 16);
+  }
+
+private:
+  uint32_t mA{0};
+  uint32_t mB{0};
+  uint32_t mLength{0};
+};
+
+// XXH64, the strong hash confirming a weak checksum match
+inline uint64_t StrongBlockHash(const unsigned char *data, size_t length, uint64_t seed = 0)
+{
+  const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+  const uint64_t P3 = 0x165667B19E3779F9ULL;
+  const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+  const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto read64 = [](const unsigned char *p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; };
+  auto read32 = [](const unsigned char *p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; };
+  auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+  auto merge = [&](uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * P1 + P4; };
+
+  const unsigned char *p = data;
+  const unsigned char *end = data + length;
+  uint64_t h;
+  if (length >= 32)
+  {
+    uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+    for (; p + 32 <= end; p += 32)
+    {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+  }
+  else
+  {
+    h = seed + P5;
+  }
+  h += length;
+  for (; p + 8 <= end; p += 8)
+  {
+    h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+  }
+  if (p + 4 <= end)
+  {
+    h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p < end; p++)
+  {
+    h = rotl(h ^ (*p * P5), 11) * P1;
+  }
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Signatures of every full block of the basis file, the short tail block is always sent as a literal
+inline bool ComputeBlockSignatures(int fd, uint64_t size, uint32_t blockSize, filetransfer::BlockSignatures &signatures)
+{
+  std::vector<unsigned char> block(blockSize);
+  RollingChecksum weak;
+  for (uint64_t offset = 0; offset + blockSize <= size; offset += blockSize)
+  {
+    if (ReadAllAt(fd, reinterpret_cast<char *>(block.data()), blockSize, offset) != static_cast<ssize_t>(blockSize))
+    {
+      return false;
+    }
+    weak.Reset(block.data(), blockSize);
+    signatures.add_weak(weak.Digest());
+    signatures.add_strong(StrongBlockHash(block.data(), blockSize));
+  }
+  return true;
+}
+
+// Client side: turns the new file into DeltaChunks against the basis signatures, one chunk at a time
+class DeltaEncoder
+{
+public:
+  DeltaEncoder(const unsigned char *data, uint64_t size, uint32_t blockSize, const std::vector<uint32_t> &weak,
+               const std::vector<uint64_t> &strong)
+      : mData(data), mSize(size), mBlockSize(blockSize), mStrong(strong)
+  {
+    mBlocks.reserve(weak.size());
+    for (uint32_t i = 0; i < weak.size(); i++)
+    {
+      mBlocks.emplace(weak[i], i);
+      mTags[Tag(weak[i])] = true;
+    }
+    if (mSize >= mBlockSize)
+    {
+      mWeak.Reset(mData, mBlockSize);
+    }
+  }
+
+  bool IsDone() const { return mLiteralStart >= mSize; }
+
+  // Bytes of the new file found in the basis so far
+  uint64_t MatchedBytes() const { return mMatchedBytes; }
+
+  // Fills chunk with the ops describing the next maxTarget bytes of the new file (one block if that is more)
+  void NextChunk(filetransfer::DeltaChunk &chunk, uint64_t maxTarget)
+  {
+    maxTarget = std::max<uint64_t>(maxTarget, 1);
+    chunk.set_offset(mLiteralStart);
+    uint64_t target = 0;
+    filetransfer::BlockRef *lastRef = nullptr;
+
+    while (true)
+    {
+      const uint64_t literal = mPosition - mLiteralStart;
+      if (target + literal >= maxTarget)
+      {
+        // Chunk is full, the rest of the literal run goes with the next one
+        const uint64_t length = target < maxTarget ? maxTarget - target : 0;
+        AddLiteral(chunk, length);
+        target += length;
+        break;
+      }
+      if (mPosition + mBlockSize > mSize)
+      {
+        // No full window left, the rest of the file is literal
+        const uint64_t length = std::min(mSize - mLiteralStart, maxTarget - target);
+        AddLiteral(chunk, length);
+        target += length;
+        mPosition = std::max(mPosition, mLiteralStart);
+        break;
+      }
+
+      const int64_t block = FindBlock(lastRef);
+      if (block < 0)
+      {
+        if (mPosition + mBlockSize < mSize)
+        {
+          mWeak.Roll(mData[mPosition], mData[mPosition + mBlockSize]);
+        }
+        mPosition++;
+        continue;
+      }
+
+      if (literal > 0)
+      {
+        AddLiteral(chunk, literal);
+        target += literal;
+        lastRef = nullptr;
+      }
+      if (target > 0 && target + mBlockSize > maxTarget)
+      {
+        break; // Matched again by the next call
+      }
+      if (lastRef && lastRef->index() + lastRef->count() == static_cast<uint64_t>(block))
+      {
+        lastRef->set_count(lastRef->count() + 1);
+      }
+      else
+      {
+        lastRef = chunk.add_ops()->mutable_blocks();
+        lastRef->set_index(block);
+        lastRef->set_count(1);
+      }
+      target += mBlockSize;
+      mMatchedBytes += mBlockSize;
+      mPosition += mBlockSize;
+      mLiteralStart = mPosition;
+      if (mPosition + mBlockSize <= mSize)
+      {
+        mWeak.Reset(mData + mPosition, mBlockSize);
+      }
+    }
+
+    chunk.set_target_length(target);
+    chunk.set_target_crc(crc32(0L, mData + chunk.offset(), static_cast<uInt>(target)));
+    chunk.set_is_last_chunk(IsDone());
+  }
+
+private:
+  // Index of the basis block matching the window at mPosition, preferring the one following the last reference
+  int64_t FindBlock(const filetransfer::BlockRef *lastRef)
+  {
+    const uint32_t weak = mWeak.Digest();
+    if (!mTags[Tag(weak)])
+    {
+      return -1; // Most offsets don't match anything, skip the hash table lookup for them
+    }
+    auto range = mBlocks.equal_range(weak);
+    if (range.first == range.second)
+    {
+      return -1;
+    }
+    const uint64_t strong = StrongBlockHash(mData + mPosition, mBlockSize);
+    int64_t found = -1;
+    for (auto it = range.first; it != range.second; ++it)
+    {
+      if (mStrong[it->second] == strong)
+      {
+        found = it->second;
+        if (lastRef && lastRef->index() + lastRef->count() == it->second)
+        {
+          break;
+        }
+      }
+    }
+    return found;
+  }
+
+  static uint16_t Tag(uint32_t weak)
+  {
+    return static_cast<uint16_t>(weak ^ (weak >> 16));
+  }
+
+  void AddLiteral(filetransfer::DeltaChunk &chunk, uint64_t length)
+  {
+    if (length == 0)
+    {
+      return;
+    }
+    chunk.add_ops()->set_literal(mData + mLiteralStart, length);
+    mLiteralStart += length;
+  }
+
+  const unsigned char *mData;
+  uint64_t mSize;
+  uint32_t mBlockSize;
+  const std::vector<uint64_t> &mStrong;
+  std::unordered_multimap<uint32_t, uint32_t> mBlocks; // Weak checksum -> block index
+  std::vector<bool> mTags = std::vector<bool>(1 << 16); // Tags of the weak checksums in mBlocks
+  RollingChecksum mWeak;
+  uint64_t mPosition{0};     // Start of the window
+  uint64_t mLiteralStart{0}; // Start of the pending literal run, everything before it has been emitted
+  uint64_t mMatchedBytes{0};
+};
+
+// Server side: writes the bytes described by chunk to out at chunk.offset(), copying referenced blocks from basis.
+// Fails before touching either file if the chunk rebuilds more than maxTargetLength bytes, a reference is outside of
+// the basis or the ops don't add up to exactly chunk.target_length(); fails after writing if the result doesn't
+// match chunk.target_crc().
+inline boost::system::error_code ApplyDeltaChunk(const filetransfer::DeltaChunk &chunk, int basisFd, uint64_t basisSize,
+                                                 uint32_t blockSize, int outFd, uint64_t maxTargetLength)
+{
+  auto ioError = []() { return boost::system::error_code(errno, boost::system::system_category()); };
+  auto invalid = []() { return boost::system::errc::make_error_code(boost::system::errc::invalid_argument); };
+  if (chunk.target_length() > maxTargetLength || blockSize == 0)
+  {
+    return invalid();
+  }
+  // Every op is checked and its length summed first, a chunk can't make the server copy more than it describes
+  uint64_t total = 0;
+  for (const auto &op : chunk.ops())
+  {
+    uint64_t length = op.literal().length();
+    if (op.has_blocks())
+    {
+      const uint64_t blocks = basisSize / blockSize;
+      if (op.blocks().index() > blocks || op.blocks().count() > blocks - op.blocks().index())
+      {
+        return invalid();
+      }
+      length = static_cast<uint64_t>(op.blocks().count()) * blockSize;
+    }
+    if (length > chunk.target_length() - total)
+    {
+      return invalid();
+    }
+    total += length;
+  }
+  if (total != chunk.target_length())
+  {
+    return invalid();
+  }
+
+  uint64_t offset = chunk.offset();
+  uLong crc = crc32(0L, Z_NULL, 0);
+  std::vector<char> buffer;
+  for (const auto &op : chunk.ops())
+  {
+    if (op.has_blocks())
+    {
+      const uint64_t start = op.blocks().index() * blockSize;
+      const uint64_t length = static_cast<uint64_t>(op.blocks().count()) * blockSize;
+      buffer.resize(std::min<uint64_t>(length, 1024 * 1024));
+      for (uint64_t copied = 0; copied < length;)
+      {
+        const size_t piece = std::min<uint64_t>(buffer.size(), length - copied);
+        if (ReadAllAt(basisFd, buffer.data(), piece, start + copied) != static_cast<ssize_t>(piece) ||
+            !WriteAllAt(outFd, buffer.data(), piece, offset))
+        {
+          return ioError();
+        }
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(buffer.data()), static_cast<uInt>(piece));
+        copied += piece;
+        offset += piece;
+      }
+    }
+    else
+    {
+      const std::string &literal = op.literal();
+      if (!WriteAllAt(outFd, literal.data(), literal.length(), offset))
+      {
+        return ioError();
+      }
+      crc = crc32(crc, reinterpret_cast<const Bytef *>(literal.data()), static_cast<uInt>(literal.length()));
+      offset += literal.length();
+    }
+  }
+
+  if (crc != chunk.target_crc())
+  {
+    return boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+  }
+  return boost::system::error_code();
+}
+
+#endif // FILETRANSFER_DELTA_H_
@@ -0,0 +1,182 @@
+#ifndef FILETRANSFER_DISK_WRITER_H_
+#define FILETRANSFER_DISK_WRITER_H_
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include "handler_memory.h"
+#include "metrics.h"
+
+namespace ba = boost::asio;
+
+// Disk work with its completion in one object, so a caller can pool them and submit without allocating
+class DiskJob
+{
+public:
+  virtual ~DiskJob() = default;
+
+  // Runs on the pool
+  virtual boost::system::error_code Run() = 0;
+  // Runs on the completion executor with Run's result
+  virtual void Complete(const boost::system::error_code &error) = 0;
+};
+
+// Disk I/O stage: runs blocking file writes on a thread pool so they never stall an io_context thread.
+// Each session submits through its own strand, so its writes run and complete in submission order.
+// At most maxQueuedWrites writes are queued on the pool at once, further submissions wait in FIFO order.
+// A job's hops to the pool and back allocate through the submitter's HandlerAllocator.
+class DiskWriter
+{
+public:
+  using WorkT = std::function<boost::system::error_code()>;
+  using CompletionHandlerT = std::function<void(const boost::system::error_code &)>;
+  using StrandT = ba::strand<ba::thread_pool::executor_type>;
+  // Completions go to a session's strand. Named concretely, an any_io_executor would allocate a copy of the strand
+  // for every completion posted through it.
+  using CompletionExecutorT = ba::strand<ba::io_context::executor_type>;
+  using AllocatorT = HandlerAllocator<void>;
+
+  DiskWriter(size_t threads, size_t maxQueuedWrites)
+      : mPool(std::max<size_t>(threads, 1)), mMaxQueuedWrites(std::max<size_t>(maxQueuedWrites, 1))
+  {
+  }
+
+  ~DiskWriter()
+  {
+    Join();
+  }
+
+  // Waits until every submitted write has run and its completion has been posted
+  void Join()
+  {
+    mPool.join();
+    std::lock_guard<std::mutex> lock(mMutex);
+    mIsJoined = true;
+  }
+
+  StrandT MakeStrand()
+  {
+    return ba::make_strand(mPool.get_executor());
+  }
+
+  // Runs work on the pool serialized through strand, then posts handler with its result to completionExecutor.
+  // The time work takes to run is recorded in pWorkTime if given.
+  void Submit(const StrandT &strand, WorkT work, const CompletionExecutorT &completionExecutor,
+              CompletionHandlerT handler, const AllocatorT &allocator, Histogram *pWorkTime = nullptr)
+  {
+    Submit(strand, std::make_shared<FunctionJob>(std::move(work), std::move(handler)), nullptr, completionExecutor,
+           allocator, pWorkTime);
+  }
+
+  // Same for a job object: Run on the pool, then Complete posted to completionExecutor. pOwner is kept alive until
+  // Complete has run, for pooled jobs that must not hold on to their owner themselves.
+  void Submit(const StrandT &strand, std::shared_ptr<DiskJob> pDiskJob, std::shared_ptr<void> pOwner,
+              const CompletionExecutorT &completionExecutor, const AllocatorT &allocator,
+              Histogram *pWorkTime = nullptr)
+  {
+    Job job{strand, std::move(pDiskJob), std::move(pOwner), completionExecutor, allocator, pWorkTime};
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mQueuedWrites < mMaxQueuedWrites)
+    {
+      ++mQueuedWrites;
+      Dispatch(std::move(job));
+    }
+    else
+    {
+      mWaiting.push_back(std::move(job));
+    }
+  }
+
+  // Runs work on the pool outside of any session's order, or right here once the pool has been joined
+  void Post(std::function<void()> work)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (!mIsJoined)
+      {
+        ba::post(mPool, std::move(work));
+        return;
+      }
+    }
+    work();
+  }
+
+  size_t QueuedWrites()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mQueuedWrites + mWaiting.size();
+  }
+
+private:
+  class FunctionJob : public DiskJob
+  {
+  public:
+    FunctionJob(WorkT work, CompletionHandlerT handler) : mWork(std::move(work)), mHandler(std::move(handler)) {}
+
+    boost::system::error_code Run() override { return mWork(); }
+    void Complete(const boost::system::error_code &error) override { mHandler(error); }
+
+  private:
+    WorkT mWork;
+    CompletionHandlerT mHandler;
+  };
+
+  struct Job
+  {
+    StrandT mStrand;
+    std::shared_ptr<DiskJob> mpDiskJob;
+    std::shared_ptr<void> mpOwner;
+    CompletionExecutorT mCompletionExecutor;
+    AllocatorT mAllocator;
+    Histogram *mpWorkTime;
+  };
+
+  void Dispatch(Job job)
+  {
+    StrandT strand = job.mStrand;
+    AllocatorT allocator = job.mAllocator;
+    ba::post(strand, BindAllocator(allocator, [this, job = std::move(job)]() mutable
+             {
+               const uint64_t start = job.mpWorkTime ? SteadyNanos() : 0;
+               boost::system::error_code error = job.mpDiskJob->Run();
+               if (job.mpWorkTime)
+               {
+                 job.mpWorkTime->ObserveSince(start);
+               }
+               ba::post(job.mCompletionExecutor,
+                        BindAllocator(job.mAllocator,
+                                      [pDiskJob = std::move(job.mpDiskJob), pOwner = std::move(job.mpOwner), error]()
+                                      { pDiskJob->Complete(error); }));
+               OnJobDone();
+             }));
+  }
+
+  // The slot of a finished job is handed straight to the oldest waiting job, which keeps FIFO order
+  void OnJobDone()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mWaiting.empty())
+    {
+      Job next = std::move(mWaiting.front());
+      mWaiting.pop_front();
+      Dispatch(std::move(next));
+    }
+    else
+    {
+      --mQueuedWrites;
+    }
+  }
+
+  ba::thread_pool mPool;
+  std::mutex mMutex;
+  size_t mMaxQueuedWrites;
+  size_t mQueuedWrites{0};
+  std::deque<Job> mWaiting;
+  bool mIsJoined{false};
+};
+
+#endif // FILETRANSFER_DISK_WRITER_H_
@@ -0,0 +1,162 @@
+#ifndef FILETRANSFER_FILE_CACHE_H_
+#define FILETRANSFER_FILE_CACHE_H_
+
+// Files served to downloads, kept open (and mapped) across requests and shared by the sessions of every worker, so
+// many clients fetching the same hot file don't each open it and fault it in again. Entries are checked against
+// the file on disk with a stat on every lookup; a file replaced since is opened afresh. Uploads never rewrite a
+// served file in place, they rename a complete copy over it (Transfer::Commit), so downloads still holding the old
+// entry keep reading the old inode, mapped or not.
+
+#include "common.h"
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct CachedFile
+{
+  CachedFile(int fd, const struct stat &info, bool isMapped)
+      : mFile(fd), mSize(static_cast<uint64_t>(info.st_size)), mDevice(info.st_dev), mInode(info.st_ino),
+        mModified(info.st_mtim)
+  {
+    if (isMapped)
+    {
+      mpMapping = std::make_unique<MappedFile>(fd, mSize);
+    }
+    // Doubles the kernel's readahead for the pread path, downloads read front to back
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  bool IsSameFile(const struct stat &info) const
+  {
+    return info.st_dev == mDevice && info.st_ino == mInode && static_cast<uint64_t>(info.st_size) == mSize &&
+           info.st_mtim.tv_sec == mModified.tv_sec && info.st_mtim.tv_nsec == mModified.tv_nsec;
+  }
+
+  // Starts reading [offset, offset + length) into the page cache in the background
+  void WillNeed(uint64_t offset, uint64_t length) const
+  {
+    if (offset >= mSize)
+    {
+      return;
+    }
+    length = std::min(length, mSize - offset);
+    if (mpMapping && mpMapping->Data())
+    {
+      const uint64_t page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+      const uint64_t start = offset / page * page;
+      ::madvise(const_cast<unsigned char *>(mpMapping->Data()) + start, length + (offset - start), MADV_WILLNEED);
+      return;
+    }
+    ::posix_fadvise(mFile.Get(), static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+  }
+
+  FileDescriptor mFile;
+  std::unique_ptr<MappedFile> mpMapping; // Only in mmap mode
+  uint64_t mSize;
+  dev_t mDevice;
+  ino_t mInode;
+  struct timespec mModified;
+};
+
+class FileCache
+{
+public:
+  // Keeps up to maxFiles files open, least recently used first out. isMapped maps each file as a whole.
+  FileCache(size_t maxFiles, bool isMapped) : mMaxFiles(std::max<size_t>(maxFiles, 1)), mIsMapped(isMapped) {}
+
+  FileCache(const FileCache &) = delete;
+  FileCache &operator=(const FileCache &) = delete;
+
+  // The file at path, opened or from the cache. Returns nullptr with error set if it can't be opened.
+  std::shared_ptr<const CachedFile> Open(const std::string &path, std::string &error)
+  {
+    struct stat info;
+    if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+    {
+      error = "File not found";
+      return nullptr;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      auto it = mIndex.find(path);
+      if (it != mIndex.end())
+      {
+        if (it->second->second->IsSameFile(info))
+        {
+          ++mHits;
+          mEntries.splice(mEntries.begin(), mEntries, it->second);
+          return it->second->second;
+        }
+        mEntries.erase(it->second);
+        mIndex.erase(it);
+      }
+    }
+
+    // Opened outside the lock, a concurrent miss for the same file opens it twice and the later one stays
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || ::fstat(fd, &info) != 0)
+    {
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+      error = "File couldn't be opened";
+      return nullptr;
+    }
+    auto pFile = std::make_shared<CachedFile>(fd, info, mIsMapped);
+    if (pFile->mpMapping && !pFile->mpMapping->IsValid())
+    {
+      error = "File couldn't be mapped";
+      return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mMisses;
+    auto it = mIndex.find(path);
+    if (it != mIndex.end())
+    {
+      mEntries.erase(it->second);
+      mIndex.erase(it);
+    }
+    mEntries.emplace_front(path, pFile);
+    mIndex[path] = mEntries.begin();
+    while (mEntries.size() > mMaxFiles)
+    {
+      mIndex.erase(mEntries.back().first);
+      mEntries.pop_back();
+    }
+    return pFile;
+  }
+
+  bool IsMapped() const { return mIsMapped; }
+
+  // Lookups served from the cache and those that had to open the file
+  uint64_t Hits()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mHits;
+  }
+
+  uint64_t Misses()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mMisses;
+  }
+
+private:
+  using EntryT = std::pair<std::string, std::shared_ptr<const CachedFile>>;
+
+  size_t mMaxFiles;
+  bool mIsMapped;
+  std::mutex mMutex;
+  std::list<EntryT> mEntries; // Most recently used first
+  std::unordered_map<std::string, std::list<EntryT>::iterator> mIndex;
+  uint64_t mHits{0};
+  uint64_t mMisses{0};
+};
+
+#endif // FILETRANSFER_FILE_CACHE_H_
@@ -1,250 +1,112 @@
-#include "common.h"
-#include "filetransfer.pb.h"
-#include <boost/asio.hpp>
-#include <boost/filesystem.hpp>
-#include <fstream>
-#include <memory>
+#include <boost/program_options.hpp>
+#include "server.h"
+#include "metrics_server.h"
 
-namespace ba = boost::asio;
-namespace bai = boost::asio::ip;
+namespace po = boost::program_options;
 
-class Session : public std::enable_shared_from_this<Session> {
-  public:
-    Session(ba::io_context& context) : mSocket(std::make_shared<bai::tcp::socket>(context)) 
-    {
-      mBuffer.prepare(sizeof(ProtocolHeader));
-    }
-
-    bai::tcp::socket& GetSocket()
-    {
-      return *mSocket;
-    }
-
-    void Start() 
-    {
-      ReadHeader();
-    }
-
-  private:
-    void ReadHeader() 
-    {
-      auto self(shared_from_this());
-      AsyncReadProtobufMessageHeader(mSocket, mBuffer,
-                                [self](const boost::system::error_code &error, size_t sz,
-                                  std::shared_ptr<ProtocolHeader> header) {
-                                    self->HandleReadHeader(error, sz, header);
-                                });
-    }
-
-    void ReadPayload(std::shared_ptr<ProtocolHeader> pHeader)
+int main(int argc, char *argv[])
+{
+  try
+  {
+    unsigned short port = PORT;
+    ServerConfig config;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::string acceptMode = "reuseport";
+    uint64_t ackDelayUs = config.mAckDelay.count();
+    std::string downloadRead = "pread";
+    unsigned short metricsPort = 0;
+
+    po::options_description options("Options");
+    options.add_options()
+      ("help,h", "Show this help message")
+      ("port", po::value<unsigned short>(&port)->default_value(port), "Port to listen on")
+      ("workers", po::value<size_t>(&workers)->default_value(workers),
+       "Worker threads, each with its own io_context")
+      ("accept-mode", po::value<std::string>(&acceptMode)->default_value(acceptMode),
+       "reuseport: an SO_REUSEPORT acceptor per worker, shared: one acceptor handing out connections round-robin")
+      ("max-chunk-size", po::value<uint32_t>(&config.mMaxChunkSize)->default_value(config.mMaxChunkSize),
+       "Largest chunk size in bytes the server agrees to")
+      ("disk-threads", po::value<size_t>(&config.mDiskThreads)->default_value(config.mDiskThreads),
+       "Threads writing chunk data to disk")
+      ("max-queued-disk-writes", po::value<size_t>(&config.mMaxQueuedDiskWrites)->default_value(config.mMaxQueuedDiskWrites),
+       "Disk writes queued across all sessions before further writes wait")
+      ("max-session-disk-writes", po::value<size_t>(&config.mMaxPendingDiskWritesPerSession)->default_value(config.mMaxPendingDiskWritesPerSession),
+       "Disk writes a session may have outstanding before it stops reading its socket")
+      ("session-memory", po::value<uint64_t>(&config.mSessionMemoryBudget)->default_value(config.mSessionMemoryBudget),
+       "Bytes of received chunk data a session may hold on their way to disk before it stops reading its socket, "
+       "which also caps the chunk buffers it keeps for reuse (0 = unlimited)")
+      ("memory-budget", po::value<uint64_t>(&config.mMemoryBudget)->default_value(config.mMemoryBudget),
+       "Bytes of received chunk data and receive buffers all sessions together may hold before they stop reading "
+       "(0 = unlimited)")
+      ("manifest-interval", po::value<uint64_t>(&config.mManifestInterval)->default_value(config.mManifestInterval),
+       "Bytes received between saves of a resumable upload's progress manifest")
+      ("ack-chunks", po::value<size_t>(&config.mAckEveryChunks)->default_value(config.mAckEveryChunks),
+       "Chunks acknowledged together at most")
+      ("ack-bytes", po::value<uint64_t>(&config.mAckEveryBytes)->default_value(config.mAckEveryBytes),
+       "Bytes acknowledged together at most")
+      ("ack-delay-us", po::value<uint64_t>(&ackDelayUs)->default_value(ackDelayUs),
+       "Microseconds a received chunk waits for its acknowledgement at most")
+      ("max-streams", po::value<size_t>(&config.mMaxStreamsPerSession)->default_value(config.mMaxStreamsPerSession),
+       "Uploads a client may run at once over one connection")
+      ("download-read", po::value<std::string>(&downloadRead)->default_value(downloadRead),
+       "How downloads read files: pread in the disk stage, or mmap (copied from the page cache by the session)")
+      ("open-files", po::value<size_t>(&config.mOpenFileCacheSize)->default_value(config.mOpenFileCacheSize),
+       "Files kept open (and mapped) between downloads")
+      ("metrics-port", po::value<unsigned short>(&metricsPort)->default_value(metricsPort),
+       "Serve Prometheus metrics on http://127.0.0.1:<port>/metrics (0 = disabled)");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
     {
-      auto self(shared_from_this());
-      mData.clear();
-      mData.resize(pHeader->mPayloadSize);
-      AsyncReadProtobufMessagePayload<filetransfer::ClientMessage>(mSocket, mData, pHeader,
-                                [self](const boost::system::error_code &error, size_t sz,
-                                  std::shared_ptr<filetransfer::ClientMessage> message) {
-                                    self->HandleReadPayload(error, sz, message);
-                                });
+      std::cerr << "Usage: " << argv[0] << " [options]\n";
+      std::cerr << options << "\n";
+      return 1;
     }
 
-    void HandleReadHeader(const boost::system::error_code& error, size_t transferredByte,
-                          std::shared_ptr<ProtocolHeader> header) 
+    config.mAckDelay = std::chrono::microseconds(ackDelayUs);
+    if (downloadRead != "pread" && downloadRead != "mmap")
     {
-      if (!error && header)
-      {
-        auto self(shared_from_this());
-        self->ReadPayload(header);
-      }
-      else
-      {
-        std::cout << "Error in HandleReadHeader: " << error.message() << std::endl;
-      }
+      std::cerr << "Unknown download read mode: " << downloadRead << "\n";
+      return 1;
     }
+    config.mIsDownloadMapped = downloadRead == "mmap";
 
-
-    void HandleReadPayload(const boost::system::error_code& error, size_t transferredByte,
-                    std::shared_ptr<filetransfer::ClientMessage> message) 
+    if (acceptMode != "reuseport" && acceptMode != "shared")
     {
-      if (!error && message)
-      {
-        switch (message->content_case())
-        {
-          case filetransfer::ClientMessage::kFileRequest:
-            HandleFileRequest(message->file_request());
-            break;
-          case filetransfer::ClientMessage::kFileChunk:
-            HandleFileChunk(message->file_chunk());
-            break;
-          case filetransfer::ClientMessage::kUploadFinished:
-            HandleUploadFinished(message->upload_finished());
-            break;
-          default:
-            std::cout << "Unknown ClientMessage type" << std::endl;
-            break;
-        }
-        ReadHeader();
-      }
-      else
-      {
-        if (mOut.is_open())
-        {
-          mOut.close();
-        }
-        std::cout << "Error in HandleReadPayload: " << error.message() << std::endl;
-      }
+      std::cerr << "Unknown accept mode: " << acceptMode << "\n";
+      return 1;
     }
 
-    void HandleFileRequest(const filetransfer::FileTransferRequest& request)
-    {
-      mCurrentFilename = request.filename();
-      mCurrentFileSize = request.filesize();
-      mBytesReceived = 0;
-
-      std::string targetPath = "uploads/" + mCurrentFilename;
-      boost::filesystem::path filePath(targetPath);
-      if (boost::filesystem::exists(filePath))
-      {
-        std::cerr << "File is already exists. It will be overridden" << std::endl;
-      }
-
-      boost::filesystem::create_directories("uploads");
-
-      mOut.open(targetPath, std::ios_base::binary | std::ios_base::trunc);
-      if (!mOut.is_open())
-      {
-        std::cerr << "File couldn't be open: " << targetPath << std::endl;
-        SendUploadStatus(request.filename(), "File couldn't be open", false, 0);
-        return;
-      }
+    ServerPool server(workers, acceptMode == "shared" ? AcceptMode::SHARED : AcceptMode::REUSE_PORT, port, config);
+    server.Start();
+    LOG_INFO("Server is listening Port " << server.LocalPort() << " with " << server.Workers()
+             << " workers (" << acceptMode << ")");
 
-      std::cout << "File transfer request is received: " << mCurrentFilename << std::endl;
-      SendUploadStatus(request.filename(), "File transfer request is received", true, 0);
-    }
-
-    void HandleFileChunk(const filetransfer::FileChunk& chunk)
+    // Scrapes are served on their own thread, away from the workers
+    ba::io_context metricsContext;
+    std::unique_ptr<MetricsServer> pMetricsServer;
+    std::thread metricsThread;
+    if (metricsPort != 0)
     {
-      if (!mOut.is_open() || chunk.filename() != mCurrentFilename)
-      {
-        std::cerr << "Wrong filename" << std::endl;
-        SendUploadStatus(chunk.filename(), "Wrong filename", false, 0);
-        return;
-      }
-
-      mOut.seekp(chunk.offset(), std::ios_base::beg);
-      mOut.write(chunk.data().c_str(), chunk.data().length());
-
-      mBytesReceived += chunk.data().length();
-
-      std::cout << "Received: " << mBytesReceived << " Remaining: "
-                << static_cast<double>(mBytesReceived) / mCurrentFileSize * 100.0
-                << "%" << std::endl;
-        
-      if (mBytesReceived >= mCurrentFileSize || chunk.is_last_chunk())
-      {
-        std::cout << "All bytes received: " << mCurrentFilename << std::endl;
-        SendUploadStatus(chunk.filename(), "All bytes received", true, mBytesReceived);
-      }
-      else
-      {
-        SendUploadStatus(chunk.filename(), "Bytes received", true, mBytesReceived);
-      }
+      pMetricsServer = std::make_unique<MetricsServer>(metricsContext, metricsPort, server.Metrics());
+      pMetricsServer->StartAccept();
+      metricsThread = std::thread([&metricsContext] { metricsContext.run(); });
+      LOG_INFO("Metrics on http://127.0.0.1:" << pMetricsServer->LocalPort() << "/metrics");
     }
 
-    void HandleUploadFinished(const filetransfer::FileUploadFinished& finished)
+    server.Join();
+    if (metricsThread.joinable())
     {
-      if (finished.filename() == mCurrentFilename && mOut.is_open())
-      {
-        mOut.close();
-        std::cout << "File transfer completed: " << mCurrentFilename << std::endl;
-        SendUploadStatus(mCurrentFilename, "File transfer completed", true, mCurrentFileSize);
-      }
+      metricsContext.stop();
+      metricsThread.join();
     }
-
-    void SendUploadStatus(const std::string& filename, const std::string& statusMsg,
-                          bool success, uint64_t receivedBytes)
-    {
-      filetransfer::ServerMessage serverMsg;
-      filetransfer::FileUploadStatus* status = serverMsg.mutable_upload_status();
-      status->set_filename(filename);
-      status->set_status_message(statusMsg);
-      status->set_success(success);
-      status->set_bytes_received(receivedBytes);
-
-      AsyncWriteProtobufMessage(*mSocket, serverMsg, [] (const auto& error, auto /* sz */) {
-        if (error)
-        {
-          std::cerr << "SendUploadStatus write error: " << error.message() << std::endl;
-        }
-      });
-    }
-
-    void HandleWrite(const boost::system::error_code& error, size_t transferredByte) {
-      if (error)
-      {
-        std::cerr << "Error in HandleWrite: " << error.message() << std::endl;
-      }
-    }
-
-  private:
-    std::shared_ptr<bai::tcp::socket> mSocket;
-    ba::streambuf mBuffer;
-    std::vector<char> mData;
-    std::ofstream mOut;
-    std::string mCurrentFilename{""};
-    size_t mCurrentFileSize{0};
-    size_t mBytesReceived{0};
-};
-
-class Server
-{
-public:
-  Server(ba::io_context& context)
-    : mContext(context),
-      mAcceptor(context, bai::tcp::endpoint(bai::tcp::v4(), 12345))
-  {}
-
-  void StartAccept()
-  {
-    auto session = std::make_shared<Session>(mContext);
-
-    mAcceptor.async_accept(session->GetSocket(), std::bind(&Server::HandleAccept, this, session, std::placeholders::_1));
-  }
-
-private:
-  void HandleAccept(std::shared_ptr<Session> session, const boost::system::error_code& error)
-  {
-    if (!error)
-    {
-      std::cout << "New connection has been established: " << session->GetSocket().remote_endpoint() << std::endl;
-      session->Start();
-    }
-    else
-    {
-      std::cerr << "Error in accept: " << error.message() << std::endl;
-    }
-
-    StartAccept();
-  }
-
-  ba::io_context& mContext;
-  bai::tcp::acceptor mAcceptor;
-};
-
-int main()
-{
-  try
-  {
-    ba::io_context context;
-    Server server(context);
-    server.StartAccept();
-    std::cout << "Server is listening Port 12345" << std::endl;
-    
-    context.run();
   }
   catch (const std::exception& e)
   {
-    std::cerr << "Server error: " << e.what() << std::endl;
+    LOG_ERROR("Server error: " << e.what());
   }
 
   return 0;
@@ -0,0 +1,153 @@
+#ifndef FILETRANSFER_HANDLER_MEMORY_H_
+#define FILETRANSFER_HANDLER_MEMORY_H_
+
+// Memory for the asynchronous operations of one connection. Every socket read and write, timer wait, post and disk
+// round trip allocates an operation object that Asio frees before calling its handler. Handlers bound to the
+// connection's HandlerAllocator (BindAllocator) take those from a few fixed blocks the connection keeps reusing, where
+// Asio's own per-thread cache holds a single block and misses whenever more operations are in flight or an
+// operation is freed on another thread than the one that started it (the disk stage). Blocks are claimed and returned
+// with atomics for that reason. A request they can't serve, too large or with every block in use, goes to the heap.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Fits the largest operation a session starts, a gather write of its write queue
+const size_t HANDLER_BLOCK_SIZE = 512;
+// More than a session has in flight with the default limits: a read, a write, the ack timer, a few posts, and one
+// disk job per pending disk write
+const size_t HANDLER_BLOCK_COUNT = 32;
+
+class HandlerMemory
+{
+public:
+  HandlerMemory() = default;
+  HandlerMemory(const HandlerMemory &) = delete;
+  HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+  void *Allocate(size_t size)
+  {
+    if (size <= HANDLER_BLOCK_SIZE)
+    {
+      uint64_t used = mUsed.load(std::memory_order_relaxed);
+      while (~used != 0)
+      {
+        const int index = __builtin_ctzll(~used);
+        if (mUsed.compare_exchange_weak(used, used | (uint64_t(1) << index), std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+        {
+          return mBlocks[index].mData;
+        }
+      }
+    }
+    return ::operator new(size);
+  }
+
+  void Deallocate(void *pointer)
+  {
+    const uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(mBlocks);
+    if (address >= begin && address < begin + sizeof(mBlocks))
+    {
+      const size_t index = (address - begin) / sizeof(Block);
+      mUsed.fetch_and(~(uint64_t(1) << index), std::memory_order_release);
+      return;
+    }
+    ::operator delete(pointer);
+  }
+
+private:
+  static_assert(HANDLER_BLOCK_COUNT <= 64, "Blocks in use are tracked in one 64 bit word");
+
+  struct Block
+  {
+    alignas(std::max_align_t) unsigned char mData[HANDLER_BLOCK_SIZE];
+  };
+
+  Block mBlocks[HANDLER_BLOCK_COUNT];
+  std::atomic<uint64_t> mUsed{0}; // One bit per block
+};
+
+// Standard allocator over a connection's HandlerMemory. It shares ownership of the memory, since an operation can
+// finish after the connection that started it is gone (a timer wait cancelled by its destruction, say).
+template <typename T>
+class HandlerAllocator
+{
+public:
+  using value_type = T;
+
+  explicit HandlerAllocator(std::shared_ptr<HandlerMemory> pMemory) : mpMemory(std::move(pMemory)) {}
+
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U> &other) noexcept : mpMemory(other.mpMemory)
+  {
+  }
+
+  T *allocate(size_t n)
+  {
+    return static_cast<T *>(mpMemory->Allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T *pointer, size_t /* n */)
+  {
+    mpMemory->Deallocate(pointer);
+  }
+
+  template <typename U>
+  bool operator==(const HandlerAllocator<U> &other) const noexcept
+  {
+    return mpMemory == other.mpMemory;
+  }
+
+  template <typename U>
+  bool operator!=(const HandlerAllocator<U> &other) const noexcept
+  {
+    return mpMemory != other.mpMemory;
+  }
+
+private:
+  template <typename U>
+  friend class HandlerAllocator;
+
+  std::shared_ptr<HandlerMemory> mpMemory;
+};
+
+// A handler whose associated allocator is allocator, which Asio then uses for the operations started with it
+// and for the posts and strand hops that deliver its completion
+template <typename Handler, typename Allocator>
+class AllocatorBinder
+{
+public:
+  using allocator_type = Allocator;
+
+  AllocatorBinder(const Allocator &allocator, Handler handler) : mHandler(std::move(handler)), mAllocator(allocator) {}
+
+  allocator_type get_allocator() const noexcept
+  {
+    return mAllocator;
+  }
+
+  template <typename... Args>
+  void operator()(Args &&...args)
+  {
+    mHandler(std::forward<Args>(args)...);
+  }
+
+private:
+  Handler mHandler;
+  Allocator mAllocator;
+};
+
+// With std::allocator, what a handler has by default, Asio keeps using its per-thread cache
+template <typename Allocator, typename Handler>
+AllocatorBinder<typename std::decay<Handler>::type, Allocator> BindAllocator(const Allocator &allocator,
+                                                                             Handler &&handler)
+{
+  return AllocatorBinder<typename std::decay<Handler>::type, Allocator>(allocator, std::forward<Handler>(handler));
+}
+
+#endif // FILETRANSFER_HANDLER_MEMORY_H_
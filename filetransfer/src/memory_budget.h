@@ -0,0 +1,94 @@
+#ifndef FILETRANSFER_MEMORY_BUDGET_H_
+#define FILETRANSFER_MEMORY_BUDGET_H_
+
+// Bytes of received chunk data held in memory by all sessions together, on their way to disk or in buffers kept for
+// reuse. Sessions count their writes and buffers in and out and stop reading from their sockets while the budget is
+// used up, which leaves the pushing back to TCP flow control instead of letting memory grow with the number of
+// uploads.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+class MemoryBudget
+{
+public:
+  // 0 means no limit
+  explicit MemoryBudget(uint64_t limit) : mLimit(limit) {}
+
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  // Counts bytes already received against the budget. They may take it over the limit, what is checked is
+  // whether more should be read (IsExhausted).
+  void Acquire(uint64_t bytes)
+  {
+    const uint64_t used = mUsed.fetch_add(bytes) + bytes;
+    uint64_t peak = mPeak.load(std::memory_order_relaxed);
+    while (used > peak && !mPeak.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  void Release(uint64_t bytes)
+  {
+    mUsed.fetch_sub(bytes);
+    // Pairs with Wait, which counts itself in before checking the budget, so one of the two sees the other
+    if (mWaiterCount.load() == 0)
+    {
+      return;
+    }
+    std::vector<std::function<void()>> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (IsExhausted())
+      {
+        return;
+      }
+      waiters.swap(mWaiters);
+      mWaiterCount = 0;
+    }
+    for (auto &waiter : waiters)
+    {
+      waiter();
+    }
+  }
+
+  bool IsExhausted() const
+  {
+    return mLimit != 0 && mUsed.load() >= mLimit;
+  }
+
+  // Runs waiter once the budget has room again, on the thread releasing it, or right away if it has room now
+  void Wait(std::function<void()> waiter)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      ++mWaiterCount;
+      if (IsExhausted())
+      {
+        mWaiters.push_back(std::move(waiter));
+        return;
+      }
+      --mWaiterCount;
+    }
+    waiter();
+  }
+
+  uint64_t Limit() const { return mLimit; }
+  uint64_t Used() const { return mUsed.load(std::memory_order_relaxed); }
+  uint64_t Peak() const { return mPeak.load(std::memory_order_relaxed); }
+
+private:
+  const uint64_t mLimit;
+  std::atomic<uint64_t> mUsed{0};
+  std::atomic<uint64_t> mPeak{0};
+  std::atomic<size_t> mWaiterCount{0};
+  std::mutex mMutex;
+  std::vector<std::function<void()>> mWaiters;
+};
+
+#endif // FILETRANSFER_MEMORY_BUDGET_H_
@@ -0,0 +1,246 @@
+#ifndef FILETRANSFER_METRICS_H_
+#define FILETRANSFER_METRICS_H_
+
+// Counters, gauges and histograms cheap enough to record on every chunk. Each metric is split into cache line
+// sized shards, a thread always records into the same shard with relaxed atomic adds, and the shards are only
+// summed when the metrics are rendered in the Prometheus text format (MetricsRegistry::Render).
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const size_t METRIC_SHARDS = 16;
+
+// Shard of the calling thread, threads are spread over the shards in the order they first record
+inline size_t MetricShard()
+{
+  static std::atomic<size_t> sNextShard{0};
+  thread_local const size_t tShard = sNextShard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+  return tShard;
+}
+
+inline uint64_t SteadyNanos()
+{
+  return static_cast<uint64_t>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+class Metric
+{
+public:
+  virtual ~Metric() = default;
+  // Writes the metric's sample lines
+  virtual void Render(std::ostream &out, const std::string &name) const = 0;
+};
+
+// Only ever goes up, Prometheus derives rates from it
+class Counter : public Metric
+{
+public:
+  void Add(uint64_t value = 1)
+  {
+    mShards[MetricShard()].mValue.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t Value() const
+  {
+    uint64_t value = 0;
+    for (const auto &shard : mShards)
+    {
+      value += shard.mValue.load(std::memory_order_relaxed);
+    }
+    return value;
+  }
+
+  void Render(std::ostream &out, const std::string &name) const override
+  {
+    out << name << " " << Value() << "\n";
+  }
+
+private:
+  struct alignas(64) Shard
+  {
+    std::atomic<uint64_t> mValue{0};
+  };
+  std::array<Shard, METRIC_SHARDS> mShards;
+};
+
+// Goes up and down, a shard may go negative when a thread decrements what another one incremented
+class Gauge : public Metric
+{
+public:
+  void Add(int64_t value)
+  {
+    mShards[MetricShard()].mValue.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  int64_t Value() const
+  {
+    int64_t value = 0;
+    for (const auto &shard : mShards)
+    {
+      value += shard.mValue.load(std::memory_order_relaxed);
+    }
+    return value;
+  }
+
+  void Render(std::ostream &out, const std::string &name) const override
+  {
+    out << name << " " << Value() << "\n";
+  }
+
+private:
+  struct alignas(64) Shard
+  {
+    std::atomic<int64_t> mValue{0};
+  };
+  std::array<Shard, METRIC_SHARDS> mShards;
+};
+
+// Durations in nanoseconds counted into fixed buckets, rendered in seconds. A scrape that races with recording may
+// see a bucket count and the total from slightly different moments, which Prometheus tolerates.
+class Histogram : public Metric
+{
+public:
+  // Upper bounds of the buckets in nanoseconds, ascending; values above the last go to +Inf
+  explicit Histogram(std::vector<uint64_t> bounds)
+      : mBounds(std::move(bounds)), mShards(std::make_unique<Shard[]>(METRIC_SHARDS))
+  {
+    for (size_t i = 0; i < METRIC_SHARDS; i++)
+    {
+      mShards[i].mCounts = std::make_unique<std::atomic<uint64_t>[]>(mBounds.size() + 1);
+    }
+  }
+
+  void Observe(uint64_t nanos)
+  {
+    size_t bucket = 0;
+    while (bucket < mBounds.size() && nanos > mBounds[bucket])
+    {
+      bucket++;
+    }
+    Shard &shard = mShards[MetricShard()];
+    shard.mCounts[bucket].fetch_add(1, std::memory_order_relaxed);
+    shard.mSum.fetch_add(nanos, std::memory_order_relaxed);
+  }
+
+  void ObserveSince(uint64_t startNanos)
+  {
+    const uint64_t now = SteadyNanos();
+    Observe(now > startNanos ? now - startNanos : 0);
+  }
+
+  void Render(std::ostream &out, const std::string &name) const override
+  {
+    uint64_t cumulative = 0;
+    uint64_t sum = 0;
+    for (size_t bucket = 0; bucket <= mBounds.size(); bucket++)
+    {
+      for (size_t i = 0; i < METRIC_SHARDS; i++)
+      {
+        cumulative += mShards[i].mCounts[bucket].load(std::memory_order_relaxed);
+      }
+      out << name << "_bucket{le=\"";
+      if (bucket < mBounds.size())
+      {
+        out << mBounds[bucket] / 1e9;
+      }
+      else
+      {
+        out << "+Inf";
+      }
+      out << "\"} " << cumulative << "\n";
+    }
+    for (size_t i = 0; i < METRIC_SHARDS; i++)
+    {
+      sum += mShards[i].mSum.load(std::memory_order_relaxed);
+    }
+    out << name << "_sum " << sum / 1e9 << "\n" << name << "_count " << cumulative << "\n";
+  }
+
+  // Bounds from 1 microsecond to about 4 seconds, doubling
+  static std::vector<uint64_t> ExponentialBounds(uint64_t first = 1000, size_t count = 23)
+  {
+    std::vector<uint64_t> bounds;
+    for (size_t i = 0; i < count; i++)
+    {
+      bounds.push_back(first << i);
+    }
+    return bounds;
+  }
+
+private:
+  struct alignas(64) Shard
+  {
+    std::unique_ptr<std::atomic<uint64_t>[]> mCounts;
+    std::atomic<uint64_t> mSum{0};
+  };
+
+  std::vector<uint64_t> mBounds;
+  std::unique_ptr<Shard[]> mShards;
+};
+
+// Owns the metrics, which are registered up front and live as long as the registry; recording into them needs
+// no lock, only registering and rendering take one.
+class MetricsRegistry
+{
+public:
+  Counter &AddCounter(const std::string &name, const std::string &help)
+  {
+    return Add<Counter>(name, help, "counter", std::make_unique<Counter>());
+  }
+
+  Gauge &AddGauge(const std::string &name, const std::string &help)
+  {
+    return Add<Gauge>(name, help, "gauge", std::make_unique<Gauge>());
+  }
+
+  Histogram &AddHistogram(const std::string &name, const std::string &help,
+                          std::vector<uint64_t> bounds = Histogram::ExponentialBounds())
+  {
+    return Add<Histogram>(name, help, "histogram", std::make_unique<Histogram>(std::move(bounds)));
+  }
+
+  // Prometheus text exposition format, version 0.0.4
+  std::string Render() const
+  {
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const auto &entry : mEntries)
+    {
+      out << "# HELP " << entry.mName << " " << entry.mHelp << "\n"
+          << "# TYPE " << entry.mName << " " << entry.mType << "\n";
+      entry.mpMetric->Render(out, entry.mName);
+    }
+    return out.str();
+  }
+
+private:
+  struct Entry
+  {
+    std::string mName;
+    std::string mHelp;
+    std::string mType;
+    std::unique_ptr<Metric> mpMetric;
+  };
+
+  template <typename T>
+  T &Add(const std::string &name, const std::string &help, const std::string &type, std::unique_ptr<T> pMetric)
+  {
+    T &metric = *pMetric;
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.push_back(Entry{name, help, type, std::move(pMetric)});
+    return metric;
+  }
+
+  mutable std::mutex mMutex;
+  std::vector<Entry> mEntries;
+};
+
+#endif // FILETRANSFER_METRICS_H_
@@ -0,0 +1,104 @@
+#ifndef FILETRANSFER_METRICS_SERVER_H_
+#define FILETRANSFER_METRICS_SERVER_H_
+
+// Minimal HTTP/1.0 endpoint serving a MetricsRegistry to Prometheus on GET /metrics. One request per connection,
+// answered and closed; scrapes are rare, so each renders the registry afresh.
+
+#include "metrics.h"
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+
+class MetricsServer
+{
+public:
+  // Listens on the loopback interface only, port 0 picks an ephemeral one
+  MetricsServer(ba::io_context &context, unsigned short port, const MetricsRegistry &registry)
+      : mContext(context), mAcceptor(context, bai::tcp::endpoint(bai::address_v4::loopback(), port)),
+        mRegistry(registry)
+  {
+  }
+
+  unsigned short LocalPort() const
+  {
+    return mAcceptor.local_endpoint().port();
+  }
+
+  void StartAccept()
+  {
+    auto pSocket = std::make_shared<bai::tcp::socket>(mContext);
+    mAcceptor.async_accept(*pSocket, [this, pSocket](const boost::system::error_code &error)
+                           {
+                             if (error == ba::error::operation_aborted)
+                             {
+                               return;
+                             }
+                             if (!error)
+                             {
+                               std::make_shared<Exchange>(std::move(*pSocket), mRegistry)->Start();
+                             }
+                             StartAccept();
+                           });
+  }
+
+private:
+  // One request and its response
+  struct Exchange : public std::enable_shared_from_this<Exchange>
+  {
+    static const size_t MAX_REQUEST_SIZE = 8192;
+
+    Exchange(bai::tcp::socket socket, const MetricsRegistry &registry)
+        : mSocket(std::move(socket)), mRequest(MAX_REQUEST_SIZE), mRegistry(registry)
+    {
+    }
+
+    void Start()
+    {
+      auto self(shared_from_this());
+      ba::async_read_until(mSocket, mRequest, "\r\n\r\n", [self](const boost::system::error_code &error, size_t sz)
+                           {
+                             if (!error)
+                             {
+                               self->Respond(sz);
+                             }
+                           });
+    }
+
+    void Respond(size_t headerSize)
+    {
+      const std::string request(ba::buffers_begin(mRequest.data()), ba::buffers_begin(mRequest.data()) + headerSize);
+      const std::string requestLine = request.substr(0, request.find("\r\n"));
+      if (requestLine.rfind("GET /metrics ", 0) == 0 || requestLine.rfind("GET / ", 0) == 0)
+      {
+        const std::string body = mRegistry.Render();
+        mResponse = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+      }
+      else
+      {
+        mResponse = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      }
+
+      auto self(shared_from_this());
+      ba::async_write(mSocket, ba::buffer(mResponse), [self](const boost::system::error_code & /*error*/, size_t /*sz*/)
+                      {
+                        boost::system::error_code ignored;
+                        self->mSocket.shutdown(bai::tcp::socket::shutdown_both, ignored);
+                      });
+    }
+
+    bai::tcp::socket mSocket;
+    ba::streambuf mRequest;
+    std::string mResponse;
+    const MetricsRegistry &mRegistry;
+  };
+
+  ba::io_context &mContext;
+  bai::tcp::acceptor mAcceptor;
+  const MetricsRegistry &mRegistry;
+};
+
+#endif // FILETRANSFER_METRICS_SERVER_H_
@@ -0,0 +1,87 @@
+#ifndef FILETRANSFER_RANGE_SET_H_
+#define FILETRANSFER_RANGE_SET_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+
+// Set of byte ranges [start, end), kept merged so adjacent and overlapping ranges collapse into one
+class RangeSet
+{
+public:
+  void Add(uint64_t start, uint64_t end)
+  {
+    if (start >= end)
+    {
+      return;
+    }
+
+    // A range that starts before and reaches into [start, end] is extended in place: adding ranges in order needs
+    // no new map nodes
+    auto it = mRanges.upper_bound(start);
+    auto merged = mRanges.end();
+    if (it != mRanges.begin() && std::prev(it)->second >= start)
+    {
+      merged = std::prev(it);
+    }
+    // Swallow every range that starts inside [start, end]
+    while (it != mRanges.end() && it->first <= end)
+    {
+      end = std::max(end, it->second);
+      it = mRanges.erase(it);
+    }
+    if (merged != mRanges.end())
+    {
+      merged->second = std::max(merged->second, end);
+    }
+    else
+    {
+      mRanges.emplace_hint(it, start, end);
+    }
+  }
+
+  bool Covers(uint64_t start, uint64_t end) const
+  {
+    if (start >= end)
+    {
+      return true;
+    }
+    auto it = mRanges.upper_bound(start);
+    if (it == mRanges.begin())
+    {
+      return false;
+    }
+    return std::prev(it)->second >= end;
+  }
+
+  // End of the covered run starting at from, or from itself if from isn't covered
+  uint64_t ContiguousEnd(uint64_t from) const
+  {
+    auto it = mRanges.upper_bound(from);
+    if (it == mRanges.begin())
+    {
+      return from;
+    }
+    return std::max(from, std::prev(it)->second);
+  }
+
+  uint64_t CoveredBytes() const
+  {
+    uint64_t total = 0;
+    for (const auto &range : mRanges)
+    {
+      total += range.second - range.first;
+    }
+    return total;
+  }
+
+  const std::map<uint64_t, uint64_t> &Ranges() const { return mRanges; }
+
+  void Clear() { mRanges.clear(); }
+
+private:
+  std::map<uint64_t, uint64_t> mRanges; // start -> end
+};
+
+#endif // FILETRANSFER_RANGE_SET_H_
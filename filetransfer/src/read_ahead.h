@@ -0,0 +1,131 @@
+#ifndef FILETRANSFER_READ_AHEAD_H_
+#define FILETRANSFER_READ_AHEAD_H_
+
+// Reads a byte range of a file front to back on a background thread, up to a fixed number of chunks ahead of the
+// consumer, so disk reads overlap with sending instead of adding to it. The chunk buffers are recycled: Take()
+// swaps the ready data into the caller's string and keeps the caller's old buffer for a later read.
+
+#include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+
+class ReadAhead
+{
+public:
+  // Reads [start, end) of fd in chunks of chunkSize, at most depth of them ahead. onReady is posted to executor
+  // whenever a chunk becomes ready while the consumer waits for one (Take returned false).
+  ReadAhead(int fd, uint64_t start, uint64_t end, size_t chunkSize, size_t depth, ba::any_io_executor executor,
+            std::function<void()> onReady)
+      : mFd(fd), mNextReadOffset(start), mEnd(end), mChunkSize(std::max<size_t>(chunkSize, 1)),
+        mSlots(std::max<size_t>(depth, 1)), mExecutor(std::move(executor)), mOnReady(std::move(onReady))
+  {
+    ::posix_fadvise(mFd, static_cast<off_t>(start), static_cast<off_t>(end - start), POSIX_FADV_SEQUENTIAL);
+    mThread = std::thread([this]() { Run(); });
+  }
+
+  ReadAhead(const ReadAhead &) = delete;
+  ReadAhead &operator=(const ReadAhead &) = delete;
+
+  ~ReadAhead()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsStopped = true;
+    }
+    mCondition.notify_all();
+    mThread.join();
+  }
+
+  // Swaps the next chunk's data into data and returns true with its offset, or returns false if it hasn't been
+  // read yet (onReady follows once it has). A failed read sets error instead and returns true.
+  bool Take(std::string &data, uint64_t &offset, bool &error)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (mReady == 0)
+      {
+        mIsConsumerWaiting = true;
+        return false;
+      }
+      Slot &slot = mSlots[mFirstReady];
+      offset = slot.mOffset;
+      error = slot.mIsError;
+      data.swap(slot.mData);
+      mFirstReady = (mFirstReady + 1) % mSlots.size();
+      --mReady;
+    }
+    mCondition.notify_one();
+    return true;
+  }
+
+  // Reads that had to wait for a free slot because the consumer was behind, and reads the consumer had to wait for
+  uint64_t ReaderStalls() const { return mReaderStalls; }
+  uint64_t ConsumerStalls() const { return mConsumerStalls; }
+
+private:
+  struct Slot
+  {
+    uint64_t mOffset{0};
+    std::string mData;
+    bool mIsError{false};
+  };
+
+  void Run()
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    size_t next = 0; // Slot the next read goes into
+    while (!mIsStopped && mNextReadOffset < mEnd)
+    {
+      if (mReady == mSlots.size())
+      {
+        ++mReaderStalls;
+        mCondition.wait(lock, [this]() { return mIsStopped || mReady < mSlots.size(); });
+        continue;
+      }
+
+      // The slot is ours until it is marked ready, the consumer only touches ready ones
+      Slot &slot = mSlots[next];
+      const uint64_t offset = mNextReadOffset;
+      const size_t length = static_cast<size_t>(std::min<uint64_t>(mChunkSize, mEnd - offset));
+      lock.unlock();
+      slot.mData.resize(length);
+      const ssize_t bytesRead = ReadAllAt(mFd, &slot.mData[0], length, offset);
+      slot.mIsError = bytesRead <= 0;
+      slot.mData.resize(bytesRead > 0 ? static_cast<size_t>(bytesRead) : 0);
+      slot.mOffset = offset;
+      lock.lock();
+
+      mNextReadOffset = slot.mIsError ? mEnd : offset + slot.mData.length();
+      next = (next + 1) % mSlots.size();
+      ++mReady;
+      if (mIsConsumerWaiting)
+      {
+        ++mConsumerStalls;
+        mIsConsumerWaiting = false;
+        ba::post(mExecutor, mOnReady);
+      }
+    }
+  }
+
+  int mFd;
+  uint64_t mNextReadOffset;
+  uint64_t mEnd;
+  size_t mChunkSize;
+  std::vector<Slot> mSlots; // Ring of chunks, mReady of them ready from mFirstReady on
+  size_t mFirstReady{0};
+  size_t mReady{0};
+  bool mIsConsumerWaiting{false};
+  bool mIsStopped{false};
+  std::atomic<uint64_t> mReaderStalls{0};
+  std::atomic<uint64_t> mConsumerStalls{0};
+  ba::any_io_executor mExecutor;
+  std::function<void()> mOnReady;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::thread mThread;
+};
+
+#endif // FILETRANSFER_READ_AHEAD_H_
@@ -0,0 +1,1670 @@
+#ifndef FILETRANSFER_SERVER_H_
+#define FILETRANSFER_SERVER_H_
+
+#include "common.h"
+#include "zero_copy.h"
+#include "write_queue.h"
+#include "buffer_pool.h"
+#include "file_cache.h"
+#include "memory_budget.h"
+#include "disk_writer.h"
+#include "metrics.h"
+#include "transfer_registry.h"
+#include "delta.h"
+#include "compression.h"
+#include "filetransfer.pb.h"
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+
+namespace ba = boost::asio;
+namespace bai = boost::asio::ip;
+
+// Frame payload allowed beyond a chunk's data, for the filename, the other fields and the ops of a delta chunk
+const uint32_t MAX_FRAME_OVERHEAD = 1024 * 1024;
+
+// Chunk buffers a session keeps for reuse, fewer when its memory budget holds fewer chunks
+const size_t MAX_POOLED_CHUNK_BUFFERS = 32;
+
+struct ServerConfig
+{
+  // Largest chunk the server agrees to. Each session buffers one chunk payload at a time,
+  // so this bounds the per-session receive memory.
+  uint32_t mMaxChunkSize{4 * 1024 * 1024};
+  // Accept raw data frames (spliced straight from the socket into the file) when the client asks for them
+  bool mAllowRawDataFrames{true};
+  // Disk I/O stage: worker threads, writes queued across all sessions, and writes a session may have
+  // outstanding before it stops reading from its socket
+  size_t mDiskThreads{4};
+  size_t mMaxQueuedDiskWrites{256};
+  size_t mMaxPendingDiskWritesPerSession{16};
+  // Bytes of chunk data a session may hold in memory on their way to disk, and all sessions together (0 = no
+  // limit). A session over either budget stops reading its socket until writes drain. Buffers kept for reuse count
+  // too: the receive buffer against both, pooled chunk buffers against the shared one, while a session's pool holds
+  // no more chunks than its own budget.
+  uint64_t mSessionMemoryBudget{64ULL << 20};
+  uint64_t mMemoryBudget{1ULL << 30};
+  // Bytes received between saves of a resumable upload's manifest, which flush the file to disk
+  uint64_t mManifestInterval{64ULL << 20};
+  // Clients that understand UploadAck are acknowledged cumulatively: once mAckEveryChunks chunks or mAckEveryBytes
+  // bytes are on disk, or mAckDelay after the first of them, whichever comes first. Errors and the last chunk are
+  // acknowledged right away.
+  size_t mAckEveryChunks{8};
+  uint64_t mAckEveryBytes{4ULL << 20};
+  std::chrono::microseconds mAckDelay{2000};
+  // Uploads a client may run at once over one connection
+  size_t mMaxStreamsPerSession{64};
+  // Downloads read through a whole-file mmap, copied from the page cache on the session's thread, or with pread in
+  // the disk stage. Up to mOpenFileCacheSize files stay open between downloads (FileCache).
+  bool mIsDownloadMapped{false};
+  size_t mOpenFileCacheSize{16};
+  // Chunks of one download being read or waiting to be written to the socket
+  size_t mMaxQueuedDownloadChunks{4};
+};
+
+// What the sessions record for MetricsServer, registered once in the registry the server renders
+struct ServerMetrics
+{
+  explicit ServerMetrics(MetricsRegistry& registry)
+    : mActiveSessions(registry.AddGauge("filetransfer_active_sessions", "Connections being served")),
+      mReceivedBytes(registry.AddCounter("filetransfer_received_bytes_total", "Upload bytes written to disk")),
+      mChunks(registry.AddCounter("filetransfer_chunks_total", "Upload chunks written to disk")),
+      mChecksumFailures(registry.AddCounter("filetransfer_checksum_failures_total",
+                                            "Frames whose payload failed the checksum, each closes its connection")),
+      mFrameParseTime(registry.AddHistogram("filetransfer_frame_parse_seconds", "Time to parse a received frame")),
+      mDiskWriteTime(registry.AddHistogram("filetransfer_disk_write_seconds",
+                                           "Time to write a received chunk in the disk stage")),
+      mUploadAckDelay(registry.AddHistogram("filetransfer_upload_ack_delay_seconds",
+                                            "Time from an upload chunk reaching disk to its acknowledgement")),
+      mDownloadAckRtt(registry.AddHistogram("filetransfer_download_ack_rtt_seconds",
+                                            "Time from queueing a download chunk to the client acknowledging it"))
+  {
+  }
+
+  Gauge& mActiveSessions;
+  Counter& mReceivedBytes;
+  Counter& mChunks;
+  Counter& mChecksumFailures;
+  Histogram& mFrameParseTime;
+  Histogram& mDiskWriteTime;
+  Histogram& mUploadAckDelay;
+  Histogram& mDownloadAckRtt;
+};
+
+// State shared by the sessions of every worker
+struct ServerResources
+{
+  explicit ServerResources(const ServerConfig& config)
+    : mDiskWriter(config.mDiskThreads, config.mMaxQueuedDiskWrites), mTransfers(config.mManifestInterval, &mDiskWriter),
+      mFiles(config.mOpenFileCacheSize, config.mIsDownloadMapped), mMemory(config.mMemoryBudget),
+      mMetrics(mMetricsRegistry)
+  {
+  }
+
+  DiskWriter mDiskWriter;
+  TransferRegistry mTransfers;
+  FileCache mFiles; // Served to downloads
+  MemoryBudget mMemory; // Chunk data of every session on its way to disk, and the buffers kept for reuse
+  MetricsRegistry mMetricsRegistry;
+  ServerMetrics mMetrics;
+};
+
+// Upload rebuilt from a delta against the existing target file (the basis). The new version is written next to it
+// and only replaces it once complete.
+struct DeltaUpload
+{
+  std::shared_ptr<FileDescriptor> mpBasis;
+  uint64_t mBasisSize{0};
+  uint32_t mBlockSize{0};
+  std::shared_ptr<FileDescriptor> mpOutput;
+  std::string mOutputPath;
+  bool mIsFinished{false};
+};
+
+// One upload on a connection. Every message carries the stream_id of the upload it belongs to, so a connection can
+// carry several uploads at once; clients that don't multiplex send everything on stream 0.
+struct UploadStream
+{
+  uint32_t mId{0};
+  std::string mFilename;
+  size_t mFileSize{0};
+  uint64_t mRangeStart{0};
+  uint64_t mRangeEnd{0};
+  size_t mBytesReceived{0};
+  uint32_t mChunkSize{DEFAULT_CHUNK_SIZE};
+  bool mIsRawDataFrames{false};
+  filetransfer::CompressionCodec mCompression{filetransfer::COMPRESSION_NONE};
+  std::shared_ptr<CompressionStats> mpCompressionStats;
+  std::shared_ptr<Transfer> mpTransfer;
+  std::shared_ptr<DeltaUpload> mpDelta;
+  size_t mPendingDiskWrites{0};
+  bool mIsFinishPending{false}; // FileUploadFinished arrived while writes were still pending
+  // Cumulative acks, see SetAckPolicy
+  bool mIsCompactAcks{false};
+  size_t mAckEveryChunks{1};
+  uint64_t mAckEveryBytes{1};
+  size_t mUnackedChunks{0}; // On disk but not acknowledged yet
+  uint64_t mUnackedBytes{0};
+  uint64_t mFirstUnackedNanos{0}; // SteadyNanos when the oldest of them reached disk
+
+  bool IsInRange(uint64_t offset, uint64_t length) const
+  {
+    return offset >= mRangeStart && offset <= mRangeEnd && length <= mRangeEnd - offset;
+  }
+};
+
+// A file sent to the client on one stream of a connection. The client acknowledges what it has written
+// (DownloadAck), the server keeps at most mWindowBytes beyond that in flight.
+struct DownloadStream
+{
+  uint32_t mId{0};
+  std::string mFilename;
+  std::shared_ptr<const CachedFile> mpFile;
+  uint32_t mChunkSize{DEFAULT_CHUNK_SIZE};
+  uint64_t mWindowBytes{0};
+  uint64_t mNextOffset{0};  // Of the next chunk to read
+  uint64_t mAckedOffset{0};
+  uint64_t mAdvisedEnd{0};  // Readahead was requested up to here
+  size_t mQueuedChunks{0};  // Being read or waiting in the write queue
+  std::deque<std::pair<uint64_t, uint64_t>> mUnackedChunks; // End offset and SteadyNanos when queued, of chunks sent
+};
+
+// A session's socket and timer run on a strand of its worker's io_context. The strand is named as their executor type,
+// as an any_io_executor would allocate a copy of it for every operation started on them.
+using SessionExecutor = ba::strand<ba::io_context::executor_type>;
+using SessionSocket = ba::basic_stream_socket<bai::tcp, SessionExecutor>;
+using SessionTimer = ba::basic_waitable_timer<std::chrono::steady_clock, ba::wait_traits<std::chrono::steady_clock>,
+                                              SessionExecutor>;
+using SessionWriteQueue = BasicWriteQueue<SessionSocket, HandlerAllocator<void>>;
+
+class Session : public std::enable_shared_from_this<Session> {
+  public:
+    Session(ba::io_context& context, const ServerConfig& config, std::shared_ptr<ServerResources> resources)
+      : mSocket(std::make_shared<SessionSocket>(ba::make_strand(context))),
+        mHandlerAllocator(std::make_shared<HandlerMemory>()),
+        mpWriteQueue(std::make_shared<SessionWriteQueue>(mSocket, mHandlerAllocator)), mAckTimer(mSocket->get_executor()), mConfig(config), mpResources(resources), mDiskStrand(resources->mDiskWriter.MakeStrand()),
+        mChunkWrites(ChunkBufferCount(config, config.mMaxChunkSize)),
+        mChunkBuffers(ChunkBufferCount(config, config.mMaxChunkSize))
+    {
+    }
+
+    ~Session()
+    {
+      if (mIsStarted)
+      {
+        mpResources->mMetrics.mActiveSessions.Add(-1);
+      }
+      // Disk writes whose completions were dropped unrun, with the context stopped, never gave their bytes back
+      mpResources->mMemory.Release(mRetainedBytes + mPendingDiskBytes);
+    }
+
+    SessionSocket& GetSocket()
+    {
+      return *mSocket;
+    }
+
+    void Start()
+    {
+      mIsStarted = true;
+      mpResources->mMetrics.mActiveSessions.Add(1);
+      // Acks are small and latency bound, send them without waiting on Nagle
+      boost::system::error_code ignored;
+      mSocket->set_option(bai::tcp::no_delay(true), ignored);
+      ReadHeader();
+    }
+
+  private:
+    class ChunkWrite;
+
+    void ReadHeader()
+    {
+      auto self(shared_from_this());
+      AsyncReadProtobufMessageHeader(*mSocket, mHeader,
+                                BindAllocator(mHandlerAllocator, [self](const boost::system::error_code &error, size_t sz) {
+                                    self->HandleReadHeader(error, sz);
+                                }));
+    }
+
+    void ReadPayload()
+    {
+      auto self(shared_from_this());
+      AsyncReadProtobufMessagePayload(*mSocket, mHeader, mData, mMessage,
+                                BindAllocator(mHandlerAllocator, [self](const boost::system::error_code &error, size_t sz,
+                                  filetransfer::ClientMessage* message) {
+                                    self->HandleReadPayload(error, sz, message);
+                                }));
+    }
+
+    void HandleReadHeader(const boost::system::error_code& error, size_t transferredByte)
+    {
+      // Turned away before a buffer is sized for it, no chunk we agree to needs a bigger frame
+      const uint64_t maxFrameSize = static_cast<uint64_t>(std::max(std::min(mConfig.mMaxChunkSize, MAX_CHUNK_SIZE),
+                                                                   DELTA_MAX_BLOCK_SIZE)) + MAX_FRAME_OVERHEAD;
+      if (!error && mHeader.mPayloadSize > maxFrameSize)
+      {
+        LOG_ERROR("Frame of " << mHeader.mPayloadSize << " bytes is over the limit of " << maxFrameSize
+                 << ", closing the connection");
+        CloseStreams();
+      }
+      else if (!error)
+      {
+        ReadPayload();
+      }
+      else
+      {
+        LOG_INFO("Error in HandleReadHeader: " << error.message());
+      }
+    }
+
+
+    // message is only valid until the next frame is read
+    void HandleReadPayload(const boost::system::error_code& error, size_t transferredByte,
+                    filetransfer::ClientMessage* message)
+    {
+      UpdateRetainedMemory(); // The receive buffer may have grown for this frame
+      if (!error && message)
+      {
+        mpResources->mMetrics.mFrameParseTime.Observe(mMessage.LastParseNanos());
+        const uint32_t streamId = message->stream_id();
+        switch (message->content_case())
+        {
+          case filetransfer::ClientMessage::kFileRequest:
+            HandleFileRequest(streamId, message->file_request());
+            break;
+          case filetransfer::ClientMessage::kFileChunk:
+            if (mHeader.mFlags & FRAME_FLAG_RAW_DATA)
+            {
+              // Raw data follows the descriptor, the next header is read once it has been consumed
+              HandleRawFileChunk(FindStream(streamId), message->file_chunk());
+              return;
+            }
+            HandleFileChunk(streamId, *message->mutable_file_chunk());
+            break;
+          case filetransfer::ClientMessage::kDeltaChunk:
+            HandleDeltaChunk(streamId, *message->mutable_delta_chunk());
+            break;
+          case filetransfer::ClientMessage::kUploadFinished:
+            HandleUploadFinished(streamId, message->upload_finished());
+            break;
+          case filetransfer::ClientMessage::kDownloadRequest:
+            HandleDownloadRequest(streamId, message->download_request());
+            break;
+          case filetransfer::ClientMessage::kDownloadAck:
+            HandleDownloadAck(streamId, message->download_ack());
+            break;
+          default:
+            LOG_INFO("Unknown ClientMessage type");
+            break;
+        }
+        ContinueReading();
+      }
+      else
+      {
+        if (error == ba::error::fault)
+        {
+          mpResources->mMetrics.mChecksumFailures.Add();
+        }
+        CloseStreams();
+        LOG_INFO("Error in HandleReadPayload: " << error.message());
+      }
+    }
+
+    std::shared_ptr<UploadStream> FindStream(uint32_t streamId) const
+    {
+      auto it = mStreams.find(streamId);
+      return it != mStreams.end() ? it->second : nullptr;
+    }
+
+    // A request on a stream that is still open replaces its upload, which is how a client without streams sends
+    // one file after the other
+    void HandleFileRequest(uint32_t streamId, const filetransfer::FileTransferRequest& request)
+    {
+      if (auto pPrevious = FindStream(streamId))
+      {
+        CloseStream(*pPrevious);
+      }
+      // Checked before any path is built from it
+      if (!IsPlainFilename(request.filename()))
+      {
+        LOG_ERROR("Invalid filename: " << request.filename());
+        SendUploadStatus(streamId, request.filename(), "Invalid filename", false, 0);
+        return;
+      }
+      if (mStreams.size() >= mConfig.mMaxStreamsPerSession)
+      {
+        LOG_ERROR("Too many concurrent uploads on one connection: " << request.filename());
+        SendUploadStatus(streamId, request.filename(), "Too many concurrent uploads on one connection", false, 0);
+        return;
+      }
+
+      auto pStream = std::make_shared<UploadStream>();
+      UploadStream& stream = *pStream;
+      stream.mId = streamId;
+      stream.mFilename = request.filename();
+      stream.mFileSize = request.filesize();
+      mProtocolVersion = NegotiateProtocolVersion(request.protocol_version());
+      SetAckPolicy(stream, request);
+
+      // Connections of a parallel upload share a transfer ID and each send one range of the file,
+      // a request without an ID sends all of it
+      stream.mRangeStart = 0;
+      stream.mRangeEnd = stream.mFileSize;
+      if (!request.transfer_id().empty())
+      {
+        if (request.range_offset() > stream.mFileSize || request.range_length() > stream.mFileSize - request.range_offset())
+        {
+          LOG_ERROR("Range is outside of the file: " << stream.mFilename);
+          SendUploadStatus(streamId, request.filename(), "Range is outside of the file", false, 0);
+          return;
+        }
+        stream.mRangeStart = request.range_offset();
+        stream.mRangeEnd = stream.mRangeStart + request.range_length();
+      }
+
+      // Agree on the client's proposal, capped by our own limit
+      uint32_t chunkSize = request.chunk_size() != 0 ? request.chunk_size() : DEFAULT_CHUNK_SIZE;
+      chunkSize = std::min({chunkSize, mConfig.mMaxChunkSize, MAX_CHUNK_SIZE});
+      stream.mChunkSize = chunkSize;
+      SizeChunkPools(chunkSize);
+      stream.mIsRawDataFrames = FILETRANSFER_HAS_ZERO_COPY && mConfig.mAllowRawDataFrames && request.raw_data_frames();
+      // The client's first codec we support. Raw data frames skip user space, so they are never compressed.
+      stream.mCompression = filetransfer::COMPRESSION_NONE;
+      for (int codec : request.compression())
+      {
+        if (!stream.mIsRawDataFrames && codec != filetransfer::COMPRESSION_NONE &&
+            IsCodecSupported(static_cast<filetransfer::CompressionCodec>(codec)))
+        {
+          stream.mCompression = static_cast<filetransfer::CompressionCodec>(codec);
+          break;
+        }
+      }
+      stream.mpCompressionStats = std::make_shared<CompressionStats>();
+
+      std::string targetPath = "uploads/" + stream.mFilename;
+      boost::filesystem::create_directories("uploads");
+
+      mStreams[streamId] = pStream;
+      if (request.delta() && request.transfer_id().empty() && StartDelta(pStream))
+      {
+        return;
+      }
+
+      boost::filesystem::path filePath(targetPath);
+      if (boost::filesystem::exists(filePath))
+      {
+        LOG_WARN("File is already exists. It will be overridden");
+      }
+      std::string error;
+      stream.mpTransfer = mpResources->mTransfers.Open(request.transfer_id(), stream.mFilename, stream.mFileSize,
+                                                       request.resume(), request.file_hash(), request.file_mtime(),
+                                                       request.file_checksum(), error);
+      if (!stream.mpTransfer)
+      {
+        LOG_ERROR(error << ": " << targetPath);
+        SendUploadStatus(streamId, request.filename(), error, false, 0);
+        CloseStream(stream);
+        return;
+      }
+
+      // Whatever an earlier, interrupted upload left at the start of our range doesn't need to be sent again
+      const uint64_t resumeOffset = std::min(stream.mpTransfer->ContiguousEnd(stream.mRangeStart), stream.mRangeEnd);
+      stream.mBytesReceived = resumeOffset - stream.mRangeStart;
+
+      std::ostringstream details;
+      details << "chunk size " << chunkSize << (stream.mIsRawDataFrames ? ", raw data frames" : "");
+      if (stream.mCompression != filetransfer::COMPRESSION_NONE)
+      {
+        details << ", " << CodecName(stream.mCompression) << " compression";
+      }
+      if (!request.transfer_id().empty())
+      {
+        details << ", transfer " << request.transfer_id() << " bytes " << stream.mRangeStart << "-" << stream.mRangeEnd;
+      }
+      if (stream.mBytesReceived > 0)
+      {
+        details << ", resuming at " << resumeOffset;
+      }
+      if (streamId != 0)
+      {
+        details << ", stream " << streamId;
+      }
+      LOG_INFO("File transfer request is received: " << stream.mFilename << " (" << details.str() << ")");
+
+      filetransfer::ServerMessage serverMsg;
+      serverMsg.set_stream_id(streamId);
+      filetransfer::FileUploadStatus* status = serverMsg.mutable_upload_status();
+      status->set_filename(request.filename());
+      status->set_status_message("File transfer request is received");
+      status->set_success(true);
+      status->set_bytes_received(stream.mBytesReceived);
+      status->set_chunk_size(chunkSize);
+      status->set_raw_data_frames(stream.mIsRawDataFrames);
+      status->set_resume_offset(resumeOffset);
+      status->set_compression(stream.mCompression);
+      status->set_protocol_version(mProtocolVersion);
+      SendServerMessage(serverMsg);
+    }
+
+    // Sends the signatures of the existing target for the client to diff against. Returns false to fall back to
+    // a full upload when there is nothing to diff against.
+    bool StartDelta(std::shared_ptr<UploadStream> pStream)
+    {
+      UploadStream& stream = *pStream;
+      const std::string targetPath = "uploads/" + stream.mFilename;
+      boost::system::error_code error;
+      const uint64_t basisSize = boost::filesystem::file_size(targetPath, error);
+      // An interrupted upload leaves a partial target behind, that one is resumed instead
+      if (error || basisSize == 0 || boost::filesystem::exists(ManifestPath(stream.mFilename)))
+      {
+        return false;
+      }
+
+      auto pDelta = std::make_shared<DeltaUpload>();
+      pDelta->mpBasis = std::make_shared<FileDescriptor>(::open(targetPath.c_str(), O_RDONLY | O_CLOEXEC));
+      pDelta->mBasisSize = basisSize;
+      pDelta->mBlockSize = DeltaBlockSize(basisSize);
+      pDelta->mOutputPath = "uploads/." + stream.mFilename + ".delta";
+      pDelta->mpOutput = std::make_shared<FileDescriptor>(
+        ::open(pDelta->mOutputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+      if (pDelta->mpBasis->Get() < 0 || pDelta->mpOutput->Get() < 0)
+      {
+        LOG_WARN("Delta files couldn't be open, falling back to a full upload: " << targetPath);
+        ::unlink(pDelta->mOutputPath.c_str());
+        return false;
+      }
+      stream.mpDelta = pDelta;
+      stream.mIsRawDataFrames = false;
+      stream.mCompression = filetransfer::COMPRESSION_NONE;
+
+      LOG_INFO("File transfer request is received: " << stream.mFilename << " (chunk size " << stream.mChunkSize
+               << ", delta against " << basisSize << " bytes in blocks of " << pDelta->mBlockSize << ")");
+
+      // Reading the whole basis is disk work, the reply goes out once the signatures are ready
+      auto pSignatures = std::make_shared<filetransfer::BlockSignatures>();
+      auto self(shared_from_this());
+      SubmitDiskWrite(pStream,
+                      [pDelta, pSignatures]() {
+                        if (!ComputeBlockSignatures(pDelta->mpBasis->Get(), pDelta->mBasisSize, pDelta->mBlockSize, *pSignatures))
+                        {
+                          return boost::system::errc::make_error_code(boost::system::errc::io_error);
+                        }
+                        return boost::system::error_code();
+                      },
+                      [self, pStream, pDelta, pSignatures](const boost::system::error_code& error) {
+                        if (pStream->mpDelta != pDelta)
+                        {
+                          return;
+                        }
+                        if (error)
+                        {
+                          LOG_ERROR("Signatures couldn't be computed: " << error.message());
+                          self->SendUploadStatus(pStream->mId, pStream->mFilename, "Signatures couldn't be computed", false, 0);
+                          self->CloseStream(*pStream);
+                          return;
+                        }
+
+                        filetransfer::ServerMessage serverMsg;
+                        serverMsg.set_stream_id(pStream->mId);
+                        filetransfer::FileUploadStatus* status = serverMsg.mutable_upload_status();
+                        status->set_filename(pStream->mFilename);
+                        status->set_status_message("File transfer request is received");
+                        status->set_success(true);
+                        status->set_bytes_received(0);
+                        status->set_chunk_size(pStream->mChunkSize);
+                        status->set_protocol_version(self->mProtocolVersion);
+                        status->set_delta_block_size(pDelta->mBlockSize);
+                        self->SendServerMessage(serverMsg, [self, pStream, pSignatures]() { self->SendSignatures(pStream, pSignatures, 0); });
+                      });
+      return true;
+    }
+
+    // Signatures go out in batches, each once the previous one has been written
+    void SendSignatures(std::shared_ptr<UploadStream> pStream, std::shared_ptr<filetransfer::BlockSignatures> pSignatures,
+                        size_t firstBlock)
+    {
+      if (FindStream(pStream->mId) != pStream)
+      {
+        return; // The upload was closed or replaced meanwhile
+      }
+      const size_t blocks = pSignatures->weak_size();
+      const size_t count = std::min(DELTA_SIGNATURES_PER_MESSAGE, blocks - firstBlock);
+      filetransfer::ServerMessage serverMsg;
+      serverMsg.set_stream_id(pStream->mId);
+      filetransfer::BlockSignatures* batch = serverMsg.mutable_block_signatures();
+      batch->set_first_block(firstBlock);
+      for (size_t i = firstBlock; i < firstBlock + count; i++)
+      {
+        batch->add_weak(pSignatures->weak(i));
+        batch->add_strong(pSignatures->strong(i));
+      }
+      batch->set_is_last(firstBlock + count >= blocks);
+
+      if (batch->is_last())
+      {
+        SendServerMessage(serverMsg);
+        return;
+      }
+      auto self(shared_from_this());
+      SendServerMessage(serverMsg, [self, pStream, pSignatures, next = firstBlock + count]() {
+                          self->SendSignatures(pStream, pSignatures, next);
+                        });
+    }
+
+    void HandleDeltaChunk(uint32_t streamId, filetransfer::DeltaChunk& chunk)
+    {
+      auto pStream = FindStream(streamId);
+      if (!pStream || !pStream->mpDelta || chunk.filename() != pStream->mFilename)
+      {
+        LOG_ERROR("Wrong filename");
+        SendUploadStatus(streamId, chunk.filename(), "Wrong filename", false, 0);
+        if (pStream)
+        {
+          CloseStream(*pStream);
+        }
+        return;
+      }
+      UploadStream& stream = *pStream;
+      const uint64_t maxTargetLength = std::max(stream.mChunkSize, stream.mpDelta->mBlockSize);
+      if (!stream.IsInRange(chunk.offset(), chunk.target_length()) || chunk.target_length() > maxTargetLength)
+      {
+        LOG_ERROR("Delta chunk is outside of the file: " << chunk.offset());
+        FailStream(stream, "Delta chunk is outside of the file");
+        return;
+      }
+
+      // Rebuilding reads the basis and writes the new file, both in the disk stage
+      auto pChunk = std::make_shared<filetransfer::DeltaChunk>(std::move(chunk));
+      auto pDelta = stream.mpDelta;
+      auto self(shared_from_this());
+      SubmitDiskWrite(pStream,
+                      [pDelta, pChunk, maxTargetLength]() {
+                        return ApplyDeltaChunk(*pChunk, pDelta->mpBasis->Get(), pDelta->mBasisSize, pDelta->mBlockSize,
+                                               pDelta->mpOutput->Get(), maxTargetLength);
+                      },
+                      [self, pStream, pChunk](const boost::system::error_code& error) {
+                        if (error && self->FindStream(pStream->mId) == pStream)
+                        {
+                          LOG_ERROR("Delta chunk couldn't be applied: " << error.message());
+                          self->FailStream(*pStream, "Delta chunk couldn't be applied");
+                        }
+                        if (error)
+                        {
+                          return;
+                        }
+                        self->CompleteChunk(pStream, pChunk->offset(), pChunk->target_length(), pChunk->is_last_chunk());
+                      },
+                      mHeader.mPayloadSize);
+    }
+
+    void HandleFileChunk(uint32_t streamId, filetransfer::FileChunk& chunk)
+    {
+      auto pStream = FindStream(streamId);
+      if (!pStream || !pStream->mpTransfer || chunk.filename() != pStream->mFilename)
+      {
+        LOG_ERROR("Wrong filename");
+        SendUploadStatus(streamId, chunk.filename(), "Wrong filename", false, 0);
+        if (pStream)
+        {
+          CloseStream(*pStream);
+        }
+        return;
+      }
+      UploadStream& stream = *pStream;
+      const filetransfer::CompressionCodec codec = chunk.compression();
+      if (codec != filetransfer::COMPRESSION_NONE && (codec != stream.mCompression || chunk.uncompressed_length() > stream.mChunkSize))
+      {
+        LOG_ERROR("Unexpected compressed chunk: " << chunk.offset());
+        FailStream(stream, "Unexpected compressed chunk");
+        return;
+      }
+      const size_t length = codec != filetransfer::COMPRESSION_NONE ? chunk.uncompressed_length() : chunk.data().length();
+      if (!stream.IsInRange(chunk.offset(), length))
+      {
+        LOG_ERROR("Chunk is outside of the requested range: " << chunk.offset());
+        FailStream(stream, "Chunk is outside of the requested range");
+        return;
+      }
+
+      // The disk stage takes ownership of the chunk data, decompresses it if needed, and the ack is sent once
+      // it is written
+      auto pWrite = mChunkWrites.Acquire();
+      pWrite->mData.swap(*chunk.mutable_data()); // The message gets the pooled buffer's capacity for the next chunk
+      pWrite->mpSession = this;
+      pWrite->mpStream = pStream;
+      pWrite->mpFile = stream.mpTransfer->File();
+      pWrite->mpStats = stream.mpCompressionStats;
+      pWrite->mCodec = codec;
+      pWrite->mOffset = chunk.offset();
+      pWrite->mLength = length;
+      pWrite->mIsLastChunk = chunk.is_last_chunk();
+      pWrite->mMemoryBytes = pWrite->mData.capacity();
+      BeginDiskWrite(stream, pWrite->mMemoryBytes);
+      mpResources->mDiskWriter.Submit(mDiskStrand, pWrite, shared_from_this(), mSocket->get_executor(),
+                                      mHandlerAllocator, &mpResources->mMetrics.mDiskWriteTime);
+    }
+
+    void OnChunkWritten(ChunkWrite& write, const boost::system::error_code& error)
+    {
+      // The pooled write lets go of the upload, the next chunk fills it in again
+      auto pStream = std::move(write.mpStream);
+      write.mpFile.reset();
+      write.mpStats.reset();
+      EndDiskWrite(*pStream, write.mMemoryBytes);
+      if (error && FindStream(pStream->mId) == pStream)
+      {
+        LOG_ERROR("File write failed: " << error.message());
+        FailStream(*pStream, "File write failed");
+      }
+      else if (!error)
+      {
+        CompleteChunk(pStream, write.mOffset, write.mLength, write.mIsLastChunk);
+      }
+      OnDiskWriteDone(pStream);
+    }
+
+    void HandleRawFileChunk(std::shared_ptr<UploadStream> pStream, const filetransfer::FileChunk& chunk)
+    {
+#if FILETRANSFER_HAS_ZERO_COPY
+      // The raw bytes can't be skipped without knowing they are expected, so a bad descriptor ends the session
+      if (!pStream || !pStream->mIsRawDataFrames || !pStream->mpTransfer || chunk.filename() != pStream->mFilename ||
+          chunk.raw_length() > pStream->mChunkSize || !pStream->IsInRange(chunk.offset(), chunk.raw_length()))
+      {
+        LOG_ERROR("Unexpected raw data frame for: " << chunk.filename());
+        SendUploadStatus(pStream ? pStream->mId : 0, chunk.filename(), "Unexpected raw data frame", false,
+                         pStream ? pStream->mBytesReceived : 0);
+        CloseStreams();
+        return;
+      }
+      UploadStream& stream = *pStream;
+
+      if (!mPipe.Open(stream.mChunkSize))
+      {
+        LOG_ERROR("Splice pipe couldn't be created: " << std::strerror(errno));
+        SendUploadStatus(stream.mId, chunk.filename(), "Splice pipe couldn't be created", false, stream.mBytesReceived);
+        CloseStreams();
+        return;
+      }
+
+      auto self(shared_from_this());
+      auto pFile = stream.mpTransfer->File();
+      const uint64_t offset = chunk.offset();
+      const size_t length = chunk.raw_length();
+      const bool isLastChunk = chunk.is_last_chunk();
+      // socket -> pipe runs here, pipe -> file runs in the disk stage
+      SpliceDrainT drain = [self, pStream, pFile](size_t inPipe, uint64_t fileOffset, std::function<void(const boost::system::error_code&)> done) {
+        self->SubmitDiskWrite(pStream,
+                              [self, pFile, inPipe, fileOffset]() {
+                                return DrainPipeToFile(self->mPipe, pFile->Get(), fileOffset, inPipe);
+                              },
+                              done, inPipe);
+      };
+      AsyncSpliceToFile(mSocket, mPipe, pFile->Get(), offset, length,
+                        [self, pStream, offset, length, isLastChunk](const boost::system::error_code& error, size_t /* sz */) {
+                          if (error)
+                          {
+                            LOG_INFO("Error in HandleRawFileChunk: " << error.message());
+                            self->CloseStreams();
+                            return;
+                          }
+                          self->CompleteChunk(pStream, offset, length, isLastChunk);
+                          self->ContinueReading();
+                        },
+                        drain);
+#else
+      LOG_ERROR("Raw data frames are not supported on this platform");
+      SendUploadStatus(pStream ? pStream->mId : 0, chunk.filename(), "Raw data frames are not supported", false,
+                       pStream ? pStream->mBytesReceived : 0);
+      CloseStreams();
+#endif
+    }
+
+    // Chunk data is on disk, account for it and acknowledge. bytes_received counts this stream's range only.
+    void CompleteChunk(const std::shared_ptr<UploadStream>& pStream, uint64_t offset, size_t length, bool isLastChunk)
+    {
+      if (FindStream(pStream->mId) != pStream)
+      {
+        return; // Closed or replaced, nobody is waiting for the ack
+      }
+      UploadStream& stream = *pStream;
+      if (stream.mpTransfer && stream.mpTransfer->AddReceived(offset, offset + length))
+      {
+        auto pTransfer = stream.mpTransfer;
+        SubmitDiskWrite(pStream,
+                        [pTransfer]() {
+                          pTransfer->SaveManifest();
+                          return boost::system::error_code();
+                        },
+                        [](const boost::system::error_code& /* error */) {});
+      }
+      UpdateBytesReceived(stream, offset, length);
+      if (stream.mUnackedChunks++ == 0)
+      {
+        stream.mFirstUnackedNanos = SteadyNanos();
+      }
+      stream.mUnackedBytes += length;
+      mpResources->mMetrics.mReceivedBytes.Add(length);
+      mpResources->mMetrics.mChunks.Add();
+
+      LOG_PROGRESS("Received: " << stream.mBytesReceived << " Remaining: "
+                   << static_cast<double>(stream.mBytesReceived) / (stream.mRangeEnd - stream.mRangeStart) * 100.0
+                   << "%");
+
+      if (stream.mBytesReceived >= stream.mRangeEnd - stream.mRangeStart || isLastChunk)
+      {
+        LOG_INFO("All bytes received: " << stream.mFilename);
+        ClearUnacked(stream);
+        SendUploadStatus(stream.mId, stream.mFilename, "All bytes received", true, stream.mBytesReceived);
+      }
+      else if (!stream.mIsCompactAcks)
+      {
+        ClearUnacked(stream);
+        SendUploadStatus(stream.mId, stream.mFilename, "Bytes received", true, stream.mBytesReceived);
+      }
+      else if (stream.mUnackedChunks >= stream.mAckEveryChunks || stream.mUnackedBytes >= stream.mAckEveryBytes)
+      {
+        SendAck(stream);
+      }
+      else if (!mIsAckTimerArmed)
+      {
+        ArmAckTimer();
+      }
+    }
+
+    // Bytes of the stream's range on disk, as covered ranges: a chunk written twice counts once. Counted from the range
+    // start up to the first gap, which is what the client's cumulative acknowledgements mean.
+    void UpdateBytesReceived(UploadStream& stream, uint64_t offset, size_t length)
+    {
+      if (stream.mpTransfer)
+      {
+        stream.mBytesReceived = std::min(stream.mpTransfer->ContiguousEnd(stream.mRangeStart), stream.mRangeEnd) -
+                                stream.mRangeStart;
+      }
+      else if (offset <= stream.mRangeStart + stream.mBytesReceived)
+      {
+        // Delta chunks are applied in order, without a Transfer
+        stream.mBytesReceived = std::max<uint64_t>(stream.mBytesReceived, offset + length - stream.mRangeStart);
+      }
+    }
+
+    // Clients that can't read UploadAck get a FileUploadStatus per chunk. Otherwise the thresholds stay below half
+    // the client's send window, so a full window always draws an ack without waiting for the timer.
+    void SetAckPolicy(UploadStream& stream, const filetransfer::FileTransferRequest& request)
+    {
+      stream.mIsCompactAcks = request.compact_acks();
+      stream.mAckEveryChunks = std::max<size_t>(mConfig.mAckEveryChunks, 1);
+      stream.mAckEveryBytes = std::max<uint64_t>(mConfig.mAckEveryBytes, 1);
+      if (request.send_window_chunks() != 0)
+      {
+        stream.mAckEveryChunks = std::min<size_t>(stream.mAckEveryChunks, std::max<size_t>(request.send_window_chunks() / 2, 1));
+      }
+      if (request.send_window_bytes() != 0)
+      {
+        stream.mAckEveryBytes = std::min<uint64_t>(stream.mAckEveryBytes, std::max<uint64_t>(request.send_window_bytes() / 2, 1));
+      }
+    }
+
+    // Acknowledges everything of the stream on disk so far
+    void SendAck(UploadStream& stream)
+    {
+      ClearUnacked(stream);
+      mAckMessage.set_stream_id(stream.mId);
+      mAckMessage.mutable_ack()->set_bytes_received(stream.mBytesReceived);
+      SendServerMessage(mAckMessage);
+    }
+
+    // Everything on disk is about to be acknowledged
+    void ClearUnacked(UploadStream& stream)
+    {
+      if (stream.mUnackedChunks > 0)
+      {
+        mpResources->mMetrics.mUploadAckDelay.ObserveSince(stream.mFirstUnackedNanos);
+      }
+      stream.mUnackedChunks = 0;
+      stream.mUnackedBytes = 0;
+    }
+
+    // One timer serves every stream of the session. It isn't cancelled by acks sent in the meantime, it finds
+    // nothing to acknowledge then. That keeps the ack path to one timer wait per mAckDelay at most.
+    void ArmAckTimer()
+    {
+      mIsAckTimerArmed = true;
+      mAckTimer.expires_after(mConfig.mAckDelay);
+      std::weak_ptr<Session> weakSelf(shared_from_this());
+      mAckTimer.async_wait(BindAllocator(mHandlerAllocator, [weakSelf](const boost::system::error_code& error) {
+                             auto self = weakSelf.lock();
+                             if (!self)
+                             {
+                               return;
+                             }
+                             self->mIsAckTimerArmed = false;
+                             if (error)
+                             {
+                               return;
+                             }
+                             for (auto& entry : self->mStreams)
+                             {
+                               if (entry.second->mUnackedChunks > 0)
+                               {
+                                 self->SendAck(*entry.second);
+                               }
+                             }
+                           }));
+    }
+
+    // Runs work in the disk stage in order with this session's other writes, handler runs on the session strand.
+    // memoryBytes of received data held until the write is done count against the memory budgets, writes of
+    // received data are the ones timed for the metrics.
+    void SubmitDiskWrite(std::shared_ptr<UploadStream> pStream, DiskWriter::WorkT work,
+                         std::function<void(const boost::system::error_code&)> handler, uint64_t memoryBytes = 0)
+    {
+      BeginDiskWrite(*pStream, memoryBytes);
+      auto self(shared_from_this());
+      mpResources->mDiskWriter.Submit(mDiskStrand, std::move(work), mSocket->get_executor(),
+                           [self, pStream, handler = std::move(handler), memoryBytes](const boost::system::error_code& error) {
+                             self->EndDiskWrite(*pStream, memoryBytes);
+                             handler(error);
+                             self->OnDiskWriteDone(pStream);
+                           },
+                           mHandlerAllocator, memoryBytes != 0 ? &mpResources->mMetrics.mDiskWriteTime : nullptr);
+    }
+
+    void BeginDiskWrite(UploadStream& stream, uint64_t memoryBytes)
+    {
+      ++mPendingDiskWrites;
+      ++stream.mPendingDiskWrites;
+      mPendingDiskBytes += memoryBytes;
+      mpResources->mMemory.Acquire(memoryBytes);
+    }
+
+    void EndDiskWrite(UploadStream& stream, uint64_t memoryBytes)
+    {
+      --mPendingDiskWrites;
+      --stream.mPendingDiskWrites;
+      mPendingDiskBytes -= memoryBytes;
+      mpResources->mMemory.Release(memoryBytes);
+    }
+
+    bool IsSessionBudgetExhausted() const
+    {
+      return mPendingDiskWrites >= mConfig.mMaxPendingDiskWritesPerSession ||
+             (mConfig.mSessionMemoryBudget != 0 && mPendingDiskWrites != 0 &&
+              mPendingDiskBytes + mData.capacity() >= mConfig.mSessionMemoryBudget);
+    }
+
+    // Pooled chunk buffers are either held by a write, and counted in mPendingDiskBytes, or idle. Pooling no more of
+    // them than the session budget holds chunks of the given size keeps the idle ones within the budget as well.
+    static size_t ChunkBufferCount(const ServerConfig& config, uint32_t maxChunkSize)
+    {
+      const uint64_t chunkSize = std::min({maxChunkSize, config.mMaxChunkSize, MAX_CHUNK_SIZE});
+      if (config.mSessionMemoryBudget == 0 || chunkSize == 0)
+      {
+        return MAX_POOLED_CHUNK_BUFFERS;
+      }
+      return std::max<uint64_t>(std::min<uint64_t>(config.mSessionMemoryBudget / chunkSize, MAX_POOLED_CHUNK_BUFFERS), 1);
+    }
+
+    // The pools start out sized for the largest chunk the server agrees to. Once a stream has agreed on its chunk
+    // size they hold as many chunks as the budget has room for at the largest size this session's streams use, so
+    // a window of small chunks is written from pooled buffers.
+    void SizeChunkPools(uint32_t chunkSize)
+    {
+      mLargestChunkSize = std::max(mLargestChunkSize, chunkSize);
+      const size_t count = ChunkBufferCount(mConfig, mLargestChunkSize);
+      mChunkWrites.SetMaxBuffers(count);
+      mChunkBuffers.SetMaxBuffers(count);
+    }
+
+    // Counts the buffers kept for the next frames, the receive buffer and the pooled chunk buffers no write holds,
+    // against the shared budget. Data held by writes is counted by SubmitDiskWrite.
+    void UpdateRetainedMemory()
+    {
+      const uint64_t retained = mData.capacity() + mChunkWrites.IdleBytes() + mChunkBuffers.IdleBytes();
+      if (retained > mRetainedBytes)
+      {
+        mpResources->mMemory.Acquire(retained - mRetainedBytes);
+      }
+      else if (retained < mRetainedBytes)
+      {
+        mpResources->mMemory.Release(mRetainedBytes - retained);
+      }
+      mRetainedBytes = retained;
+    }
+
+    // Frees the idle pooled chunk buffers once the session has no upload left to write, so an idle connection holds
+    // no chunk memory
+    void ReleaseIdleChunkBuffers()
+    {
+      if (mPendingDiskWrites == 0 && mStreams.empty())
+      {
+        mChunkWrites.ReleaseIdle();
+      }
+      UpdateRetainedMemory();
+    }
+
+    // Reads the next frame unless the session has too many disk writes or too much data outstanding, or all
+    // sessions together have used up the memory budget. The socket isn't read then (and TCP pushes back on the
+    // client) until writes drain: this session's for its own limits, anyone's for the shared budget.
+    void ContinueReading()
+    {
+      if (IsSessionBudgetExhausted())
+      {
+        mIsReadPaused = true;
+        return;
+      }
+      if (mpResources->mMemory.IsExhausted() || (mPendingDiskWrites == 0 && mStreams.empty() && mDownloads.empty()))
+      {
+        // No frame is being read, so the receive buffer can go too. Nothing is kept while waiting on the budget.
+        mChunkWrites.ReleaseIdle();
+        mChunkBuffers.ReleaseIdle();
+        std::vector<char>().swap(mData);
+        UpdateRetainedMemory();
+      }
+      if (mpResources->mMemory.IsExhausted())
+      {
+        mIsReadPaused = true;
+        mIsWaitingForMemory = true;
+        // The wait keeps the session alive like a pending read would
+        auto self(shared_from_this());
+        mpResources->mMemory.Wait([self]() {
+                                    ba::post(self->mSocket->get_executor(), [self]() {
+                                               self->mIsWaitingForMemory = false;
+                                               self->mIsReadPaused = false;
+                                               self->ContinueReading();
+                                             });
+                                  });
+        return;
+      }
+      ReadHeader();
+    }
+
+    void OnDiskWriteDone(const std::shared_ptr<UploadStream>& pStream)
+    {
+      ReleaseIdleChunkBuffers(); // The write's buffer went back to the pool
+      // A session waiting on the shared budget is resumed by it
+      if (mIsReadPaused && !mIsWaitingForMemory && !IsSessionBudgetExhausted())
+      {
+        mIsReadPaused = false;
+        ContinueReading();
+      }
+      if (pStream->mPendingDiskWrites == 0 && pStream->mIsFinishPending)
+      {
+        pStream->mIsFinishPending = false;
+        FinishUpload(pStream);
+      }
+    }
+
+    void HandleUploadFinished(uint32_t streamId, const filetransfer::FileUploadFinished& finished)
+    {
+      auto pStream = FindStream(streamId);
+      if (!pStream || finished.filename() != pStream->mFilename)
+      {
+        return;
+      }
+      if (pStream->mPendingDiskWrites > 0)
+      {
+        // Confirm only once everything is on disk
+        pStream->mIsFinishPending = true;
+        return;
+      }
+      FinishUpload(pStream);
+    }
+
+    void FinishUpload(std::shared_ptr<UploadStream> pStream)
+    {
+      UploadStream& stream = *pStream;
+      if (FindStream(stream.mId) != pStream || (!stream.mpTransfer && !stream.mpDelta))
+      {
+        return;
+      }
+      if (stream.mBytesReceived < stream.mRangeEnd - stream.mRangeStart)
+      {
+        LOG_ERROR("Upload finished before all bytes were received: " << stream.mFilename);
+        SendUploadStatus(stream.mId, stream.mFilename, "Upload finished before all bytes were received", false,
+                         stream.mBytesReceived);
+        CloseStream(stream);
+        return;
+      }
+
+      if (stream.mpDelta)
+      {
+        // The new version replaces the basis in one step
+        if (std::rename(stream.mpDelta->mOutputPath.c_str(), ("uploads/" + stream.mFilename).c_str()) != 0)
+        {
+          LOG_ERROR("Rebuilt file couldn't replace the existing one: " << std::strerror(errno));
+          SendUploadStatus(stream.mId, stream.mFilename, "Rebuilt file couldn't replace the existing one", false,
+                           stream.mBytesReceived);
+          CloseStream(stream);
+          return;
+        }
+        stream.mpDelta->mIsFinished = true;
+        SendTransferComplete(stream);
+        CloseStream(stream);
+        return;
+      }
+
+      // Other connections may still be sending their ranges, confirm once the whole file is on disk.
+      // The wait doesn't keep the session alive, it ends with its connection.
+      std::weak_ptr<Session> weakSelf(shared_from_this());
+      Transfer* pTransfer = stream.mpTransfer.get();
+      stream.mpTransfer->WaitForCompletion(mSocket->get_executor(), [weakSelf, pStream, pTransfer]() {
+                                             if (auto self = weakSelf.lock())
+                                             {
+                                               self->CompleteTransfer(pStream, pTransfer);
+                                             }
+                                           });
+    }
+
+    void CompleteTransfer(const std::shared_ptr<UploadStream>& pStream, const Transfer* pTransfer)
+    {
+      if (FindStream(pStream->mId) != pStream || pStream->mpTransfer.get() != pTransfer)
+      {
+        return; // The stream moved on to another upload
+      }
+      if (!pStream->mpTransfer->IsChecksumExpected())
+      {
+        ConfirmTransfer(*pStream, pStream->mpTransfer->Commit()
+                                    ? boost::system::error_code()
+                                    : boost::system::errc::make_error_code(boost::system::errc::io_error));
+        return;
+      }
+
+      // Part of the file came from an earlier run of the client, confirm only if all of it matches
+      auto pVerified = pStream->mpTransfer;
+      auto self(shared_from_this());
+      SubmitDiskWrite(pStream,
+                      [pVerified]() {
+                        if (!pVerified->VerifyChecksum())
+                        {
+                          return boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+                        }
+                        return pVerified->Commit()
+                          ? boost::system::error_code()
+                          : boost::system::errc::make_error_code(boost::system::errc::io_error);
+                      },
+                      [self, pStream, pTransfer](const boost::system::error_code& error) {
+                        if (self->FindStream(pStream->mId) != pStream || pStream->mpTransfer.get() != pTransfer)
+                        {
+                          return;
+                        }
+                        self->ConfirmTransfer(*pStream, error);
+                      });
+    }
+
+    // Confirms the upload once its file has replaced the target, or reports why it hasn't
+    void ConfirmTransfer(UploadStream& stream, const boost::system::error_code& error)
+    {
+      if (error == boost::system::errc::illegal_byte_sequence)
+      {
+        LOG_ERROR("Resumed file doesn't match the client's checksum: " << stream.mFilename);
+        SendUploadStatus(stream.mId, stream.mFilename, "Resumed file doesn't match the client's checksum", false,
+                         stream.mBytesReceived);
+      }
+      else if (error)
+      {
+        SendUploadStatus(stream.mId, stream.mFilename, "Uploaded file couldn't replace the existing one", false,
+                         stream.mBytesReceived);
+      }
+      else
+      {
+        SendTransferComplete(stream);
+      }
+      CloseStream(stream);
+    }
+
+    void SendTransferComplete(const UploadStream& stream)
+    {
+      LOG_INFO("File transfer completed: " << stream.mFilename);
+      if (stream.mCompression != filetransfer::COMPRESSION_NONE && stream.mpCompressionStats)
+      {
+        const CompressionStats& stats = *stream.mpCompressionStats;
+        LOG_INFO("Compression (" << CodecName(stream.mCompression) << "): " << stats.mWireBytes << " bytes received for "
+                 << stats.mRawBytes << " bytes written (ratio " << stats.Ratio() << "), " << stats.mCompressedChunks
+                 << " chunks compressed, " << stats.mCpuNanos / 1e6 << " ms CPU decompressing");
+      }
+      LOG_INFO("Sent " << mpWriteQueue->WrittenFrames() << " frames in " << mpWriteQueue->Writes()
+               << " writes on this connection");
+
+      filetransfer::ServerMessage serverMsg;
+      serverMsg.set_stream_id(stream.mId);
+      filetransfer::FileUploadStatus* status = serverMsg.mutable_upload_status();
+      status->set_filename(stream.mFilename);
+      status->set_status_message("File transfer completed");
+      status->set_success(true);
+      status->set_bytes_received(stream.mFileSize);
+      status->set_transfer_complete(true);
+      SendServerMessage(serverMsg);
+    }
+
+    // Ends the stream's upload and forgets the stream. In-flight disk writes keep their own reference, the file is
+    // closed when the last one finishes and the last session of the transfer lets go of it.
+    void CloseStream(UploadStream& stream)
+    {
+      stream.mpTransfer.reset();
+      if (stream.mpDelta && !stream.mpDelta->mIsFinished)
+      {
+        ::unlink(stream.mpDelta->mOutputPath.c_str()); // Abandoned, the basis stays as it was
+      }
+      stream.mpDelta.reset();
+      auto it = mStreams.find(stream.mId);
+      if (it != mStreams.end() && it->second.get() == &stream)
+      {
+        mStreams.erase(it);
+      }
+      ReleaseIdleChunkBuffers();
+    }
+
+    void CloseStreams()
+    {
+      while (!mStreams.empty())
+      {
+        CloseStream(*mStreams.begin()->second);
+      }
+      mDownloads.clear();
+    }
+
+    // Files are only served from the uploads directory, by plain name
+    void HandleDownloadRequest(uint32_t streamId, const filetransfer::FileDownloadRequest& request)
+    {
+      mDownloads.erase(streamId);
+      const std::string& filename = request.filename();
+      std::string error;
+      std::shared_ptr<const CachedFile> pFile;
+      if (!IsPlainFilename(filename))
+      {
+        error = "Invalid filename";
+      }
+      else if (mStreams.size() + mDownloads.size() >= mConfig.mMaxStreamsPerSession)
+      {
+        error = "Too many concurrent transfers on one connection";
+      }
+      else
+      {
+        pFile = mpResources->mFiles.Open("uploads/" + filename, error);
+      }
+      if (pFile && request.offset() > pFile->mSize)
+      {
+        error = "Offset is beyond the end of the file";
+      }
+      if (!error.empty())
+      {
+        LOG_ERROR("Download of " << filename << " refused: " << error);
+        SendDownloadStatus(streamId, filename, false, error, 0, 0);
+        return;
+      }
+
+      auto pStream = std::make_shared<DownloadStream>();
+      pStream->mId = streamId;
+      pStream->mFilename = filename;
+      pStream->mpFile = pFile;
+      const uint32_t chunkSize = request.chunk_size() != 0 ? request.chunk_size() : DEFAULT_CHUNK_SIZE;
+      pStream->mChunkSize = std::max<uint32_t>(std::min({chunkSize, mConfig.mMaxChunkSize, MAX_CHUNK_SIZE}), 1);
+      SizeChunkPools(pStream->mChunkSize);
+      pStream->mWindowBytes = static_cast<uint64_t>(std::max<uint32_t>(request.window_chunks(), 1)) * pStream->mChunkSize;
+      pStream->mNextOffset = pStream->mAckedOffset = pStream->mAdvisedEnd = request.offset();
+
+      LOG_INFO("File download request is received: " << filename << " (" << pFile->mSize << " bytes, chunk size "
+               << pStream->mChunkSize << ", " << (mpResources->mFiles.IsMapped() ? "mmap" : "pread")
+               << (request.offset() > 0 ? ", from " + std::to_string(request.offset()) : std::string()) << ")");
+
+      SendDownloadStatus(streamId, filename, true, "File download request is received", pFile->mSize, pStream->mChunkSize);
+      if (pStream->mAckedOffset >= pFile->mSize)
+      {
+        return; // Nothing to send
+      }
+      mDownloads[streamId] = pStream;
+      FillDownloadWindow(pStream);
+    }
+
+    void HandleDownloadAck(uint32_t streamId, const filetransfer::DownloadAck& ack)
+    {
+      auto it = mDownloads.find(streamId);
+      if (it == mDownloads.end())
+      {
+        return;
+      }
+      std::shared_ptr<DownloadStream> pStream = it->second;
+      pStream->mAckedOffset = std::max(pStream->mAckedOffset, std::min(ack.offset(), pStream->mNextOffset));
+      while (!pStream->mUnackedChunks.empty() && pStream->mUnackedChunks.front().first <= pStream->mAckedOffset)
+      {
+        mpResources->mMetrics.mDownloadAckRtt.ObserveSince(pStream->mUnackedChunks.front().second);
+        pStream->mUnackedChunks.pop_front();
+      }
+      if (pStream->mAckedOffset >= pStream->mpFile->mSize)
+      {
+        LOG_INFO("File download completed: " << pStream->mFilename);
+        mDownloads.erase(it);
+        return;
+      }
+      FillDownloadWindow(pStream);
+    }
+
+    // Reads chunks while the client's window and the per-download queue limit allow, asking the kernel to read a
+    // window ahead of them
+    void FillDownloadWindow(const std::shared_ptr<DownloadStream>& pStream)
+    {
+      DownloadStream& stream = *pStream;
+      const uint64_t size = stream.mpFile->mSize;
+      if (stream.mNextOffset >= stream.mAdvisedEnd && stream.mAdvisedEnd < size)
+      {
+        stream.mpFile->WillNeed(stream.mAdvisedEnd, stream.mWindowBytes);
+        stream.mAdvisedEnd += stream.mWindowBytes;
+      }
+      while (stream.mNextOffset < size && stream.mNextOffset - stream.mAckedOffset < stream.mWindowBytes &&
+             stream.mQueuedChunks < std::max<size_t>(mConfig.mMaxQueuedDownloadChunks, 1))
+      {
+        const uint64_t offset = stream.mNextOffset;
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(stream.mChunkSize, size - offset));
+        stream.mNextOffset += length;
+        ++stream.mQueuedChunks;
+        if (stream.mpFile->mpMapping)
+        {
+          SendDownloadChunk(pStream, offset, reinterpret_cast<const char*>(stream.mpFile->mpMapping->Data()) + offset, length);
+        }
+        else
+        {
+          ReadDownloadChunk(pStream, offset, length);
+        }
+      }
+    }
+
+    // pread in the disk stage, the chunk is sent from the session strand once read
+    void ReadDownloadChunk(const std::shared_ptr<DownloadStream>& pStream, uint64_t offset, size_t length)
+    {
+      auto pData = mChunkBuffers.Acquire();
+      auto pFile = pStream->mpFile;
+      auto self(shared_from_this());
+      mpResources->mDiskWriter.Submit(mDiskStrand,
+                                      [pFile, pData, offset, length]() {
+                                        pData->resize(length);
+                                        if (ReadAllAt(pFile->mFile.Get(), &(*pData)[0], length, offset) != static_cast<ssize_t>(length))
+                                        {
+                                          return boost::system::errc::make_error_code(boost::system::errc::io_error);
+                                        }
+                                        return boost::system::error_code();
+                                      },
+                                      mSocket->get_executor(),
+                                      [self, pStream, pData, offset, length](const boost::system::error_code& error) {
+                                        auto it = self->mDownloads.find(pStream->mId);
+                                        if (it == self->mDownloads.end() || it->second != pStream)
+                                        {
+                                          --pStream->mQueuedChunks;
+                                          return; // Failed or replaced meanwhile
+                                        }
+                                        if (error)
+                                        {
+                                          LOG_ERROR("Download read failed: " << pStream->mFilename);
+                                          self->SendDownloadStatus(pStream->mId, pStream->mFilename, false, "File read failed", 0, 0);
+                                          self->mDownloads.erase(pStream->mId);
+                                          return;
+                                        }
+                                        // The pooled buffer goes out as the chunk's data, the message's old buffer goes back to the pool
+                                        self->mDownloadChunkMessage.mutable_download_chunk()->mutable_data()->swap(*pData);
+                                        self->SendDownloadChunk(pStream, offset, nullptr, length);
+                                      },
+                                      mHandlerAllocator);
+    }
+
+    // data is copied into the chunk message unless it is nullptr, when the message already holds the data
+    void SendDownloadChunk(const std::shared_ptr<DownloadStream>& pStream, uint64_t offset, const char* data, size_t length)
+    {
+      // Serialized when queued, the data is copied into the frame there and the message is reused
+      mDownloadChunkMessage.set_stream_id(pStream->mId);
+      filetransfer::FileChunk* chunk = mDownloadChunkMessage.mutable_download_chunk();
+      chunk->set_offset(offset);
+      if (data)
+      {
+        chunk->mutable_data()->assign(data, length);
+      }
+      chunk->set_is_last_chunk(offset + length >= pStream->mpFile->mSize);
+      pStream->mUnackedChunks.emplace_back(offset + length, SteadyNanos());
+      auto self(shared_from_this());
+      mpWriteQueue->Push(mDownloadChunkMessage, [self, pStream](const boost::system::error_code& error, size_t /* sz */) {
+                           --pStream->mQueuedChunks;
+                           auto it = self->mDownloads.find(pStream->mId);
+                           if (error || it == self->mDownloads.end() || it->second != pStream)
+                           {
+                             return;
+                           }
+                           self->FillDownloadWindow(pStream);
+                         },
+                         mProtocolVersion);
+    }
+
+    void SendDownloadStatus(uint32_t streamId, const std::string& filename, bool success, const std::string& statusMsg,
+                            uint64_t fileSize, uint32_t chunkSize)
+    {
+      filetransfer::ServerMessage serverMsg;
+      serverMsg.set_stream_id(streamId);
+      filetransfer::FileDownloadStatus* status = serverMsg.mutable_download_status();
+      status->set_filename(filename);
+      status->set_success(success);
+      status->set_status_message(statusMsg);
+      status->set_filesize(fileSize);
+      status->set_chunk_size(chunkSize);
+      SendServerMessage(serverMsg);
+    }
+
+    // Reports a failed upload and ends its stream, nothing more of it is written. Chunks still arriving for it find
+    // no stream and are refused.
+    void FailStream(UploadStream& stream, const std::string& statusMsg)
+    {
+      SendUploadStatus(stream.mId, stream.mFilename, statusMsg, false, stream.mBytesReceived);
+      CloseStream(stream);
+    }
+
+    void SendUploadStatus(uint32_t streamId, const std::string& filename, const std::string& statusMsg,
+                          bool success, uint64_t receivedBytes)
+    {
+      // Acks are serialized as soon as they are queued, so one message is reused for all of them
+      mStatusMessage.set_stream_id(streamId);
+      filetransfer::FileUploadStatus* status = mStatusMessage.mutable_upload_status();
+      status->Clear();
+      status->set_filename(filename);
+      status->set_status_message(statusMsg);
+      status->set_success(success);
+      status->set_bytes_received(receivedBytes);
+      SendServerMessage(mStatusMessage);
+    }
+
+    // Queued behind any messages still being sent, onSent runs once the message has been written
+    void SendServerMessage(const filetransfer::ServerMessage& serverMsg, std::function<void()> onSent = nullptr)
+    {
+      if (!onSent)
+      {
+        // Without captures the handler fits in std::function itself, which keeps acks allocation free
+        mpWriteQueue->Push(serverMsg, [] (const auto& error, auto /* sz */) {
+          if (error)
+          {
+            LOG_ERROR("SendUploadStatus write error: " << error.message());
+          }
+        }, mProtocolVersion);
+        return;
+      }
+      mpWriteQueue->Push(serverMsg, [onSent] (const auto& error, auto /* sz */) {
+        if (error)
+        {
+          LOG_ERROR("SendUploadStatus write error: " << error.message());
+          return;
+        }
+        onSent();
+      }, mProtocolVersion);
+    }
+
+    void HandleWrite(const boost::system::error_code& error, size_t transferredByte) {
+      if (error)
+      {
+        LOG_ERROR("Error in HandleWrite: " << error.message());
+      }
+    }
+
+  private:
+    // A received chunk written in the disk stage. Pooled with its buffers, so steady uploads allocate nothing per
+    // chunk for it. The pool belongs to the session, so the disk stage keeps the session alive instead.
+    class ChunkWrite : public DiskJob
+    {
+    public:
+      std::string mData; // As received, compressed or not
+      std::string mDecompressed; // Keeps its capacity for the next compressed chunk
+      Session* mpSession{nullptr};
+      std::shared_ptr<UploadStream> mpStream;
+      std::shared_ptr<FileDescriptor> mpFile;
+      std::shared_ptr<CompressionStats> mpStats;
+      filetransfer::CompressionCodec mCodec{filetransfer::COMPRESSION_NONE};
+      uint64_t mOffset{0};
+      size_t mLength{0};
+      bool mIsLastChunk{false};
+      uint64_t mMemoryBytes{0}; // Counted against the budgets until written
+
+      void clear() { mData.clear(); }
+      size_t capacity() const { return mData.capacity() + mDecompressed.capacity(); }
+
+      boost::system::error_code Run() override
+      {
+        const std::string* pWriteData = &mData;
+        if (mCodec != filetransfer::COMPRESSION_NONE)
+        {
+          const uint64_t start = ThreadCpuNanos();
+          const bool isDecompressed = DecompressChunk(mCodec, mData, mLength, mDecompressed);
+          mpStats->mCpuNanos += ThreadCpuNanos() - start;
+          if (!isDecompressed)
+          {
+            return boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+          }
+          ++mpStats->mCompressedChunks;
+          pWriteData = &mDecompressed;
+        }
+        mpStats->mRawBytes += mLength;
+        mpStats->mWireBytes += mData.length();
+        if (!WriteAllAt(mpFile->Get(), pWriteData->data(), pWriteData->length(), mOffset))
+        {
+          return boost::system::error_code(errno, boost::system::system_category());
+        }
+        return boost::system::error_code();
+      }
+
+      void Complete(const boost::system::error_code& error) override
+      {
+        mpSession->OnChunkWritten(*this, error);
+      }
+    };
+
+    std::shared_ptr<SessionSocket> mSocket;
+    HandlerAllocator<void> mHandlerAllocator; // Over the memory of this session's asynchronous operations
+    std::shared_ptr<SessionWriteQueue> mpWriteQueue;
+    SessionTimer mAckTimer;
+    ServerConfig mConfig;
+    ProtocolHeader mHeader; // Of the frame being read
+    InboundMessage<filetransfer::ClientMessage> mMessage;
+    std::shared_ptr<ServerResources> mpResources;
+    DiskWriter::StrandT mDiskStrand;
+    size_t mPendingDiskWrites{0};
+    uint64_t mPendingDiskBytes{0}; // Received data held by those writes
+    bool mIsReadPaused{false};
+    bool mIsWaitingForMemory{false}; // On the shared memory budget, which resumes reading
+    std::vector<char> mData; // Payload of the frame being read, grows to the largest frame until the session idles
+    BasicBufferPool<ChunkWrite> mChunkWrites; // Received chunks on their way to disk
+    BufferPool mChunkBuffers; // Downloaded chunks on their way to the client
+    uint32_t mLargestChunkSize{0}; // Agreed by any stream of the session, sizes the pools
+    uint64_t mRetainedBytes{0}; // Of mData and the idle pooled buffers, counted against the shared budget
+    filetransfer::ServerMessage mStatusMessage;
+    filetransfer::ServerMessage mAckMessage;
+    bool mIsAckTimerArmed{false};
+    bool mIsStarted{false}; // Counted in the active sessions
+    std::map<uint32_t, std::shared_ptr<UploadStream>> mStreams; // Open uploads by stream ID
+    std::map<uint32_t, std::shared_ptr<DownloadStream>> mDownloads;
+    filetransfer::ServerMessage mDownloadChunkMessage;
+    uint8_t mProtocolVersion{PROTOCOL_VERSION_MIN};
+#if FILETRANSFER_HAS_ZERO_COPY
+    SplicePipe mPipe;
+#endif
+};
+
+// Lets several sockets bind the same port, the kernel spreads incoming connections over them
+using reuse_port = ba::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+class Server
+{
+public:
+  Server(ba::io_context& context, unsigned short port = PORT, const ServerConfig& config = ServerConfig(),
+         std::shared_ptr<ServerResources> resources = nullptr, bool reusePort = false)
+    : mContext(context),
+      mAcceptor(context),
+      mConfig(config),
+      mpResources(resources ? resources : std::make_shared<ServerResources>(config))
+  {
+    bai::tcp::endpoint endpoint(bai::tcp::v4(), port);
+    mAcceptor.open(endpoint.protocol());
+    mAcceptor.set_option(bai::tcp::acceptor::reuse_address(true));
+    if (reusePort)
+    {
+      mAcceptor.set_option(reuse_port(true));
+    }
+    mAcceptor.bind(endpoint);
+    mAcceptor.listen();
+  }
+
+  unsigned short LocalPort() const
+  {
+    return mAcceptor.local_endpoint().port();
+  }
+
+  // Hands accepted connections out round-robin over these contexts instead of keeping them on the accepting one
+  void SetSessionContexts(std::vector<ba::io_context*> contexts)
+  {
+    mSessionContexts = std::move(contexts);
+  }
+
+  void StartAccept()
+  {
+    ba::io_context& sessionContext = mSessionContexts.empty()
+      ? mContext : *mSessionContexts[mNextSessionContext++ % mSessionContexts.size()];
+    auto session = std::make_shared<Session>(sessionContext, mConfig, mpResources);
+
+    mAcceptor.async_accept(session->GetSocket(), std::bind(&Server::HandleAccept, this, session, std::placeholders::_1));
+  }
+
+private:
+  void HandleAccept(std::shared_ptr<Session> session, const boost::system::error_code& error)
+  {
+    if (!error)
+    {
+      LOG_INFO("New connection has been established: " << session->GetSocket().remote_endpoint());
+      // The session may live on another worker's context, start it there
+      ba::post(session->GetSocket().get_executor(), [session]() { session->Start(); });
+    }
+    else if (error == ba::error::operation_aborted)
+    {
+      return; // Acceptor closed
+    }
+    else
+    {
+      LOG_ERROR("Error in accept: " << error.message());
+    }
+
+    StartAccept();
+  }
+
+  ba::io_context& mContext;
+  bai::tcp::acceptor mAcceptor;
+  ServerConfig mConfig;
+  std::shared_ptr<ServerResources> mpResources;
+  std::vector<ba::io_context*> mSessionContexts;
+  size_t mNextSessionContext{0};
+};
+
+enum class AcceptMode : uint8_t
+{
+  REUSE_PORT = 0, // Every worker has its own acceptor bound with SO_REUSEPORT
+  SHARED = 1      // One acceptor hands accepted sockets out round-robin
+};
+
+// Runs the server on several cores: each worker owns an io_context driven by its own thread, so sessions
+// on different workers never contend. All workers share one disk stage and transfer registry.
+class ServerPool
+{
+public:
+  ServerPool(size_t workers, AcceptMode mode, unsigned short port = PORT, const ServerConfig& config = ServerConfig())
+    : mpResources(std::make_shared<ServerResources>(config))
+  {
+    workers = std::max<size_t>(workers, 1);
+    for (size_t i = 0; i < workers; i++)
+    {
+      // Concurrency hint 1: each context is only ever run by its own thread
+      mContexts.push_back(std::make_unique<ba::io_context>(1));
+      mWork.push_back(ba::make_work_guard(*mContexts.back()));
+    }
+
+    if (mode == AcceptMode::REUSE_PORT)
+    {
+      for (auto& context : mContexts)
+      {
+        // Port 0 picks an ephemeral port for the first worker, the others join it
+        mServers.push_back(std::make_unique<Server>(*context, mServers.empty() ? port : mServers.front()->LocalPort(),
+                                                    config, mpResources, true));
+      }
+    }
+    else
+    {
+      std::vector<ba::io_context*> sessionContexts;
+      for (auto& context : mContexts)
+      {
+        sessionContexts.push_back(context.get());
+      }
+      mServers.push_back(std::make_unique<Server>(*mContexts.front(), port, config, mpResources));
+      mServers.front()->SetSessionContexts(sessionContexts);
+    }
+  }
+
+  ~ServerPool()
+  {
+    Stop();
+  }
+
+  unsigned short LocalPort() const
+  {
+    return mServers.front()->LocalPort();
+  }
+
+  size_t Workers() const
+  {
+    return mContexts.size();
+  }
+
+  // Metrics of every worker's sessions
+  const MetricsRegistry& Metrics() const
+  {
+    return mpResources->mMetricsRegistry;
+  }
+
+  // Starts accepting and runs every worker on its own thread
+  void Start()
+  {
+    for (auto& server : mServers)
+    {
+      server->StartAccept();
+    }
+    for (auto& context : mContexts)
+    {
+      mThreads.emplace_back([&context] { context->run(); });
+    }
+  }
+
+  void Join()
+  {
+    for (auto& thread : mThreads)
+    {
+      thread.join();
+    }
+    mThreads.clear();
+  }
+
+  void Stop()
+  {
+    mWork.clear();
+    for (auto& context : mContexts)
+    {
+      context->stop();
+    }
+    Join();
+    // Let queued writes finish while the contexts their completions are posted to still exist
+    mpResources->mDiskWriter.Join();
+  }
+
+private:
+  std::shared_ptr<ServerResources> mpResources;
+  std::vector<std::unique_ptr<ba::io_context>> mContexts;
+  std::vector<ba::executor_work_guard<ba::io_context::executor_type>> mWork;
+  std::vector<std::unique_ptr<Server>> mServers;
+  std::vector<std::thread> mThreads;
+};
+
+#endif // FILETRANSFER_SERVER_H_
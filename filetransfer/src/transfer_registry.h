@@ -0,0 +1,390 @@
+#ifndef FILETRANSFER_TRANSFER_REGISTRY_H_
+#define FILETRANSFER_TRANSFER_REGISTRY_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+#include "common.h"
+#include "disk_writer.h"
+#include "range_set.h"
+#include "filetransfer.pb.h"
+
+namespace ba = boost::asio;
+
+// Where the server keeps the manifest of an interrupted upload of filename, which must be IsPlainFilename
+inline std::string ManifestPath(const std::string &filename)
+{
+  return "uploads/." + filename + ".manifest";
+}
+
+// Where an upload of filename is written until it is complete and replaces uploads/<filename> (Transfer::Commit)
+inline std::string PartPath(const std::string &filename)
+{
+  return "uploads/." + filename + ".part";
+}
+
+inline bool LoadManifest(const std::string &path, filetransfer::UploadManifest &manifest)
+{
+  FileDescriptor file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (file.Get() < 0)
+  {
+    return false;
+  }
+  return manifest.ParseFromFileDescriptor(file.Get());
+}
+
+// Replaces the manifest atomically, so a crash leaves either the old or the new one
+inline bool StoreManifest(const std::string &path, const filetransfer::UploadManifest &manifest)
+{
+  const std::string tempPath = path + ".tmp";
+  {
+    FileDescriptor file(::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (file.Get() < 0 || !manifest.SerializeToFileDescriptor(file.Get()) || ::fdatasync(file.Get()) != 0)
+    {
+      return false;
+    }
+  }
+  return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+// A file being uploaded, possibly as several byte ranges over several connections at once.
+// It is written to its part file and only takes the target's place once complete, so downloads of the old version
+// keep reading an intact file.
+// Sessions on any worker share it, so everything but the immutable identity is guarded by a mutex.
+// A resumable transfer persists the received ranges in a manifest, so an interrupted upload can continue
+// where it stopped: every manifestInterval bytes (through SaveManifest) and when the last session lets go of it
+// (TransferRegistry saves it in the disk stage then).
+class Transfer
+{
+public:
+  Transfer(std::string id, std::string filename, uint64_t size, std::shared_ptr<FileDescriptor> file)
+      : mId(std::move(id)), mFilename(std::move(filename)), mSize(size), mpFile(std::move(file))
+  {
+  }
+
+  const std::string &Id() const { return mId; }
+  const std::string &Filename() const { return mFilename; }
+  uint64_t Size() const { return mSize; }
+  const std::shared_ptr<FileDescriptor> &File() const { return mpFile; }
+
+  // Persists progress under the file's manifest, identified by fileHash and fileMtime, starting from the given ranges
+  void EnableManifest(uint32_t fileHash, uint64_t fileMtime, uint64_t manifestInterval, const RangeSet &received)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mIsResumable = true;
+    mFileHash = fileHash;
+    mFileMtime = fileMtime;
+    mManifestInterval = manifestInterval;
+    mReceived = received;
+  }
+
+  // Records [start, end) as written to disk. Returns true when the manifest is due to be saved.
+  bool AddReceived(uint64_t start, uint64_t end)
+  {
+    std::vector<Waiter> ready;
+    bool isManifestDue = false;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mReceived.Add(start, end);
+      ready = TakeWaitersIfComplete();
+
+      mUnsavedBytes += end - start;
+      if (mIsResumable && !mIsComplete && mUnsavedBytes >= mManifestInterval)
+      {
+        mUnsavedBytes = 0;
+        isManifestDue = true;
+      }
+    }
+    Notify(ready);
+    return isManifestDue;
+  }
+
+  // Posts handler to executor once every byte of the file has been received, which may be right away
+  void WaitForCompletion(ba::any_io_executor executor, std::function<void()> handler)
+  {
+    std::vector<Waiter> ready;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mWaiters.emplace_back(std::move(executor), std::move(handler));
+      ready = TakeWaitersIfComplete();
+    }
+    Notify(ready);
+  }
+
+  uint64_t ReceivedBytes()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mReceived.CoveredBytes();
+  }
+
+  // The transfer continues an interrupted upload. Its identity only samples the file, so once complete the whole
+  // file has to match the client's checksum (VerifyChecksum).
+  void ExpectChecksum(uint32_t checksum)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mIsChecksumExpected = true;
+    mExpectedChecksum = checksum;
+  }
+
+  bool IsChecksumExpected()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIsChecksumExpected;
+  }
+
+  // Reads the complete file back and compares it with the expected checksum. The file is read once, every session
+  // of the transfer gets the same result. Blocks on the disk, so runs in the disk stage.
+  bool VerifyChecksum()
+  {
+    std::lock_guard<std::mutex> verifyLock(mVerifyMutex);
+    if (!mIsVerified)
+    {
+      uint32_t checksum = 0;
+      mIsChecksumMatched = FileChecksum(mpFile->Get(), mSize, checksum) && checksum == mExpectedChecksum;
+      mIsVerified = true;
+    }
+    return mIsChecksumMatched;
+  }
+
+  // Renames the complete part file over the target, once for every session of the transfer. Downloads still
+  // holding the old target keep its inode and contents.
+  bool Commit()
+  {
+    std::lock_guard<std::mutex> commitLock(mCommitMutex);
+    if (!mIsCommitted)
+    {
+      mIsCommitted = true;
+      mIsCommitSucceeded = std::rename(PartPath(mFilename).c_str(), ("uploads/" + mFilename).c_str()) == 0;
+      if (!mIsCommitSucceeded)
+      {
+        LOG_ERROR("Uploaded file couldn't replace the existing one: " << std::strerror(errno));
+      }
+      else if (mIsResumable)
+      {
+        // An interrupted transfer of the file may have saved its manifest again since this one completed
+        std::remove(ManifestPath(mFilename).c_str());
+      }
+    }
+    return mIsCommitSucceeded;
+  }
+
+  // End of the received run of bytes starting at offset
+  uint64_t ContiguousEnd(uint64_t offset)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mReceived.ContiguousEnd(offset);
+  }
+
+  // Flushes the received data and records it in the manifest. Blocks on the disk, so runs in the disk stage. Does nothing for complete or non-resumable transfers.
+  void SaveManifest()
+  {
+    std::lock_guard<std::mutex> saveLock(mSaveMutex);
+    filetransfer::UploadManifest manifest;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (!mIsResumable || mIsComplete)
+      {
+        return;
+      }
+      manifest.set_filename(mFilename);
+      manifest.set_filesize(mSize);
+      manifest.set_file_hash(mFileHash);
+      manifest.set_file_mtime(mFileMtime);
+      for (const auto &range : mReceived.Ranges())
+      {
+        filetransfer::ByteRange *received = manifest.add_received();
+        received->set_offset(range.first);
+        received->set_length(range.second - range.first);
+      }
+    }
+    // A later transfer of the file may have completed and renamed the part file away since (this one's session was
+    // interrupted, and the last save runs when the disk stage gets to it). The manifest would then describe a file
+    // that no longer exists.
+    struct stat fileStat;
+    struct stat partStat;
+    if (::fstat(mpFile->Get(), &fileStat) != 0 || ::stat(PartPath(mFilename).c_str(), &partStat) != 0 ||
+        fileStat.st_dev != partStat.st_dev || fileStat.st_ino != partStat.st_ino)
+    {
+      return;
+    }
+    // The manifest must never claim bytes that aren't on disk yet
+    if (::fdatasync(mpFile->Get()) != 0 || !StoreManifest(ManifestPath(mFilename), manifest))
+    {
+      LOG_ERROR("Manifest couldn't be saved: " << mFilename);
+    }
+  }
+
+private:
+  using Waiter = std::pair<ba::any_io_executor, std::function<void()>>;
+
+  std::vector<Waiter> TakeWaitersIfComplete()
+  {
+    std::vector<Waiter> ready;
+    if (!mIsComplete && mReceived.Covers(0, mSize))
+    {
+      mIsComplete = true;
+      if (mIsResumable)
+      {
+        std::remove(ManifestPath(mFilename).c_str()); // Nothing left to resume
+      }
+    }
+    if (mIsComplete)
+    {
+      ready.swap(mWaiters);
+    }
+    return ready;
+  }
+
+  static void Notify(std::vector<Waiter> &ready)
+  {
+    for (auto &waiter : ready)
+    {
+      ba::post(waiter.first, std::move(waiter.second));
+    }
+  }
+
+  const std::string mId;
+  const std::string mFilename;
+  const uint64_t mSize;
+  const std::shared_ptr<FileDescriptor> mpFile;
+  std::mutex mMutex;
+  RangeSet mReceived;
+  bool mIsComplete{false};
+  std::vector<Waiter> mWaiters;
+  bool mIsResumable{false};
+  uint32_t mFileHash{0};
+  uint64_t mFileMtime{0};
+  uint64_t mManifestInterval{0};
+  uint64_t mUnsavedBytes{0};
+  std::mutex mSaveMutex;
+  bool mIsChecksumExpected{false};
+  uint32_t mExpectedChecksum{0};
+  std::mutex mVerifyMutex;
+  bool mIsVerified{false};
+  bool mIsChecksumMatched{false};
+  std::mutex mCommitMutex;
+  bool mIsCommitted{false};
+  bool mIsCommitSucceeded{false};
+};
+
+// Transfers by ID, so that the connections of a parallel upload find the same target file.
+// Entries are weak: a transfer goes away with the last session using it.
+class TransferRegistry
+{
+public:
+  // The last save of a released transfer's manifest runs on pDiskWriter, or on the releasing thread without one
+  explicit TransferRegistry(uint64_t manifestInterval = 64ULL << 20, DiskWriter *pDiskWriter = nullptr)
+      : mManifestInterval(manifestInterval), mpDiskWriter(pDiskWriter)
+  {
+  }
+
+  // Returns the transfer registered under id, or opens the file's part file and registers a new one.
+  // An empty id is a single-connection transfer that isn't registered. With resume set, a new transfer continues
+  // from the file's manifest if its size, hash and modification time match, otherwise the file starts over empty;
+  // a continued transfer is checked against fileChecksum once complete.
+  // Returns nullptr with error set on failure.
+  std::shared_ptr<Transfer> Open(const std::string &id, const std::string &filename, uint64_t size,
+                                 bool resume, uint32_t fileHash, uint64_t fileMtime, uint32_t fileChecksum,
+                                 std::string &error)
+  {
+    // Every path below is built from the filename
+    if (!IsPlainFilename(filename))
+    {
+      error = "Invalid filename";
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!id.empty())
+    {
+      auto it = mTransfers.find(id);
+      if (it != mTransfers.end())
+      {
+        if (auto transfer = it->second.lock())
+        {
+          if (transfer->Filename() != filename || transfer->Size() != size)
+          {
+            error = "Transfer ID is in use for another file";
+            return nullptr;
+          }
+          return transfer;
+        }
+        mTransfers.erase(it);
+      }
+    }
+
+    const std::string partPath = PartPath(filename);
+    const std::string manifestPath = ManifestPath(filename);
+    RangeSet received;
+    filetransfer::UploadManifest manifest;
+    bool isResuming = resume && LoadManifest(manifestPath, manifest) && manifest.filename() == filename &&
+                      manifest.filesize() == size && manifest.file_hash() == fileHash &&
+                      manifest.file_mtime() == fileMtime;
+    // Read back too, to verify a resumed file. The part file has to be there still to continue it.
+    int fd = isResuming ? ::open(partPath.c_str(), O_RDWR | O_CLOEXEC) : -1;
+    isResuming = fd >= 0;
+    if (isResuming)
+    {
+      for (const auto &range : manifest.received())
+      {
+        received.Add(range.offset(), std::min(range.offset() + range.length(), size));
+      }
+    }
+    else
+    {
+      std::remove(manifestPath.c_str()); // Stale, describes another file or a part file that's gone
+      fd = ::open(partPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd < 0)
+    {
+      error = "File couldn't be open";
+      return nullptr;
+    }
+    // Whichever io thread drops the last reference, the two fdatasyncs of the final save run in the disk stage
+    DiskWriter *pDiskWriter = mpDiskWriter;
+    std::shared_ptr<Transfer> transfer(new Transfer(id, filename, size, std::make_shared<FileDescriptor>(fd)),
+                                       [pDiskWriter](Transfer *pTransfer) {
+                                         auto release = [pTransfer]() {
+                                           pTransfer->SaveManifest();
+                                           delete pTransfer;
+                                         };
+                                         if (pDiskWriter)
+                                         {
+                                           pDiskWriter->Post(release);
+                                         }
+                                         else
+                                         {
+                                           release();
+                                         }
+                                       });
+    if (resume)
+    {
+      transfer->EnableManifest(fileHash, fileMtime, mManifestInterval, received);
+    }
+    if (isResuming)
+    {
+      transfer->ExpectChecksum(fileChecksum);
+    }
+    if (!id.empty())
+    {
+      mTransfers[id] = transfer;
+    }
+    return transfer;
+  }
+
+private:
+  const uint64_t mManifestInterval;
+  DiskWriter *const mpDiskWriter;
+  std::mutex mMutex;
+  std::unordered_map<std::string, std::weak_ptr<Transfer>> mTransfers;
+};
+
+#endif // FILETRANSFER_TRANSFER_REGISTRY_H_
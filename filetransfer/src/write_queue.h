@@ -0,0 +1,236 @@
+#ifndef FILETRANSFER_WRITE_QUEUE_H_
+#define FILETRANSFER_WRITE_QUEUE_H_
+
+// Outgoing frames of one connection. Exactly one write is outstanding on the socket at a time; frames queued
+// meanwhile go out together in the next write as a single gather write (one writev), so a burst of pipelined
+// chunks or acks costs one syscall instead of one per frame. Not thread safe, all calls must come from the
+// socket's executor (the session strand on the server, the io_context thread on the client).
+// SocketT is the connection's socket type, the queue's own writes and posts allocate through AllocatorT.
+
+#include "common.h"
+#include "zero_copy.h"
+#include <iterator>
+
+template <typename SocketT, typename AllocatorT = std::allocator<void>>
+class BasicWriteQueue : public std::enable_shared_from_this<BasicWriteQueue<SocketT, AllocatorT>>
+{
+public:
+  using HandlerT = std::function<void(const boost::system::error_code &, size_t)>;
+
+  // A gather write takes at most maxBatchFrames frames and stops adding frames once it holds maxBatchBytes
+  explicit BasicWriteQueue(std::shared_ptr<SocketT> socket, const AllocatorT &allocator = AllocatorT(),
+                           size_t maxBatchFrames = 64, size_t maxBatchBytes = 4 * 1024 * 1024)
+      : mSocket(std::move(socket)), mAllocator(allocator), mMaxBatchFrames(std::max<size_t>(maxBatchFrames, 1)),
+        mMaxBatchBytes(maxBatchBytes)
+  {
+  }
+
+  BasicWriteQueue(const BasicWriteQueue &) = delete;
+  BasicWriteQueue &operator=(const BasicWriteQueue &) = delete;
+
+  // Queues message as a frame of the given version. handler, if any, runs once it has been written or with the
+  // error that stopped the queue; pOwner is kept alive until then, so a handler can capture a bare pointer to it
+  // and still fit in std::function without allocating. Must be called from the socket's executor.
+  template <typename T>
+  void Push(const T &message, HandlerT handler, uint8_t version = PROTOCOL_VERSION_MIN,
+            std::shared_ptr<void> pOwner = nullptr)
+  {
+    Entry entry{AcquireFrame(), std::move(handler), std::move(pOwner)};
+    const bool isSerialized = SerializeFrame(message, *entry.mpFrame, 0, version);
+    Enqueue(std::move(entry), isSerialized);
+  }
+
+#if FILETRANSFER_HAS_ZERO_COPY
+  // Queues message as a raw data frame descriptor followed by length bytes of fd, sent with sendfile. The
+  // descriptor still goes out in a gather write with the frames before it; the batch ends with the file data.
+  template <typename T>
+  void PushWithFileData(const T &message, int fd, uint64_t offset, size_t length, HandlerT handler,
+                        uint8_t version = PROTOCOL_VERSION_MIN, std::shared_ptr<void> pOwner = nullptr)
+  {
+    Entry entry{AcquireFrame(), std::move(handler), std::move(pOwner)};
+    const bool isSerialized = SerializeFrame(message, *entry.mpFrame, FRAME_FLAG_RAW_DATA, version);
+    entry.mFd = fd;
+    entry.mFileOffset = offset;
+    entry.mFileLength = length;
+    Enqueue(std::move(entry), isSerialized);
+  }
+#endif
+
+  // Frames written so far and the socket writes they took
+  uint64_t WrittenFrames() const { return mWrittenFrames; }
+  uint64_t Writes() const { return mWrites; }
+
+private:
+  struct Entry
+  {
+    std::unique_ptr<OutboundFrame> mpFrame;
+    HandlerT mHandler;
+    std::shared_ptr<void> mpOwner; // Of the handler, kept alive until it has run
+    int mFd{-1};
+    uint64_t mFileOffset{0};
+    size_t mFileLength{0};
+
+    size_t FrameBytes() const { return sizeof(ProtocolHeader) + mpFrame->mSerializedData.length(); }
+  };
+
+  // Buffer sequence over the frames of the write in progress. async_write keeps a copy of the sequence it is
+  // given, a view avoids copying the buffer vector with every write.
+  struct BufferView
+  {
+    using value_type = ba::const_buffer;
+    using const_iterator = const ba::const_buffer *;
+
+    const_iterator begin() const { return mBegin; }
+    const_iterator end() const { return mEnd; }
+
+    const_iterator mBegin;
+    const_iterator mEnd;
+  };
+
+  // Frames are recycled once written, their buffers keep the capacity of the largest message they carried
+  std::unique_ptr<OutboundFrame> AcquireFrame()
+  {
+    if (mFreeFrames.empty())
+    {
+      return std::make_unique<OutboundFrame>();
+    }
+    std::unique_ptr<OutboundFrame> pFrame = std::move(mFreeFrames.back());
+    mFreeFrames.pop_back();
+    return pFrame;
+  }
+
+  void ReleaseFrame(std::unique_ptr<OutboundFrame> pFrame)
+  {
+    if (mFreeFrames.size() < mMaxBatchFrames)
+    {
+      mFreeFrames.push_back(std::move(pFrame));
+    }
+  }
+
+  void Enqueue(Entry entry, bool isSerialized)
+  {
+    if (!isSerialized)
+    {
+      Fail(std::move(entry), boost::system::errc::make_error_code(boost::system::errc::no_message));
+      return;
+    }
+    if (mError)
+    {
+      Fail(std::move(entry), mError);
+      return;
+    }
+    mQueue.push_back(std::move(entry));
+    if (!mIsWriting)
+    {
+      // Flushing from a fresh handler lets everything the caller queues in its current handler (a window of
+      // chunks, a burst of acks) go out in the same write
+      mIsWriting = true;
+      ba::post(mSocket->get_executor(), BindAllocator(mAllocator, [self = this->shared_from_this()]() { self->Flush(); }));
+    }
+  }
+
+  void Fail(Entry entry, boost::system::error_code error)
+  {
+    ReleaseFrame(std::move(entry.mpFrame));
+    if (entry.mHandler)
+    {
+      ba::post(mSocket->get_executor(),
+               BindAllocator(mAllocator, [handler = std::move(entry.mHandler), pOwner = std::move(entry.mpOwner), error]()
+                             { handler(error, 0); }));
+    }
+  }
+
+  // Moves as many queued frames as the batch limits allow into one gather write, mIsWriting is already set
+  void Flush()
+  {
+    mBatch.clear();
+    mBuffers.clear();
+    size_t batchBytes = 0;
+    size_t taken = 0;
+    while (taken < mQueue.size() && taken < mMaxBatchFrames && (taken == 0 || batchBytes < mMaxBatchBytes))
+    {
+      const Entry &entry = mQueue[taken++];
+      mBuffers.push_back(ba::buffer(&entry.mpFrame->mHeader, sizeof(ProtocolHeader)));
+      mBuffers.push_back(ba::buffer(entry.mpFrame->mSerializedData));
+      batchBytes += entry.FrameBytes();
+      if (entry.mFd >= 0)
+      {
+        break; // Its file data has to follow right after it
+      }
+    }
+    std::move(mQueue.begin(), mQueue.begin() + taken, std::back_inserter(mBatch));
+    mQueue.erase(mQueue.begin(), mQueue.begin() + taken);
+
+    ++mWrites;
+    ba::async_write(*mSocket, BufferView{mBuffers.data(), mBuffers.data() + mBuffers.size()},
+                    BindAllocator(mAllocator, [self = this->shared_from_this()](const boost::system::error_code &error, size_t)
+                                  { self->HandleWrite(error); }));
+  }
+
+  void HandleWrite(const boost::system::error_code &error)
+  {
+#if FILETRANSFER_HAS_ZERO_COPY
+    const Entry &last = mBatch.back();
+    if (!error && last.mFd >= 0 && last.mFileLength > 0)
+    {
+      AsyncSendFile(mSocket, last.mFd, last.mFileOffset, last.mFileLength,
+                    [self = this->shared_from_this()](const boost::system::error_code &sendError, size_t)
+                    { self->CompleteBatch(sendError); });
+      return;
+    }
+#endif
+    CompleteBatch(error);
+  }
+
+  void CompleteBatch(const boost::system::error_code &error)
+  {
+    // Handlers queueing new frames only add to the queue here, they all go out together in the next write
+    std::vector<Entry> batch;
+    batch.swap(mBatch);
+    mWrittenFrames += error ? 0 : batch.size();
+    for (Entry &entry : batch)
+    {
+      const size_t bytes = error ? 0 : entry.FrameBytes() + entry.mFileLength;
+      ReleaseFrame(std::move(entry.mpFrame));
+      if (entry.mHandler)
+      {
+        entry.mHandler(error, bytes);
+      }
+      entry.mpOwner.reset();
+    }
+    batch.clear();
+    mBatch.swap(batch); // Keep the capacity for the next batch
+
+    if (error)
+    {
+      // The stream is broken mid-frame, nothing queued behind it can be delivered
+      mError = error;
+      for (Entry &entry : mQueue)
+      {
+        Fail(std::move(entry), error);
+      }
+      mQueue.clear();
+    }
+    if (mQueue.empty())
+    {
+      mIsWriting = false;
+      return;
+    }
+    Flush();
+  }
+
+  std::shared_ptr<SocketT> mSocket;
+  AllocatorT mAllocator;
+  size_t mMaxBatchFrames;
+  size_t mMaxBatchBytes;
+  std::vector<Entry> mQueue;
+  std::vector<Entry> mBatch;               // Frames of the write in progress
+  std::vector<ba::const_buffer> mBuffers;  // Their headers and payloads
+  std::vector<std::unique_ptr<OutboundFrame>> mFreeFrames;
+  bool mIsWriting{false}; // A write is in progress or a flush is scheduled
+  boost::system::error_code mError;
+  uint64_t mWrittenFrames{0};
+  uint64_t mWrites{0};
+};
+
+#endif // FILETRANSFER_WRITE_QUEUE_H_
@@ -0,0 +1,202 @@
+#ifndef FILETRANSFER_ZERO_COPY_H_
+#define FILETRANSFER_ZERO_COPY_H_
+
+// Raw data frames: file bytes go from the file descriptor to the socket with sendfile on the sending side,
+// and socket -> pipe -> file with splice on the receiving side, without passing through user space.
+
+#include "common.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#define FILETRANSFER_HAS_ZERO_COPY 1
+#else
+#define FILETRANSFER_HAS_ZERO_COPY 0
+#endif
+
+#if FILETRANSFER_HAS_ZERO_COPY
+
+// Sends length bytes of fd starting at offset with sendfile, waiting for writability whenever the socket buffer is full
+template <typename SocketT>
+void AsyncSendFile(std::shared_ptr<SocketT> socket, int fd, uint64_t offset, size_t length,
+                   std::function<void(const boost::system::error_code &, size_t)> handler, size_t sent = 0)
+{
+  boost::system::error_code error;
+  socket->native_non_blocking(true, error);
+  while (!error && sent < length)
+  {
+    off_t fileOffset = static_cast<off_t>(offset + sent);
+    ssize_t n = ::sendfile(socket->native_handle(), fd, &fileOffset, length - sent);
+    if (n > 0)
+    {
+      sent += n;
+    }
+    else if (n == 0)
+    {
+      error = ba::error::eof; // File is shorter than announced
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      socket->async_wait(SocketT::wait_write,
+                         [socket, fd, offset, length, handler, sent](const boost::system::error_code &waitError)
+                         {
+                           if (waitError)
+                           {
+                             handler(waitError, sent);
+                             return;
+                           }
+                           AsyncSendFile(socket, fd, offset, length, handler, sent);
+                         });
+      return;
+    }
+    else if (errno != EINTR)
+    {
+      error = boost::system::error_code(errno, boost::system::system_category());
+    }
+  }
+
+  ba::post(socket->get_executor(), [handler, error, sent]()
+           { handler(error, sent); });
+}
+
+// Pipe used as the in-kernel buffer between the socket and the output file
+class SplicePipe
+{
+public:
+  SplicePipe() = default;
+  SplicePipe(const SplicePipe &) = delete;
+  SplicePipe &operator=(const SplicePipe &) = delete;
+  ~SplicePipe()
+  {
+    if (mFds[0] >= 0)
+    {
+      ::close(mFds[0]);
+      ::close(mFds[1]);
+    }
+  }
+
+  bool Open(size_t desiredCapacity)
+  {
+    if (mFds[0] >= 0)
+    {
+      return true;
+    }
+    if (::pipe2(mFds, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+      mFds[0] = mFds[1] = -1;
+      return false;
+    }
+    // Best effort, limited by /proc/sys/fs/pipe-max-size for unprivileged processes
+    ::fcntl(mFds[1], F_SETPIPE_SZ, static_cast<int>(desiredCapacity));
+    int capacity = ::fcntl(mFds[1], F_GETPIPE_SZ);
+    mCapacity = capacity > 0 ? static_cast<size_t>(capacity) : 64 * 1024;
+    return true;
+  }
+
+  int ReadFd() const { return mFds[0]; }
+  int WriteFd() const { return mFds[1]; }
+  size_t Capacity() const { return mCapacity; }
+
+private:
+  int mFds[2]{-1, -1};
+  size_t mCapacity{0};
+};
+
+// Moves length bytes out of the pipe into fd at offset, blocking on the file
+inline boost::system::error_code DrainPipeToFile(const SplicePipe &pipe, int fd, uint64_t offset, size_t length)
+{
+  while (length > 0)
+  {
+    loff_t fileOffset = static_cast<loff_t>(offset);
+    ssize_t n = ::splice(pipe.ReadFd(), nullptr, fd, &fileOffset, length, SPLICE_F_MOVE);
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      return n < 0 ? boost::system::error_code(errno, boost::system::system_category())
+                   : boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    length -= n;
+    offset += n;
+  }
+  return boost::system::error_code();
+}
+
+// Empties the pipe into the file somewhere else (e.g. a disk I/O thread) and calls done when finished
+using SpliceDrainT = std::function<void(size_t length, uint64_t fileOffset,
+                                        std::function<void(const boost::system::error_code &)> done)>;
+
+// Moves length bytes from the socket into fd at offset through the pipe, waiting for readability whenever the
+// socket has no data. Each time the pipe is filled it is emptied into the file, inline with DrainPipeToFile or
+// through drain if given. The pipe must be empty when called and is empty again on successful completion.
+template <typename SocketT>
+void AsyncSpliceToFile(std::shared_ptr<SocketT> socket, SplicePipe &pipe, int fd, uint64_t offset,
+                       size_t length, std::function<void(const boost::system::error_code &, size_t)> handler,
+                       SpliceDrainT drain = nullptr, size_t written = 0)
+{
+  boost::system::error_code error;
+  socket->native_non_blocking(true, error);
+  while (!error && written < length)
+  {
+    ssize_t moved = ::splice(socket->native_handle(), nullptr, pipe.WriteFd(), nullptr,
+                             std::min(length - written, pipe.Capacity()), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved == 0)
+    {
+      error = ba::error::eof;
+      break;
+    }
+    if (moved < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        socket->async_wait(SocketT::wait_read,
+                           [socket, &pipe, fd, offset, length, handler, drain, written](const boost::system::error_code &waitError)
+                           {
+                             if (waitError)
+                             {
+                               handler(waitError, written);
+                               return;
+                             }
+                             AsyncSpliceToFile(socket, pipe, fd, offset, length, handler, drain, written);
+                           });
+        return;
+      }
+      if (errno != EINTR)
+      {
+        error = boost::system::error_code(errno, boost::system::system_category());
+      }
+      continue;
+    }
+
+    // Drain what just entered the pipe into the file, so the pipe is empty whenever we wait on the socket
+    if (drain)
+    {
+      const size_t inPipe = static_cast<size_t>(moved);
+      drain(inPipe, offset + written, [socket, &pipe, fd, offset, length, handler, drain, written, inPipe](const boost::system::error_code &drainError)
+            {
+              if (drainError)
+              {
+                handler(drainError, written);
+                return;
+              }
+              AsyncSpliceToFile(socket, pipe, fd, offset, length, handler, drain, written + inPipe);
+            });
+      return;
+    }
+    error = DrainPipeToFile(pipe, fd, offset + written, moved);
+    if (!error)
+    {
+      written += moved;
+    }
+  }
+
+  ba::post(socket->get_executor(), [handler, error, written]()
+           { handler(error, written); });
+}
+
+#endif // FILETRANSFER_HAS_ZERO_COPY
+
+#endif // FILETRANSFER_ZERO_COPY_H_